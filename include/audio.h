@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <chip8.h>
+
+#define AUDIO_SAMPLE_RATE 44100 //in samples per second (mono, signed 16-bit)
+
+/* where the samples go: the sound card, a WAV file, or nowhere (headless and CI runs: the null backend consumes
+samples at AUDIO_SAMPLE_RATE like a sound card would, so it can also drive the emulation speed);
+every backend consumes samples on its own thread, the emulator thread never waits for it */
+typedef enum {
+    AUDIO_BACKEND_NULL,
+    AUDIO_BACKEND_NATIVE,
+    AUDIO_BACKEND_WAV
+} AudioBackend;
+
+//wavFilepath is only used by AUDIO_BACKEND_WAV; returns 0 on success
+int audioInit(AudioBackend backend, const char* wavFilepath);
+//called by the emulator thread once per emulated frame: queues one frame of the machine's sound output (never blocks)
+void audioGenerateFrame(const Chip8State* machine);
+void audioTerminate(void);
+
+//number of samples generated and not consumed by the backend yet
+size_t audioGetBufferedSamples(void);
+/* dynamic rate control: when enabled, audioGenerateFrame stretches or shrinks each frame's samples by up to 0.5%
+(an inaudible pitch change) so that the number of buffered samples converges to targetSamples */
+void audioSetRateControl(bool enabled, size_t targetSamples);
@@ -1,9 +1,95 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+//low resolution (CHIP-8) and high resolution (SUPER-CHIP 00FF) display sizes
 #define CHIP8_DISPLAY_WIDTH 64
 #define CHIP8_DISPLAY_HEIGHT 32
+#define CHIP8_HIRES_DISPLAY_WIDTH 128
+#define CHIP8_HIRES_DISPLAY_HEIGHT 64
+
+//the screen is made of CHIP8_HIRES_DISPLAY_HEIGHT rows of CHIP8_SCREEN_ROW_WORDS 64-bit words
+#define CHIP8_SCREEN_ROW_WORDS 2
+//per plane: XO-CHIP draws to up to 4 bitplanes (FN01), a pixel's color is the palette entry indexed by its plane bits
+#define CHIP8_MAX_PLANES 4
+#define CHIP8_PLANE_WORDS (CHIP8_HIRES_DISPLAY_HEIGHT * CHIP8_SCREEN_ROW_WORDS)
+
+//the 16 built-in hexadecimal digit sprites, 4x5 pixels (5 bytes each, the leftmost pixel being bit 7)
+extern const uint8_t fontData[80];
+
+//a complete CHIP-8 machine (registers, screen and RAM); its layout is private to the CHIP-8 core
+typedef struct Chip8State Chip8State;
+//an immutable ROM image, loaded once per process and shared by every machine created from it
+typedef struct Chip8Rom Chip8Rom;
+
+/* platform whose behavior the interpreter reproduces where CHIP-8 implementations disagree (VF reset by 8XY1/2/3,
+I increment by FX55/FX65, 8XY6/8XYE source register, BNNN register, sprite clipping, display wait) */
+typedef enum {
+    CHIP8_PROFILE_DEFAULT, //the behavior this interpreter always had
+    CHIP8_PROFILE_VIP,
+    CHIP8_PROFILE_SCHIP,
+    CHIP8_PROFILE_XOCHIP,
+    CHIP8_PROFILE_COUNT
+} Chip8Profile;
+
+//how many instructions run in a frame
+typedef enum {
+    CHIP8_TIMING_FIXED, //the same number of instructions every frame, whatever they are
+    CHIP8_TIMING_VIP, //COSMAC VIP machine cycles: each instruction costs what it cost on the VIP (VIP profile only)
+    CHIP8_TIMING_COUNT
+} Chip8Timing;
 
 int chip8Init(const char* filepath);
-bool (*getChip8Screen(void))[CHIP8_DISPLAY_WIDTH];
-void chip8UpdateKeypadState(bool keys[16]);
-int chip8Update(void);
\ No newline at end of file
+/* pixel (x, y) of plane p is bit 63-(x%64) of word p*CHIP8_PLANE_WORDS + y*CHIP8_SCREEN_ROW_WORDS + x/64; in low
+resolution only the first word of the first CHIP8_DISPLAY_HEIGHT rows is used */
+const uint64_t* getChip8Screen(void);
+//bit k of keys is set when key k is pressed
+void chip8UpdateKeypadState(uint16_t keys);
+int chip8Update(void);
+int chip8UpdateSlice(int slice, int nbOfSlices);
+
+//set when the screen of the machine driven by chip8Update changed since it was last presented
+bool chip8DidScreenChange(void);
+void chip8SetScreenChanged(bool);
+
+/* multi-instance API: chip8GetMachine returns the machine driven by the functions above, chip8CreateMachine
+returns a new machine running a ROM loaded with chip8LoadRom, and chip8Fork an independent copy of any machine
+(RAM is shared copy-on-write); created and forked machines must be released with chip8Free */
+Chip8State* chip8GetMachine(void);
+const Chip8Rom* chip8LoadRom(const char* filepath);
+Chip8State* chip8CreateMachine(const Chip8Rom* rom);
+Chip8State* chip8Fork(const Chip8State* machine);
+//copies the state of source into an existing machine (a snapshot restore that allocates nothing)
+void chip8CopyMachine(Chip8State* destination, const Chip8State* source);
+void chip8Free(Chip8State* machine);
+int chip8RunFrame(Chip8State* machine);
+/* runs slice `slice` (from 0 to nbOfSlices-1) of the machine's current frame: its share of the frame's instructions
+(or VIP cycles), the timers ticking after the last slice; chip8RunFrame(machine) is chip8RunFrameSlice(machine, 0, 1) */
+int chip8RunFrameSlice(Chip8State* machine, int slice, int nbOfSlices);
+void chip8SetProfile(Chip8State* machine, Chip8Profile profile);
+int chip8ProfileFromName(const char* name);
+//returns 0 on success, 1 if the timing model is not available for the machine's profile
+int chip8SetTiming(Chip8State* machine, Chip8Timing timing);
+void chip8SetKeypad(Chip8State* machine, uint16_t keys);
+const uint64_t* chip8GetScreen(const Chip8State* machine);
+void chip8GetScreenSize(const Chip8State* machine, int* width, int* height);
+//number of planes of chip8GetScreen holding the display (1 unless an XO-CHIP program selected more planes)
+int chip8GetPlaneCount(const Chip8State* machine);
+//instructions executed by the machine since it was created (copied by chip8Fork and chip8CopyMachine)
+uint64_t chip8GetInstructionCount(const Chip8State* machine);
+
+//how much a machine's program modified its own code, tracked per line of 64 bytes of memory
+typedef struct {
+    uint64_t codeWrites; //writes (FX33, FX55, 5XY2) that changed a byte of an executed line or of translated code
+    uint32_t executedLines; //lines the interpreter ran instructions from
+    uint32_t modifiedLines; //executed lines written to
+    bool translated; //a translation of the ROM for the machine's profile is linked in
+    bool translationDropped; //and the program wrote over it (it is interpreted since)
+} Chip8CodeWriteStats;
+void chip8GetCodeWriteStats(const Chip8State* machine, Chip8CodeWriteStats* stats);
+//the buzzer sounds while the sound timer is not 0
+bool chip8IsSoundOn(const Chip8State* machine);
+/* returns the XO-CHIP 1-bit audio pattern (16 bytes, most significant bit first) loaded by F002 and sets *pitch (FX3A),
+or returns NULL when the machine plays the plain CHIP-8 buzzer */
+const uint8_t* chip8GetAudioPattern(const Chip8State* machine, int* pitch);
@@ -0,0 +1,78 @@
+#pragma once
+
+/* static analysis of CHIP-8 programs, shared by the tools that translate or inspect a ROM: the control flow of an
+instruction, the code reachable from the entry point found by recursive descent (every statically known
+successor is followed; the targets of 00EE are only known at run time, and those of BNNN are guessed from the
+jump table it usually points to), and the basic blocks of that code */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chip8_internal.h>
+
+#define CHIP8_MAX_SUCCESSORS 2
+
+typedef enum {
+    CHIP8_FLOW_NEXT, //the next instruction
+    CHIP8_FLOW_JUMP, //1NNN
+    CHIP8_FLOW_CALL, //2NNN: its target, then the next instruction once it returns
+    CHIP8_FLOW_SKIP, //3XNN, 4XNN, 5XY0, 9XY0, EX9E, EXA1: the next instruction or the one after
+    CHIP8_FLOW_RETURN, //00EE
+    CHIP8_FLOW_INDIRECT, //BNNN
+    CHIP8_FLOW_STOP //00FD (SUPER-CHIP): the program stays on it
+} Chip8Flow;
+
+typedef struct {
+    Chip8Instruction instruction;
+    uint16_t opcode; //its first two bytes
+    uint16_t longAddress; //NNNN of F000 NNNN
+    uint16_t address;
+    uint8_t length; //in bytes: 4 for F000 NNNN (XO-CHIP), 2 otherwise
+    uint8_t flow; //Chip8Flow
+    uint8_t successorCount; //statically known successors
+    uint16_t successors[CHIP8_MAX_SUCCESSORS]; //in execution order (a call's target comes before its return address)
+} Chip8InstructionInfo;
+
+//flags of an address in Chip8CodeAnalysis
+#define CHIP8_CODE_INSTRUCTION 0x1 //a reachable instruction starts here
+#define CHIP8_CODE_LEADER 0x2 //and starts a basic block (the entry point, a jump, call or skip target, a return address)
+#define CHIP8_CODE_BYTE 0x4 //the byte belongs to a reachable instruction
+#define CHIP8_CODE_TABLE 0x8 //the instruction is an entry of a BNNN jump table
+
+/* a jump table is a run of 1NNN at the base address of a BNNN (entries are 2 bytes apart, the offset register
+selecting one): the entries are taken as successors of the BNNN, which finds the code behind most computed jumps */
+#define CHIP8_MAX_JUMP_TABLE_ENTRIES 128
+
+typedef struct {
+    uint16_t start; //address of its first instruction (a leader)
+    uint16_t last; //address of its last instruction, whose flow ends the block
+    uint16_t end; //first address past its last instruction
+    uint16_t instructionCount;
+} Chip8BasicBlock;
+
+typedef struct {
+    const Chip8Rom* rom;
+    Chip8Profile profile;
+    uint32_t memorySize; //addresses of the profile's machines (4 KB, 64 KB for XO-CHIP)
+    uint32_t programEnd; //first address past the program: the descent stays in [STARTING_MEMORY_ADDRESS, programEnd)
+    uint8_t* flags; //memorySize CHIP8_CODE_ flags
+    uint32_t instructionCount; //reachable instructions
+    Chip8BasicBlock* blocks; //the basic blocks of the reachable code, by address
+    uint32_t blockCount;
+} Chip8CodeAnalysis;
+
+//decodes the instruction at address of the initial memory of rom and finds its static successors
+Chip8InstructionInfo chip8AnalyzeInstruction(const Chip8Rom* rom, Chip8Profile profile, uint16_t address);
+//returns 0 on success; the analysis must be released with chip8FreeCodeAnalysis
+int chip8AnalyzeCode(const Chip8Rom* rom, Chip8Profile profile, Chip8CodeAnalysis* analysis);
+void chip8FreeCodeAnalysis(Chip8CodeAnalysis* analysis);
+//number of entries of the jump table at base (0: base does not start a jump table)
+uint32_t chip8JumpTableLength(const Chip8CodeAnalysis* analysis, uint16_t base);
+//returns the basic block starting at address, NULL if address is not a leader
+const Chip8BasicBlock* chip8FindBasicBlock(const Chip8CodeAnalysis* analysis, uint16_t address);
+//writes the assembly of an instruction (e.g. "ADD V1, 0x02") into buffer
+void chip8FormatInstruction(const Chip8InstructionInfo* info, char* buffer, size_t size);
+/* finds the counted loops (see Chip8CountedLoop) of the size decoded instructions of an image, by address; returns
+NULL if there is none (or if the array could not be allocated) */
+Chip8CountedLoop* chip8FindCountedLoops(const Chip8Instruction* decoded, uint32_t size, uint32_t* count);
@@ -0,0 +1,65 @@
+#pragma once
+
+/* contract between the CHIP-8 core and the C translations of ROMs written by the static recompiler (tools/recompiler.c):
+a translation registers its Chip8CompiledProgram before main runs, and the machines whose ROM and profile match it
+run the translation instead of the interpreter (fixed timing only), until the program writes over its own code */
+
+#include <stdint.h>
+
+#include <chip8_internal.h>
+
+//bumped whenever the generated code or this contract changes: translations of another version are not used
+#define CHIP8_COMPILED_VERSION 1
+
+typedef struct Chip8CompiledProgram {
+    uint64_t romHash; //Chip8Rom hash of the translated ROM
+    uint8_t profile; //Chip8Profile the translation reproduces
+    uint32_t version; //CHIP8_COMPILED_VERSION of the recompiler
+    const uint8_t* codeMap; //bit a%8 of codeMap[a/8] set: byte a of memory belongs to a translated instruction
+    //same contract as the interpreters: runs nbOfInstructions instructions, returns 1 on error
+    int (*run)(Chip8State* s, int nbOfInstructions);
+    struct Chip8CompiledProgram* next;
+} Chip8CompiledProgram;
+
+void chip8RegisterCompiledProgram(Chip8CompiledProgram* program);
+//runs nbOfInstructions instructions of machine s with the interpreter of its profile
+int chip8InterpretInstructions(Chip8State* s, int nbOfInstructions);
+
+
+/* helpers of the generated run functions, whose locals are s (the machine) and budget (instructions left to run),
+and which resume at s->PC from their dispatch label */
+
+//starts the translated instruction at address, or leaves if the budget is spent
+#define CHIP8_COMPILED_BEGIN(address) \
+    if (budget == 0) { \
+        s->PC = (address); \
+        return 0; \
+    } \
+    budget--; \
+    s->instructionCount++
+
+/* runs the instruction at address with the interpreter (the ones with complex effects: display, memory, input,
+random numbers), then resumes at the PC it left; the rest of the budget is interpreted if the frame ended (display
+wait) or if the instruction wrote over translated code */
+#define CHIP8_COMPILED_INTERPRET(address) \
+    do { \
+        s->PC = (address); \
+        if (budget == 0) \
+            return 0; \
+        budget--; \
+        if (chip8InterpretInstructions(s, 1) != 0) \
+            return 1; \
+        if (s->waitingForVblank) \
+            return 0; \
+        if (!s->compiled) \
+            return chip8InterpretInstructions(s, budget); \
+        goto dispatch; \
+    } while (0)
+
+//the translated instruction at address fails (stack overflow or underflow): the interpreter runs it again and reports it
+#define CHIP8_COMPILED_ERROR(address) \
+    do { \
+        s->PC = (address); \
+        s->instructionCount--; \
+        return chip8InterpretInstructions(s, 1); \
+    } while (0)
@@ -0,0 +1,215 @@
+#pragma once
+
+/* definitions shared by the modules of the CHIP-8 core (chip8.c, rom_registry.c): the machine layout,
+the copy-on-write RAM pages and the predecoded instruction format. Frontend modules only use chip8.h */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include <chip8.h>
+
+#define CHIP8_MEMORY_SIZE 4096 //in bytes
+#define CHIP8_ADDRESS_MASK (CHIP8_MEMORY_SIZE - 1)
+#define XOCHIP_MEMORY_SIZE 65536 //XO-CHIP machines address 64 KB
+#define XOCHIP_ADDRESS_MASK (XOCHIP_MEMORY_SIZE - 1)
+
+//RAM is split in pages shared between machines until one of them writes to it
+#define CHIP8_PAGE_SIZE 256 //in bytes
+#define CHIP8_PAGE_SHIFT 8
+#define CHIP8_PAGE_COUNT (CHIP8_MEMORY_SIZE / CHIP8_PAGE_SIZE)
+#define XOCHIP_PAGE_COUNT (XOCHIP_MEMORY_SIZE / CHIP8_PAGE_SIZE)
+
+/* self-modifying code is tracked per line of 64 bytes: a machine records the lines it fetched instructions from
+and the lines it wrote to (bit l%64 of word l/64 for line l) */
+#define CHIP8_LINE_SHIFT 6
+#define CHIP8_LINE_WORDS (XOCHIP_MEMORY_SIZE >> CHIP8_LINE_SHIFT >> 6)
+#define CHIP8_LINE_BIT(address) (1ULL << (((address) >> CHIP8_LINE_SHIFT) & 63))
+#define CHIP8_LINE_WORD(address) ((address) >> CHIP8_LINE_SHIFT >> 6)
+
+/* every guest memory read goes through this macro (and every write through writeMemory in chip8.c): addresses are masked
+to the machine's memory size (12 bits, 16 bits for XO-CHIP), so PC, I and I+k (FX33, FX55, FX65, DXYN) wrap around inside
+memory and can never read or write past it */
+#define READ_MEMORY(s, address) ((s)->pages[((address) & (s)->addressMask) >> CHIP8_PAGE_SHIFT]->bytes[(address) & (CHIP8_PAGE_SIZE - 1)])
+
+#define STARTING_MEMORY_ADDRESS 0x200
+#define FONT_DATA_POSITION 0x050
+#define BIG_FONT_DATA_POSITION 0x0A0 //SUPER-CHIP 8x10 digits, right after the 4x5 font
+#define STACK_SIZE 16 //number of shorts (16-bit values)
+
+extern const uint8_t bigFontData[160];
+
+typedef struct {
+    atomic_uint refCount; //number of machines (and ROM images) whose page table points to this page
+    uint32_t    generation; //unique tag of the page content, renewed on every write (used by the sprite cache)
+    uint8_t     bytes[CHIP8_PAGE_SIZE];
+} Chip8Page;
+
+//one value per distinct instruction, so that the interpreter dispatches with a single switch
+typedef enum {
+    CHIP8_OP_NOP, //0NNN (machine code routine) and undefined encodings, ignored
+    CHIP8_OP_CLS, //00E0
+    CHIP8_OP_RET, //00EE
+    CHIP8_OP_JP, //1NNN
+    CHIP8_OP_CALL, //2NNN
+    CHIP8_OP_SE_IMM, //3XNN
+    CHIP8_OP_SNE_IMM, //4XNN
+    CHIP8_OP_SE_REG, //5XY0
+    CHIP8_OP_LD_IMM, //6XNN
+    CHIP8_OP_ADD_IMM, //7XNN
+    CHIP8_OP_LD_REG, //8XY0
+    CHIP8_OP_OR, //8XY1
+    CHIP8_OP_AND, //8XY2
+    CHIP8_OP_XOR, //8XY3
+    CHIP8_OP_ADD_REG, //8XY4
+    CHIP8_OP_SUB, //8XY5
+    CHIP8_OP_SHR, //8XY6
+    CHIP8_OP_SUBN, //8XY7
+    CHIP8_OP_SHL, //8XYE
+    CHIP8_OP_SNE_REG, //9XY0
+    CHIP8_OP_LD_I, //ANNN
+    CHIP8_OP_JP_V0, //BNNN
+    CHIP8_OP_RND, //CXNN
+    CHIP8_OP_DRW, //DXYN
+    CHIP8_OP_SKP, //EX9E
+    CHIP8_OP_SKNP, //EXA1
+    CHIP8_OP_LD_VX_DT, //FX07
+    CHIP8_OP_LD_VX_K, //FX0A
+    CHIP8_OP_LD_DT_VX, //FX15
+    CHIP8_OP_LD_ST_VX, //FX18
+    CHIP8_OP_ADD_I, //FX1E
+    CHIP8_OP_LD_F, //FX29
+    CHIP8_OP_LD_B, //FX33
+    CHIP8_OP_LD_MEM_VX, //FX55
+    CHIP8_OP_LD_VX_MEM, //FX65
+    CHIP8_OP_SCD, //00CN (SUPER-CHIP)
+    CHIP8_OP_SCR, //00FB (SUPER-CHIP)
+    CHIP8_OP_SCL, //00FC (SUPER-CHIP)
+    CHIP8_OP_EXIT, //00FD (SUPER-CHIP)
+    CHIP8_OP_LOW, //00FE (SUPER-CHIP)
+    CHIP8_OP_HIGH, //00FF (SUPER-CHIP)
+    CHIP8_OP_LD_HF, //FX30 (SUPER-CHIP)
+    CHIP8_OP_LD_R_VX, //FX75 (SUPER-CHIP)
+    CHIP8_OP_LD_VX_R, //FX85 (SUPER-CHIP)
+    CHIP8_OP_SCU, //00DN (XO-CHIP)
+    CHIP8_OP_SAVE_RANGE, //5XY2 (XO-CHIP)
+    CHIP8_OP_LOAD_RANGE, //5XY3 (XO-CHIP)
+    CHIP8_OP_LD_I_LONG, //F000 NNNN (XO-CHIP), the only 4-byte instruction
+    CHIP8_OP_PLANE, //FN01 (XO-CHIP)
+    CHIP8_OP_AUDIO, //F002 (XO-CHIP)
+    CHIP8_OP_PITCH, //FX3A (XO-CHIP)
+    CHIP8_OP_COUNT
+} Chip8Operation;
+
+/* where the profiles disagree, the behavior of each profile's interpreter (the QUIRK_ and SUPPORTS_ macros of its
+instantiation in chip8.c), for the modules that analyze or translate a program for a given profile */
+typedef struct {
+    bool vfReset;
+    bool memoryIncrement;
+    bool shiftVx;
+    bool jumpVx;
+    bool clip;
+    bool displayWait;
+    bool schip;
+    bool xochip;
+} Chip8Quirks;
+extern const Chip8Quirks chip8ProfileQuirks[CHIP8_PROFILE_COUNT];
+
+typedef struct {
+    uint8_t  op; //Chip8Operation
+    uint8_t  x;
+    uint8_t  y;
+    uint8_t  n;
+    uint16_t nnn; //the low byte is nn
+} Chip8Instruction;
+
+typedef enum {
+    CHIP8_LOOP_TIMER_WAIT, //FX07, 3X00/4X00 (or any NN), 1<head>: spins until the delay timer reaches a value
+    CHIP8_LOOP_COUNT, //7XKK, 3XNN/4XNN, 1<head>: counts VX up (or down) to a value
+    CHIP8_LOOP_FILL //FX55 and FY1E (in either order), 7ZKK, 3ZNN/4ZNN, 1<head>: stores V0-VX over a range, Z > X and Z != Y
+} Chip8LoopKind;
+
+/* a loop of the ROM image whose iterations have no effect but on its registers, I and the memory it fills, so that
+any number of them can be run at once (chip8RunCountedLoop); its last instruction jumps back to head, and the
+conditional skip before it leaves the loop */
+typedef struct {
+    uint16_t head;
+    uint8_t kind; //Chip8LoopKind
+    uint8_t counter; //the register the skip tests
+    uint8_t step; //KK
+    uint8_t limit; //NN
+    bool exitWhenEqual; //3XNN: the loop ends once the counter equals limit, 4XNN: once it differs
+    bool storeFirst; //CHIP8_LOOP_FILL: FX55 comes before FY1E
+    uint8_t stored; //CHIP8_LOOP_FILL: X of FX55
+    uint8_t increment; //CHIP8_LOOP_FILL: Y of FY1E
+    uint8_t length; //instructions per iteration (3 or 5); the loop spans 2*length bytes
+} Chip8CountedLoop;
+
+/* an immutable ROM image registered once per process: the initial RAM pages (font and program) are shared by
+every machine created from it, and so is the predecoded form of every address of that image. The image spans
+the 64 KB of XO-CHIP memory; pages past the program all point to a single zero page */
+struct Chip8Rom {
+    uint64_t hash; //FNV-1a hash of the program bytes
+    size_t size; //in bytes
+    uint8_t* data; //program bytes
+    Chip8Page* pages[XOCHIP_PAGE_COUNT];
+    uint32_t decodedSize; //number of decoded addresses: at least CHIP8_MEMORY_SIZE, and up to the end of the program
+    Chip8Instruction* decoded; //decoded[a]: instruction whose first byte is at address a
+    Chip8CountedLoop* loops; //the counted loops of the image, by head address
+    uint32_t loopCount;
+    uint64_t* loopHeads; //bit a: a counted loop starts at address a (decodedSize bits)
+    struct Chip8Rom* next;
+};
+
+/* the registers touched by almost every instruction come first and fit in a single 64-byte cache line,
+followed by the page table and the bit-packed display planes. Only the pages a machine can address (pageCount)
+and the planes it has drawn to (planeCount) are meaningful: forking a CHIP-8 machine copies about 1.5 KB */
+struct Chip8State {
+    _Alignas(64) uint8_t V[16]; //general purpose registers
+    uint16_t I; //index register
+    uint16_t PC; //program counter
+    uint8_t  SP; //stack pointer
+    uint8_t  delay_timer;
+    uint8_t  sound_timer;
+    bool     isHalted; //the machine is waiting for a key to be pressed then released to resume its execution
+    int8_t   keyPressedDuringHalt; //the last key that was pressed while the interpreter was halted (in "isHalted" state)
+    bool     screenChanged; //set by 00E0 and DXYN, cleared once the screen has been presented
+    uint16_t keypad; //keypad state (bit k set: key k is in "pressed" state)
+    uint16_t stack[STACK_SIZE]; //stack
+    uint32_t rngState; //CXNN random generator (xorshift32), per machine so that forks replay identically
+    const Chip8Rom* rom; //image the machine was created from
+    uint8_t  profile; //Chip8Profile: selects the interpreter variant
+    bool     hires; //SUPER-CHIP 128x64 mode (00FF), otherwise 64x32 (00FE)
+    uint8_t  rplFlags[16]; //SUPER-CHIP "RPL user flags" (FX75, FX85; XO-CHIP has 16 of them)
+    uint8_t  timing; //Chip8Timing
+    bool     waitingForVblank; //a DXYN with the display wait quirk ended the frame: its remaining slices run nothing
+    int32_t  cycleBudget; //CHIP8_TIMING_VIP: machine cycles left in the current frame (negative: overrun, paid by the next frame)
+    uint16_t addressMask; //CHIP8_ADDRESS_MASK, or XOCHIP_ADDRESS_MASK for the XO-CHIP profile
+    uint16_t pageCount; //number of entries of pages in use (CHIP8_PAGE_COUNT or XOCHIP_PAGE_COUNT)
+    uint8_t  planeMask; //XO-CHIP planes selected by FN01 (bit p: plane p), drawn, cleared and scrolled by the display instructions
+    uint8_t  planeCount; //planes 0 to planeCount-1 hold the display, the others are not initialized
+    uint8_t  pitch; //XO-CHIP audio pattern playback rate (FX3A): 4000*2^((pitch-64)/48) bits per second
+    uint8_t  audioPattern[16]; //XO-CHIP 1-bit audio pattern (F002), played while the sound timer is not 0
+    uint64_t instructionCount; //instructions executed since the machine was created
+    const struct Chip8CompiledProgram* compiled; //translation of the program run instead of the interpreter, NULL if there is none
+    struct Chip8Jit* jit; //execution tiers of the program (see chip8_jit.h), NULL when the JIT is not enabled
+    uint64_t executedLines[CHIP8_LINE_WORDS]; //lines the interpreter fetched an instruction from
+    uint64_t writtenLines[CHIP8_LINE_WORDS]; //lines whose content may differ from the ROM image: its predecoded instructions are not used there
+    uint64_t codeWrites; //writes that changed a byte of an executed line or of translated code
+    Chip8Page* pages[XOCHIP_PAGE_COUNT]; //RAM
+    uint64_t screen[CHIP8_MAX_PLANES][CHIP8_HIRES_DISPLAY_HEIGHT][CHIP8_SCREEN_ROW_WORDS]; //display planes (bit 63 of a word is its leftmost pixel)
+};
+_Static_assert(offsetof(Chip8State, stack) + sizeof(uint16_t[STACK_SIZE]) <= 64, "Chip8State: hot registers must fit in one cache line");
+
+Chip8Page* chip8AllocatePage(void);
+void chip8ReleasePage(Chip8Page*);
+
+static inline bool chip8IsCountedLoopHead(const Chip8Rom* rom, uint16_t address) {
+    return address < rom->decodedSize && ((rom->loopHeads[address >> 6] >> (address & 63)) & 1);
+}
+/* with machine s at the head of a counted loop of its ROM, runs as many of its instructions as budget allows in one go,
+with the fixed timing (the iterations that fit, or all of them up to the loop's exit) and returns their number
+(0: none, the loop is left to the interpreter) */
+int chip8RunCountedLoop(Chip8State* s, int budget);
+Chip8Instruction chip8DecodeInstruction(uint8_t high, uint8_t low);
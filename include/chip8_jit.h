@@ -0,0 +1,129 @@
+#pragma once
+
+/* tiered execution of CHIP-8 programs: machines start in the interpreter, which runs a program one basic block at a
+time and counts how often each block is entered; a block entered CHIP8_JIT_DEFAULT_THRESHOLD times is handed to a
+background thread that compiles it to native code, and the machines run the native block from then on. Native
+blocks are compiled from the ROM image: a machine that wrote to the memory of a block interprets it (see the line
+bitmaps of Chip8State). Fixed timing only; native code is generated for x86-64 Linux, elsewhere everything is
+interpreted */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chip8.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+    #define CHIP8_JIT_SUPPORTED 1
+#else
+    #define CHIP8_JIT_SUPPORTED 0
+#endif
+
+#define CHIP8_JIT_DEFAULT_THRESHOLD 64
+#define CHIP8_JIT_CODE_VERSION 1 //of the code generator: to be increased with every change of the generated code
+
+/* starts the compiler thread; machines created or given a profile afterwards use the tiers. The native blocks of every
+ROM are kept in cacheDirectory across runs (created if needed), NULL: they are not kept. Returns 0 on success, also
+when the system forbids executable memory: the JIT is then left disabled (see chip8JitIsEnabled) */
+int chip8JitInit(int threshold, const char* cacheDirectory);
+//$XDG_CACHE_HOME/chip8-c, or ~/.cache/chip8-c; NULL if there is no home directory
+const char* chip8JitDefaultCacheDirectory(void);
+//writes the native blocks to the cache directory, stops the compiler thread and releases them (no machine may run afterwards)
+void chip8JitTerminate(void);
+bool chip8JitIsEnabled(void);
+/* names every native block in /tmp/perf-<pid>.map for Linux perf, and also writes /tmp/jit-<pid>.dump (with the code)
+if withJitdump; called after chip8JitInit. Returns 0 on success */
+int chip8JitPerfInit(bool withJitdump);
+//prints the share of instructions run by each tier, the compiled blocks and the compile times (a profiler report section)
+void chip8JitReport(FILE* fp);
+
+
+/* internals shared by the CHIP-8 core (chip8.c), the tiers (chip8_jit.c) and the code generator (chip8_jit_x86_64.c) */
+
+#include <stdatomic.h>
+
+#include <chip8_internal.h>
+#include <chip8_analysis.h>
+
+//a native block covers at most one line's worth of guest code, so it spans at most two lines
+#define CHIP8_JIT_MAX_BLOCK_BYTES 64
+#define CHIP8_JIT_MAX_BLOCK_INSTRUCTIONS (CHIP8_JIT_MAX_BLOCK_BYTES / 2)
+#define CHIP8_JIT_MAX_CODE_SIZE 4096 //native code of a block, in bytes
+
+/* fingerprint of the parts of Chip8State native code depends on (an FNV-1a hash of the offset and size of every field
+the code generator addresses, and of STACK_SIZE): the cache only loads code generated for the same layout. A field
+the code generator starts to use must be added here */
+#define CHIP8_JIT_LAYOUT_MIX(hash, value) ((((uint32_t)(hash)) ^ (uint32_t)(value)) * 16777619u)
+#define CHIP8_JIT_LAYOUT_FIELD(hash, field) \
+    CHIP8_JIT_LAYOUT_MIX(hash, offsetof(Chip8State, field) << 8 | sizeof(((Chip8State*)0)->field))
+#define CHIP8_JIT_STATE_LAYOUT \
+    CHIP8_JIT_LAYOUT_FIELD(CHIP8_JIT_LAYOUT_FIELD(CHIP8_JIT_LAYOUT_FIELD(CHIP8_JIT_LAYOUT_FIELD(CHIP8_JIT_LAYOUT_FIELD( \
+    CHIP8_JIT_LAYOUT_FIELD(CHIP8_JIT_LAYOUT_FIELD(CHIP8_JIT_LAYOUT_FIELD(CHIP8_JIT_LAYOUT_FIELD(CHIP8_JIT_LAYOUT_FIELD( \
+    CHIP8_JIT_LAYOUT_MIX(2166136261u, STACK_SIZE), \
+    V), I), PC), SP), stack), delay_timer), sound_timer), keypad), pitch), instructionCount)
+
+//the guest instructions of a block, in execution order: every one runs natively but maybe the last (see terminator)
+typedef struct {
+    Chip8InstructionInfo instructions[CHIP8_JIT_MAX_BLOCK_INSTRUCTIONS];
+    int instructionCount;
+    uint16_t start;
+    uint16_t end; //first address past the last instruction
+    uint16_t checkedEnd; //first address past the bytes the native code depends on (a skip at the end reads the next instruction)
+} Chip8JitSource;
+
+/* runs the block on machine s, stopping after budget instructions (at least 1), and returns the number of instructions
+run: all of them, budget, or fewer when a call or return at the end overflows or underflows the stack (the machine is
+left at that instruction for the interpreter to report) */
+typedef int (*Chip8JitCode)(Chip8State* s, int budget);
+
+typedef struct {
+    Chip8JitCode code;
+    uint32_t codeSize;
+    uint16_t start;
+    uint16_t end;
+    uint16_t checkedEnd;
+    uint8_t instructionCount;
+} Chip8JitBlock;
+
+//the tiers of the machines running one ROM with one profile, shared by all of them
+typedef struct Chip8Jit {
+    const Chip8Rom* rom;
+    uint8_t profile;
+    uint32_t memorySize;
+    _Atomic(const Chip8JitBlock*)* blocks; //blocks[a]: native block starting at address a, published by the compiler thread
+    //updated by every machine running the ROM without a lock (relaxed accesses): a count lost to a race is harmless
+    _Atomic(uint8_t)* chunkLengths; //chunkLengths[a]: instructions the interpreter runs from address a in one go (0: not known yet)
+    _Atomic(uint16_t)* hotness; //hotness[a]: times the interpreter entered the block at a (the threshold once it was queued)
+    atomic_uint_fast64_t interpretedInstructions;
+    atomic_uint_fast64_t nativeInstructions;
+    uint32_t compiledBlockCount; //blocks compiled by the compiler thread (not read from the cache)
+    const uint8_t* cacheFile; //the cache file of the ROM and profile mapped in memory, NULL if there was none
+    size_t cacheFileSize;
+    struct Chip8Jit* next;
+} Chip8Jit;
+
+//the tiers of rom with profile, created on first use; NULL when the JIT is not enabled
+Chip8Jit* chip8JitFor(const Chip8Rom* rom, Chip8Profile profile);
+//same contract as the interpreters (runs nbOfInstructions instructions, returns 1 on error)
+int chip8JitRun(Chip8State* s, int nbOfInstructions);
+
+/* the code generator: fills source with the block starting at address of the ROM image (returns its instruction
+count, 0 if the first instruction has to be interpreted), then writes its native code into code (at most
+CHIP8_JIT_MAX_CODE_SIZE bytes) and returns the code's size */
+int chip8JitScanBlock(const Chip8Rom* rom, Chip8Profile profile, uint16_t address, Chip8JitSource* source);
+uint32_t chip8JitEmitBlock(const Chip8JitSource* source, Chip8Profile profile, uint8_t* code);
+//copies codeSize bytes of native code into the executable arena and returns their address there, NULL if it is full
+const uint8_t* chip8JitAllocateCode(const uint8_t* code, uint32_t codeSize);
+
+/* the cache of native blocks (chip8_jit_cache.c): files are opened when a jit is created and saved when the JIT
+terminates; a lookup checks the cached block at address against the ROM image and its code against the hash saved
+with it, then copies the code to the arena and returns a new block (NULL if there is none, or if it is not valid) */
+int chip8JitCacheSetDirectory(const char* path);
+void chip8JitCacheOpen(Chip8Jit* jit);
+const Chip8JitBlock* chip8JitCacheLookup(const Chip8Jit* jit, uint16_t address);
+void chip8JitCacheSave(const Chip8Jit* jit);
+void chip8JitCacheClose(Chip8Jit* jit);
+
+//the perf map (chip8_jit_perf.c): every published block is recorded, by whichever thread publishes it
+void chip8JitPerfRecord(const Chip8JitBlock* block);
+void chip8JitPerfTerminate(void);
@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <glfw3.h>
 
+#include <chip8.h>
+
 extern const double TARGET_FPS;
 
 GLFWwindow* graphicsGetWindow(void);
@@ -12,4 +14,6 @@ bool graphicsDidFrameChange(void);
 
 int graphicsInit(void);
 void graphicsUpdate(void);
+//like graphicsUpdate, with the screen of any machine (e.g. a run-ahead copy of the main one)
+void graphicsPresent(const Chip8State* machine);
 void graphicsTerminate(void);
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include<glad/glad.h>
 
 void inputInit(void);
-void processInput(void);
+//samples the keyboard into the keypad of the CHIP-8 machine, and returns the keypad state (bit k: key k is pressed)
+uint16_t processInput(void);
 bool inputShouldClose(void);
-void framebufferSizeCallback(GLFWwindow* window, int width, int height);
\ No newline at end of file
+void framebufferSizeCallback(GLFWwindow* window, int width, int height);
+//F1 toggles the performance overlay
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
\ No newline at end of file
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+//nanoseconds elapsed since an arbitrary origin, read from the host's monotonic high-resolution clock
+uint64_t monotonicNanoseconds(void);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* the performance overlay (HUD) drawn over the top-left corner of the window, written with the CHIP-8 hexadecimal
+font: one right-aligned decimal number per row, in this order */
+typedef struct {
+    double instructionsPerSecond; //emulated instructions per second of host time
+    double frameTime; //host time spent emulating and presenting a frame, in seconds
+    long skippedPresents; //frames not presented because the host was behind, since the start
+    double speed; //emulated time per host time (1.0: real time)
+} OverlayStats;
+
+//called by graphicsInit, once the OpenGL context exists; returns 0 on success
+int overlayInit(void);
+void overlaySetVisible(bool visible);
+bool overlayIsVisible(void);
+void overlayToggle(void);
+//updates the numbers shown (a few times per second is enough to read them)
+void overlaySetStats(const OverlayStats* stats);
+/* draws the overlay, if visible, over the current frame in one instanced draw call; called by graphicsPresent after
+the screen quad, it leaves its own vertex array and program bound */
+void overlayDraw(void);
+void overlayTerminate(void);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <monotonic_clock.h>
+
+//the phases of a frame of the main loop, each one with its own histogram of durations (one sample per call)
+typedef enum {
+    PROFILER_PHASE_POLL_EVENTS, //glfwPollEvents
+    PROFILER_PHASE_PROCESS_INPUT,
+    PROFILER_PHASE_EMULATION, //chip8UpdateSlice (one sample per slice)
+    PROFILER_PHASE_RUN_AHEAD,
+    PROFILER_PHASE_TEXTURE_UPLOAD, //glTexSubImage2D
+    PROFILER_PHASE_DRAW, //uniforms and screen quad
+    PROFILER_PHASE_SWAP_BUFFERS,
+    PROFILER_PHASE_SLEEP, //waits between slices and until the next frame
+    PROFILER_PHASE_FRAME, //a whole iteration of the main loop
+    PROFILER_PHASE_COUNT
+} ProfilerPhase;
+
+/* enables the instrumentation (until then, profilerRecord does nothing); a report of every phase is printed to fp
+every dumpInterval seconds (0: never), and by profilerReport */
+void profilerInit(FILE* fp, double dumpInterval);
+bool profilerIsEnabled(void);
+//records the duration of a phase that started at start (a monotonicNanoseconds value) and ends now (and its scope, when tracing)
+void profilerRecord(ProfilerPhase phase, uint64_t start);
+//called once per frame by the main loop: prints the periodic report when it is due
+void profilerFrameEnd(void);
+//prints the count, p50, p99 and max of every phase
+void profilerReport(void);
+//adds a section printed by report (to the profiler's output) at the end of every report, e.g. the statistics of a module
+void profilerAddReportSection(void (*report)(FILE* fp));
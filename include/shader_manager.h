@@ -1,3 +1,5 @@
 #pragma once
 
-unsigned int getShaderProgram(void);
\ No newline at end of file
+unsigned int getShaderProgram(void);
+//program of the performance overlay (overlay.c)
+unsigned int getOverlayShaderProgram(void);
\ No newline at end of file
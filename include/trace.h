@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <monotonic_clock.h>
+
+/* timeline tracing: scopes (a name, a start and an end, read from monotonicNanoseconds) are recorded by any thread
+in a buffer of its own, without locks, and written on exit as Chrome trace-event JSON, which chrome://tracing and
+ui.perfetto.dev display as one track per thread */
+
+//enables the recording (until then, traceRecord does nothing); called once, before the other threads start
+void traceInit(void);
+bool traceIsEnabled(void);
+//names the calling thread's track in the timeline
+void traceSetThreadName(const char* name);
+/* records a scope that started at start (a monotonicNanoseconds value) and ends now, on the calling thread's track;
+name must be a string literal (only the pointer is kept, and it is written to the JSON file without escaping) */
+void traceRecord(const char* name, uint64_t start);
+//writes every recorded scope to filepath; the other threads must have stopped recording; returns 0 on success
+int traceWrite(const char* filepath);
@@ -0,0 +1,443 @@
+/* this source file turns the sound output of the CHIP-8 machine into samples: the emulator thread writes them into
+a lock-free single-producer single-consumer ring, and a backend thread reads them to feed the sound card or a WAV file */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <mmsystem.h>
+
+#elif defined(__linux__)
+    #include <pthread.h>
+    #include <unistd.h>
+    #include <dlfcn.h>
+
+#endif
+
+#include <audio.h>
+#include <chip8.h>
+#include <monotonic_clock.h>
+#include <trace.h>
+
+#define FRAME_RATE 60 //audioGenerateFrame is called once per emulated frame
+#define RING_CAPACITY 8192 //in samples (power of 2): about 185 ms
+#define PERIOD_SIZE 512 //samples handed to the backend at once
+#define AMPLITUDE 6000
+#define BUZZER_FREQUENCY 440.0 //in Hz, CHIP-8 square wave
+#define PATTERN_BITS 128 //XO-CHIP audio pattern length
+#define MAX_RATE_ADJUSTMENT 0.005 //dynamic rate control changes the number of samples per frame by at most 0.5%
+
+
+/* SPSC ring: writeIndex is only stored by the emulator thread and readIndex by the backend thread, each on its own
+cache line; both only grow (they are reduced modulo RING_CAPACITY when indexing samples) */
+typedef struct {
+    int16_t samples[RING_CAPACITY];
+    _Alignas(64) atomic_size_t writeIndex;
+    _Alignas(64) atomic_size_t readIndex;
+} SampleRing;
+
+static SampleRing ring;
+
+static AudioBackend activeBackend = AUDIO_BACKEND_NULL;
+static atomic_bool running;
+static bool initialized = false;
+
+//generator state (emulator thread only): phases carry over from one frame to the next so the waveform never jumps
+static double buzzerPhase = 0.0; //in periods, [0, 1)
+static double patternPhase = 0.0; //in pattern bits, [0, PATTERN_BITS)
+static double pendingSamples = 0.0; //fractional part of the number of samples per frame
+
+//dynamic rate control (emulator thread only)
+static bool rateControl = false;
+static size_t rateControlTarget = 0; //in buffered samples
+static double fillSum = 0.0; //to report the average buffer fill level
+static size_t fillCount = 0;
+
+//statistics, reported by audioTerminate
+static size_t droppedSamples = 0; //the ring was full (emulator thread)
+static atomic_size_t underrunSamples; //the ring was empty and silence was played (backend thread)
+
+//WAV backend
+static FILE* wavFile = NULL;
+static size_t wavDataSize = 0; //in bytes
+
+#ifdef _WIN32
+    static HANDLE backendThread;
+    static HWAVEOUT waveOutDevice;
+    #define WAVE_BUFFER_COUNT 4
+    static WAVEHDR waveHeaders[WAVE_BUFFER_COUNT];
+    static int16_t waveBuffers[WAVE_BUFFER_COUNT][PERIOD_SIZE];
+
+#elif defined(__linux__)
+    static pthread_t backendThread;
+
+    /* ALSA is loaded at run time so that the interpreter neither needs its headers to build nor libasound to run
+    (without it, the native backend is unavailable); these are the few declarations used from <alsa/asoundlib.h> */
+    typedef struct snd_pcm_t snd_pcm_t;
+    #define SND_PCM_STREAM_PLAYBACK 0
+    #define SND_PCM_FORMAT_S16_LE 2
+    #define SND_PCM_ACCESS_RW_INTERLEAVED 3
+    static void* alsaLibrary = NULL;
+    static snd_pcm_t* alsaDevice = NULL;
+    static int (*alsaOpen)(snd_pcm_t**, const char*, int, int);
+    static int (*alsaSetParams)(snd_pcm_t*, int, int, unsigned int, unsigned int, int, unsigned int);
+    static long (*alsaWritei)(snd_pcm_t*, const void*, unsigned long);
+    static int (*alsaRecover)(snd_pcm_t*, int, int);
+    static int (*alsaDrain)(snd_pcm_t*);
+    static int (*alsaClose)(snd_pcm_t*);
+
+#endif
+
+
+static void sleepMilliseconds(int milliseconds) {
+    #ifdef _WIN32
+        Sleep((DWORD)milliseconds);
+    #elif defined(__linux__)
+        usleep((useconds_t)milliseconds * 1000);
+    #endif
+}
+
+//emulator thread: queues up to count samples, the ones that don't fit are dropped
+static void ringPush(const int16_t* samples, size_t count) {
+    size_t writeIndex = atomic_load_explicit(&ring.writeIndex, memory_order_relaxed);
+    size_t readIndex = atomic_load_explicit(&ring.readIndex, memory_order_acquire);
+    size_t freeSpace = RING_CAPACITY - (writeIndex - readIndex);
+    if (count > freeSpace) {
+        droppedSamples += count - freeSpace;
+        count = freeSpace;
+    }
+    for (size_t i = 0; i < count; i++)
+        ring.samples[(writeIndex + i) & (RING_CAPACITY - 1)] = samples[i];
+    atomic_store_explicit(&ring.writeIndex, writeIndex + count, memory_order_release);
+}
+
+//backend thread: reads up to count samples, returns how many were available
+static size_t ringPop(int16_t* samples, size_t count) {
+    size_t readIndex = atomic_load_explicit(&ring.readIndex, memory_order_relaxed);
+    size_t writeIndex = atomic_load_explicit(&ring.writeIndex, memory_order_acquire);
+    size_t available = writeIndex - readIndex;
+    if (count > available)
+        count = available;
+    for (size_t i = 0; i < count; i++)
+        samples[i] = ring.samples[(readIndex + i) & (RING_CAPACITY - 1)];
+    atomic_store_explicit(&ring.readIndex, readIndex + count, memory_order_release);
+    return count;
+}
+
+//backend thread: fills a whole period, completing it with silence if the emulator is late
+static void readPeriod(int16_t* samples, size_t count) {
+    uint64_t traceStart = monotonicNanoseconds();
+    size_t read = ringPop(samples, count);
+    if (read < count) {
+        memset(samples + read, 0, (count - read) * sizeof(int16_t));
+        atomic_fetch_add_explicit(&underrunSamples, count - read, memory_order_relaxed);
+    }
+    traceRecord(read < count ? "audio period (underrun)" : "audio period", traceStart);
+}
+
+
+static void writeWavHeader(FILE* fp, size_t dataSize) {
+    uint8_t header[44];
+    uint32_t fields[] = {(uint32_t)(36 + dataSize), 16, 1 | (1 << 16), AUDIO_SAMPLE_RATE, AUDIO_SAMPLE_RATE * 2, 2 | (16 << 16), (uint32_t)dataSize};
+    memcpy(header, "RIFF", 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    memcpy(header + 36, "data", 4);
+    //little-endian fields: RIFF size, fmt size, PCM format and 1 channel, sample rate, byte rate, block align and bits per sample, data size
+    const int offsets[] = {4, 16, 20, 24, 28, 32, 40};
+    for (int i = 0; i < 7; i++)
+        for (int b = 0; b < 4; b++)
+            header[offsets[i] + b] = (uint8_t)(fields[i] >> (8 * b));
+    fwrite(header, 1, sizeof(header), fp);
+}
+
+#ifdef _WIN32
+    static DWORD WINAPI backendThreadMain(LPVOID unused) {
+        (void)unused;
+#else
+    static void* backendThreadMain(void* unused) {
+        (void)unused;
+#endif
+    traceSetThreadName("audio");
+    int16_t period[PERIOD_SIZE];
+    uint64_t startTime = monotonicNanoseconds();
+    size_t consumed = 0; //null backend: samples consumed since startTime
+    while (atomic_load(&running)) {
+        switch (activeBackend) {
+
+            case AUDIO_BACKEND_WAV: {
+                //the file gets exactly what the emulator produced: no silence is inserted
+                size_t read = ringPop(period, PERIOD_SIZE);
+                if (read == 0) {
+                    sleepMilliseconds(5);
+                    break;
+                }
+                wavDataSize += fwrite(period, sizeof(int16_t), read, wavFile) * sizeof(int16_t);
+                break;
+            }
+
+            case AUDIO_BACKEND_NATIVE: {
+                #ifdef _WIN32
+                    bool queued = false;
+                    for (int i = 0; i < WAVE_BUFFER_COUNT; i++) {
+                        WAVEHDR* header = &waveHeaders[i];
+                        if ((header->dwFlags & WHDR_PREPARED) && !(header->dwFlags & WHDR_DONE))
+                            continue; //still playing
+                        readPeriod(waveBuffers[i], PERIOD_SIZE);
+                        if (!(header->dwFlags & WHDR_PREPARED)) {
+                            header->lpData = (LPSTR)waveBuffers[i];
+                            header->dwBufferLength = sizeof(waveBuffers[i]);
+                            waveOutPrepareHeader(waveOutDevice, header, sizeof(WAVEHDR));
+                        }
+                        header->dwFlags &= ~(DWORD)WHDR_DONE;
+                        waveOutWrite(waveOutDevice, header, sizeof(WAVEHDR));
+                        queued = true;
+                    }
+                    if (!queued)
+                        sleepMilliseconds(2);
+                #elif defined(__linux__)
+                    readPeriod(period, PERIOD_SIZE);
+                    long written = alsaWritei(alsaDevice, period, PERIOD_SIZE); //blocks until the device has room
+                    if (written < 0)
+                        alsaRecover(alsaDevice, (int)written, 1);
+                #endif
+                break;
+            }
+
+            case AUDIO_BACKEND_NULL: {
+                //a simulated sound card: samples are consumed (and discarded) at exactly AUDIO_SAMPLE_RATE
+                uint64_t elapsed = monotonicNanoseconds() - startTime;
+                size_t due = (size_t)(elapsed / 1000000000ULL * AUDIO_SAMPLE_RATE + elapsed % 1000000000ULL * AUDIO_SAMPLE_RATE / 1000000000ULL);
+                while (consumed < due) {
+                    size_t count = due - consumed < PERIOD_SIZE ? due - consumed : PERIOD_SIZE;
+                    readPeriod(period, count);
+                    consumed += count;
+                }
+                sleepMilliseconds(1);
+                break;
+            }
+        }
+    }
+    #ifdef _WIN32
+        return 0;
+    #else
+        return NULL;
+    #endif
+}
+
+static int openNativeDevice(void) {
+    #ifdef _WIN32
+        WAVEFORMATEX format = {0};
+        format.wFormatTag = WAVE_FORMAT_PCM;
+        format.nChannels = 1;
+        format.nSamplesPerSec = AUDIO_SAMPLE_RATE;
+        format.wBitsPerSample = 16;
+        format.nBlockAlign = 2;
+        format.nAvgBytesPerSec = AUDIO_SAMPLE_RATE * 2;
+        if (waveOutOpen(&waveOutDevice, WAVE_MAPPER, &format, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR) {
+            fprintf(stderr, "[audio] ERROR: could not open the audio device\n");
+            return 1;
+        }
+        memset(waveHeaders, 0, sizeof(waveHeaders));
+        return 0;
+
+    #elif defined(__linux__)
+        alsaLibrary = dlopen("libasound.so.2", RTLD_NOW);
+        if (!alsaLibrary) {
+            fprintf(stderr, "[audio] ERROR: libasound.so.2 is not available\n");
+            return 1;
+        }
+        *(void**)&alsaOpen = dlsym(alsaLibrary, "snd_pcm_open");
+        *(void**)&alsaSetParams = dlsym(alsaLibrary, "snd_pcm_set_params");
+        *(void**)&alsaWritei = dlsym(alsaLibrary, "snd_pcm_writei");
+        *(void**)&alsaRecover = dlsym(alsaLibrary, "snd_pcm_recover");
+        *(void**)&alsaDrain = dlsym(alsaLibrary, "snd_pcm_drain");
+        *(void**)&alsaClose = dlsym(alsaLibrary, "snd_pcm_close");
+        if (!alsaOpen || !alsaSetParams || !alsaWritei || !alsaRecover || !alsaDrain || !alsaClose
+            || alsaOpen(&alsaDevice, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+            fprintf(stderr, "[audio] ERROR: could not open the audio device\n");
+            dlclose(alsaLibrary);
+            alsaLibrary = NULL;
+            return 1;
+        }
+        //50 ms of device latency, resampled by ALSA if the card doesn't run at AUDIO_SAMPLE_RATE
+        if (alsaSetParams(alsaDevice, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 1, AUDIO_SAMPLE_RATE, 1, 50000) < 0) {
+            fprintf(stderr, "[audio] ERROR: the audio device does not support mono 16-bit output\n");
+            alsaClose(alsaDevice);
+            dlclose(alsaLibrary);
+            alsaLibrary = NULL;
+            return 1;
+        }
+        return 0;
+
+    #else
+        fprintf(stderr, "[audio] ERROR: no native audio backend on this platform\n");
+        return 1;
+
+    #endif
+}
+
+static void closeNativeDevice(void) {
+    #ifdef _WIN32
+        waveOutReset(waveOutDevice);
+        for (int i = 0; i < WAVE_BUFFER_COUNT; i++)
+            if (waveHeaders[i].dwFlags & WHDR_PREPARED)
+                waveOutUnprepareHeader(waveOutDevice, &waveHeaders[i], sizeof(WAVEHDR));
+        waveOutClose(waveOutDevice);
+    #elif defined(__linux__)
+        alsaDrain(alsaDevice);
+        alsaClose(alsaDevice);
+        dlclose(alsaLibrary);
+        alsaLibrary = NULL;
+    #endif
+}
+
+int audioInit(AudioBackend backend, const char* wavFilepath) {
+    atomic_store(&ring.writeIndex, 0);
+    atomic_store(&ring.readIndex, 0);
+    atomic_store(&underrunSamples, 0);
+    droppedSamples = 0;
+
+    if (backend == AUDIO_BACKEND_WAV) {
+        wavFile = fopen(wavFilepath, "wb");
+        if (!wavFile) {
+            fprintf(stderr, "[audio] ERROR: could not open %s\n", wavFilepath);
+            return 1;
+        }
+        writeWavHeader(wavFile, 0); //rewritten with the actual size by audioTerminate
+        wavDataSize = 0;
+    }
+    else if (backend == AUDIO_BACKEND_NATIVE && openNativeDevice() != 0) {
+        return 1;
+    }
+
+    activeBackend = backend;
+    initialized = true;
+
+    atomic_store(&running, true);
+    #ifdef _WIN32
+        backendThread = CreateThread(NULL, 0, backendThreadMain, NULL, 0, NULL);
+        bool threadFailed = backendThread == NULL;
+    #else
+        bool threadFailed = pthread_create(&backendThread, NULL, backendThreadMain, NULL) != 0;
+    #endif
+    if (threadFailed) {
+        fprintf(stderr, "[audio] ERROR: could not start the audio thread\n");
+        atomic_store(&running, false);
+        activeBackend = AUDIO_BACKEND_NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/* fills samples with the machine's current output: silence, the CHIP-8 buzzer (a square wave) or the XO-CHIP pattern
+played at its pitch; the phases are kept across calls so consecutive frames join without discontinuity */
+static void generateSamples(const Chip8State* machine, int16_t* samples, size_t count) {
+    bool soundOn = chip8IsSoundOn(machine);
+    int pitch = 64;
+    const uint8_t* pattern = chip8GetAudioPattern(machine, &pitch);
+    double patternStep = 4000.0 * pow(2.0, (pitch - 64) / 48.0) / AUDIO_SAMPLE_RATE;
+    double buzzerStep = BUZZER_FREQUENCY / AUDIO_SAMPLE_RATE;
+
+    for (size_t i = 0; i < count; i++) {
+        int16_t sample = 0;
+        if (soundOn && pattern) {
+            int bit = (int)patternPhase;
+            sample = (pattern[bit >> 3] >> (7 - (bit & 7))) & 1 ? AMPLITUDE : -AMPLITUDE;
+        }
+        else if (soundOn) {
+            sample = buzzerPhase < 0.5 ? AMPLITUDE : -AMPLITUDE;
+        }
+        samples[i] = sample;
+
+        buzzerPhase += buzzerStep;
+        if (buzzerPhase >= 1.0)
+            buzzerPhase -= 1.0;
+        patternPhase += patternStep;
+        if (patternPhase >= PATTERN_BITS)
+            patternPhase = fmod(patternPhase, PATTERN_BITS);
+    }
+}
+
+void audioGenerateFrame(const Chip8State* machine) {
+    if (!initialized)
+        return;
+
+    double ratio = 1.0;
+    if (rateControl) {
+        //proportional control: a buffer above its target level gets fewer samples per frame, one below it more
+        size_t fill = audioGetBufferedSamples();
+        double error = ((double)rateControlTarget - (double)fill) / (double)rateControlTarget;
+        if (error > 1.0)
+            error = 1.0;
+        else if (error < -1.0)
+            error = -1.0;
+        ratio += MAX_RATE_ADJUSTMENT * error;
+        fillSum += (double)fill;
+        fillCount++;
+    }
+    pendingSamples += (double)AUDIO_SAMPLE_RATE / FRAME_RATE * ratio;
+    size_t count = (size_t)pendingSamples;
+    pendingSamples -= (double)count;
+
+    int16_t samples[AUDIO_SAMPLE_RATE / FRAME_RATE + AUDIO_SAMPLE_RATE / FRAME_RATE / 100 + 2]; //room for the rate control's 0.5%
+    if (count > sizeof(samples) / sizeof(samples[0]))
+        count = sizeof(samples) / sizeof(samples[0]);
+    generateSamples(machine, samples, count);
+    ringPush(samples, count);
+}
+
+size_t audioGetBufferedSamples(void) {
+    return atomic_load_explicit(&ring.writeIndex, memory_order_relaxed) - atomic_load_explicit(&ring.readIndex, memory_order_relaxed);
+}
+
+void audioSetRateControl(bool enabled, size_t targetSamples) {
+    rateControl = enabled && targetSamples > 0;
+    rateControlTarget = targetSamples;
+}
+
+void audioTerminate(void) {
+    if (!initialized)
+        return;
+
+    if (atomic_load(&running)) {
+        atomic_store(&running, false);
+        #ifdef _WIN32
+            WaitForSingleObject(backendThread, INFINITE);
+            CloseHandle(backendThread);
+        #else
+            pthread_join(backendThread, NULL);
+        #endif
+    }
+
+    if (activeBackend == AUDIO_BACKEND_NATIVE) {
+        closeNativeDevice();
+    }
+    else if (activeBackend == AUDIO_BACKEND_WAV) {
+        //the samples still in the ring go to the file as well
+        int16_t period[PERIOD_SIZE];
+        size_t read;
+        while ((read = ringPop(period, PERIOD_SIZE)) > 0)
+            wavDataSize += fwrite(period, sizeof(int16_t), read, wavFile) * sizeof(int16_t);
+        fseek(wavFile, 0, SEEK_SET);
+        writeWavHeader(wavFile, wavDataSize);
+        fclose(wavFile);
+        wavFile = NULL;
+    }
+
+    if (droppedSamples > 0)
+        fprintf(stderr, "[audio] WARNING: %zu samples dropped (the audio thread could not keep up)\n", droppedSamples);
+    size_t underruns = atomic_load(&underrunSamples);
+    if (underruns > 0)
+        fprintf(stderr, "[audio] WARNING: %zu samples of silence inserted (the emulator could not keep up)\n", underruns);
+    if (rateControl && fillCount > 0)
+        printf("[audio] average buffer fill: %.0f samples (target: %zu)\n", fillSum / (double)fillCount, rateControlTarget);
+
+    initialized = false;
+    activeBackend = AUDIO_BACKEND_NULL;
+}
@@ -1,32 +1,42 @@
-//this source file manages the CHIP-8 interpreter's logic and uses a bool two-dimensional array to represent the CHIP-8 screen
+//this source file manages the CHIP-8 interpreter's logic; machines keep their RAM in reference-counted copy-on-write pages so they can be forked cheaply
 
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <time.h>
 
-#include <graphics.h>
+#include <chip8_internal.h>
+#include <chip8_compiled.h>
+#include <chip8_jit.h>
+#include <trace.h>
 
-static void clearChip8Screen();
-static int loadFileToMemory(const char*);
+static const uint64_t* spriteCacheLookup(Chip8State*, uint16_t, uint8_t, uint8_t, bool);
 void dumpMemory(void);
 void generateTraceLog(const char*, int);
 
 
-#define CHIP8_DISPLAY_WIDTH 64
-#define CHIP8_DISPLAY_HEIGHT 32
-
-#define CHIP8_MEMORY_SIZE 4096 //in bytes
-#define STARTING_MEMORY_ADDRESS 0x200
-
-#define STACK_SIZE 16 //number of shorts (16-bit values)
-
 #define INSTRUCTIONS_PER_SECOND 500
-
-#define FONT_DATA_POSITION 0x050
-const uint8_t fontData[] = {
+#define TIMER_FREQUENCY 60 //the delay and sound timers are decremented once per frame, at 60 Hz
+#define INSTRUCTIONS_PER_FRAME (INSTRUCTIONS_PER_SECOND / TIMER_FREQUENCY)
+
+/* COSMAC VIP timing model (CHIP8_TIMING_VIP): the CDP1802 runs at 1.7609 MHz and a machine cycle takes 8 clocks,
+so a 60 Hz frame lasts 3668 machine cycles, of which the CDP1861 display DMA and its interrupt routine take about 1100.
+Every instruction costs the interpreter's fetch and decode, plus its own execution cycles (vipCycleCosts); DXYN, FX33,
+FX55 and FX65 add a data-dependent part. The costs are approximations of the VIP interpreter's code paths */
+#define VIP_CYCLES_PER_FRAME 3668
+#define VIP_DISPLAY_CYCLES 1100
+#define VIP_FETCH_CYCLES 40
+#define VIP_SPRITE_ROW_CYCLES 34 //DXYN, per row drawn
+#define VIP_SPRITE_SHIFT_CYCLES 4 //DXYN, per row and per bit the sprite byte is shifted by (x % 8)
+#define VIP_SPRITE_SPLIT_CYCLES 12 //DXYN, per row spanning two display bytes
+#define VIP_BCD_DIGIT_CYCLES 16 //FX33, per unit of each decimal digit (the VIP subtracts 100s and 10s in loops)
+#define VIP_REGISTER_CYCLES 14 //FX55 and FX65, per register
+
+const uint8_t fontData[80] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
     0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -45,378 +55,913 @@ const uint8_t fontData[] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-typedef struct {
-    uint8_t  V[16]; //general purpose registers
-    uint16_t I; //index register
-    uint16_t PC; //srogram counter
-    uint8_t  SP; //stack pointer
-    uint16_t stack[16]; //stack
-    uint8_t  memory[CHIP8_MEMORY_SIZE]; //RAM
-    uint8_t  delay_timer;
-    uint8_t  sound_timer;
-    bool     keypad[16]; //keypad state (true: key is in "pressed" state)
-    bool     screen[CHIP8_DISPLAY_HEIGHT][CHIP8_DISPLAY_WIDTH]; //display buffer
-    bool     isHalted; //the machine is waiting for a key to be pressed then released to resume its execution
-    int      keyPressedDuringHalt; //the last key that was pressed while the interpreter was halted (in "isHalted" state)
-} Chip8State;
-static Chip8State state;
+//SUPER-CHIP 8x10 font (FX30)
+const uint8_t bigFontData[160] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
 
+//the machine driven by chip8Update and displayed by the graphics module
+static Chip8State mainMachine;
 
-int chip8Init(const char* filepath) {
-    state.PC = STARTING_MEMORY_ADDRESS;
-    state.SP = 0;
-    state.I = 0;
-    for (int i=0; i<16; i++) {
-        state.V[i]=0;
-        state.stack[i]=0;
+static atomic_uint pageGenerationCounter;
+
+//translations of ROMs linked into the program (see chip8_compiled.h), registered before main runs
+static Chip8CompiledProgram* compiledPrograms = NULL;
+
+
+/* DXYN sprite cache: every entry holds the rows of a sprite (the n bytes starting at address I)
+already shifted and rotated into 64-bit row masks for a given x position (bit 63 is column 0), so
+redrawing the same sprite at the same column is one XOR per row.
+Entries are tagged with their source page and its generation, so any write to that page (FX33, FX55)
+invalidates them; the cache is per thread because forked machines may run on several threads */
+#define SPRITE_CACHE_SIZE 64 //number of entries (power of 2)
+#define SPRITE_MAX_ROWS 15
+
+typedef struct {
+    const Chip8Page* page; //page holding the sprite bytes (NULL: empty entry)
+    uint32_t generation; //generation of the page when the entry was built
+    uint8_t  offset; //offset of the first sprite byte in the page
+    uint8_t  n; //number of rows
+    uint8_t  x; //column of the sprite's leftmost pixel (x mod 64)
+    bool     clip; //pixels past the right edge are dropped instead of wrapping around
+    uint64_t rows[SPRITE_MAX_ROWS]; //rotated row masks
+} SpriteCacheEntry;
+static _Thread_local SpriteCacheEntry spriteCache[SPRITE_CACHE_SIZE];
+
+
+Chip8Page* chip8AllocatePage(void) {
+    Chip8Page* page = malloc(sizeof(Chip8Page));
+    if (!page) {
+        fprintf(stderr, "[chip8] ERROR: failed to allocate a memory page\n");
+        exit(1);
     }
-    state.delay_timer = 0;
-    state.sound_timer = 0;
-    state.isHalted = false;
-    state.keyPressedDuringHalt = -1;
-    memcpy(state.memory+FONT_DATA_POSITION, fontData, sizeof(fontData));
-    clearChip8Screen();
-    srand(time(NULL));
-    return loadFileToMemory(filepath);
+    atomic_init(&page->refCount, 1);
+    page->generation = atomic_fetch_add(&pageGenerationCounter, 1) + 1;
+    return page;
 }
 
-static int loadFileToMemory(const char* filepath) {
+void chip8ReleasePage(Chip8Page* page) {
+    if (page && atomic_fetch_sub(&page->refCount, 1) == 1)
+        free(page);
+}
 
-    FILE* fp = fopen(filepath, "rb");
-    if (!fp) {
-        fprintf(stderr, "[chip8] ERROR: could not open specified file\n");
-        return 1;
+/* writes one byte of guest memory: a page still shared with another machine is copied first (copy-on-write),
+and the generation of the written page is renewed so that data cached from its old content is no longer used.
+A write that changes nothing is dropped; one that changes code is self-modification: the line's predecoded
+instructions are not used anymore, and a program writing over its own translated code is interpreted from then on */
+static void writeMemory(Chip8State* s, uint16_t address, uint8_t value) {
+    address &= s->addressMask;
+    Chip8Page** slot = &s->pages[address >> CHIP8_PAGE_SHIFT];
+    if ((*slot)->bytes[address & (CHIP8_PAGE_SIZE - 1)] == value)
+        return;
+
+    bool isTranslated = s->compiled && ((s->compiled->codeMap[address >> 3] >> (address & 7)) & 1);
+    if (isTranslated)
+        s->compiled = NULL;
+    if (isTranslated || (s->executedLines[CHIP8_LINE_WORD(address)] & CHIP8_LINE_BIT(address)))
+        s->codeWrites++;
+    s->writtenLines[CHIP8_LINE_WORD(address)] |= CHIP8_LINE_BIT(address);
+
+    if (atomic_load_explicit(&(*slot)->refCount, memory_order_acquire) > 1) {
+        Chip8Page* copy = chip8AllocatePage();
+        memcpy(copy->bytes, (*slot)->bytes, CHIP8_PAGE_SIZE);
+        chip8ReleasePage(*slot);
+        *slot = copy;
     }
+    else {
+        (*slot)->generation = atomic_fetch_add(&pageGenerationCounter, 1) + 1;
+    }
+    (*slot)->bytes[address & (CHIP8_PAGE_SIZE - 1)] = value;
+}
 
-    size_t nbOfBytesRead = fread(state.memory+STARTING_MEMORY_ADDRESS, 1, CHIP8_MEMORY_SIZE-STARTING_MEMORY_ADDRESS, fp);
-    if (nbOfBytesRead>=CHIP8_MEMORY_SIZE-STARTING_MEMORY_ADDRESS)
-        fprintf(stderr, "[chip8] WARNING: ROM size too big for memory\n");
-    
-    fclose(fp);
+void chip8RegisterCompiledProgram(Chip8CompiledProgram* program) {
+    if (program->version != CHIP8_COMPILED_VERSION) {
+        fprintf(stderr, "[chip8] WARNING: ignoring a translated ROM from another recompiler version (%u, expected %d)\n",
+            (unsigned)program->version, CHIP8_COMPILED_VERSION);
+        return;
+    }
+    program->next = compiledPrograms;
+    compiledPrograms = program;
+}
 
-    return 0;
+static const Chip8CompiledProgram* findCompiledProgram(const Chip8Rom* rom, Chip8Profile profile) {
+    for (const Chip8CompiledProgram* program = compiledPrograms; program; program = program->next)
+        if (program->romHash == rom->hash && program->profile == profile)
+            return program;
+    return NULL;
 }
 
-bool (*getChip8Screen())[CHIP8_DISPLAY_WIDTH] {
-    return state.screen;
+static uint8_t nextRandomByte(Chip8State* s) {
+    uint32_t r = s->rngState;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    s->rngState = r;
+    return (uint8_t)(r >> 24);
 }
 
-static void clearChip8Screen() {
-    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
-        for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++) {
-            state.screen[y][x] = false;
-        }
+
+/* makes the first pageCount pages of the image addressable by machine s (released past them, with what was
+recorded about their lines), sharing the pages of the ROM image it does not address yet */
+static void setPageCount(Chip8State* s, int pageCount) {
+    for (int i = pageCount; i < s->pageCount; i++) {
+        chip8ReleasePage(s->pages[i]);
+        s->pages[i] = NULL;
     }
+    for (int line = pageCount << (CHIP8_PAGE_SHIFT - CHIP8_LINE_SHIFT); line < s->pageCount << (CHIP8_PAGE_SHIFT - CHIP8_LINE_SHIFT); line++) {
+        uint16_t address = (uint16_t)(line << CHIP8_LINE_SHIFT);
+        s->executedLines[CHIP8_LINE_WORD(address)] &= ~CHIP8_LINE_BIT(address);
+        s->writtenLines[CHIP8_LINE_WORD(address)] &= ~CHIP8_LINE_BIT(address);
+    }
+    for (int i = s->pageCount; i < pageCount; i++) {
+        s->pages[i] = s->rom->pages[i];
+        atomic_fetch_add_explicit(&s->pages[i]->refCount, 1, memory_order_relaxed);
+    }
+    s->pageCount = (uint16_t)pageCount;
+    s->addressMask = (uint16_t)(pageCount * CHIP8_PAGE_SIZE - 1);
 }
 
-static int executeInstruction() {
-
-    static double lastTick = -1.0;
-    if (lastTick<0) //we would otherwise be force to intialize lastTick to a constant value, if this trick is not used
-        lastTick=glfwGetTime();
-    double elaspedTime;
-    if (!state.isHalted)  
-        elaspedTime = glfwGetTime() - lastTick;
-    if (elaspedTime>=1.0/60.0) {
-        if (state.delay_timer>0)
-            state.delay_timer--;
-        if (state.sound_timer>0)
-            state.sound_timer--;
-        lastTick += 1.0/60.0;
+//resets machine s to the power-on state of rom, sharing the RAM pages of the ROM image
+static void resetMachine(Chip8State* s, const Chip8Rom* rom) {
+    setPageCount(s, 0);
+    s->rom = rom;
+    setPageCount(s, CHIP8_PAGE_COUNT);
+    s->PC = STARTING_MEMORY_ADDRESS;
+    s->SP = 0;
+    s->I = 0;
+    for (int i=0; i<16; i++) {
+        s->V[i]=0;
+        s->stack[i]=0;
     }
+    s->delay_timer = 0;
+    s->sound_timer = 0;
+    s->isHalted = false;
+    s->keyPressedDuringHalt = -1;
+    s->keypad = 0;
+    s->rngState = (uint32_t)time(NULL) | 1; //a xorshift state must not be 0
+    memset(s->screen[0], 0, sizeof(s->screen[0]));
+    s->screenChanged = true;
+    s->hires = false;
+    memset(s->rplFlags, 0, sizeof(s->rplFlags));
+    s->planeMask = 1;
+    s->planeCount = 1;
+    s->pitch = 64; //4000 bits per second
+    memset(s->audioPattern, 0, sizeof(s->audioPattern));
+    s->instructionCount = 0;
+    memset(s->executedLines, 0, sizeof(s->executedLines));
+    memset(s->writtenLines, 0, sizeof(s->writtenLines));
+    s->codeWrites = 0;
+    s->profile = CHIP8_PROFILE_DEFAULT;
+    s->compiled = findCompiledProgram(rom, CHIP8_PROFILE_DEFAULT);
+    s->jit = chip8JitFor(rom, CHIP8_PROFILE_DEFAULT);
+    s->timing = CHIP8_TIMING_FIXED;
+    s->cycleBudget = 0;
+    s->waitingForVblank = false;
+}
 
+static Chip8State* allocateMachine(void) {
+    #ifdef _WIN32
+        Chip8State* s = _aligned_malloc(sizeof(Chip8State), _Alignof(Chip8State));
+    #else
+        Chip8State* s = aligned_alloc(_Alignof(Chip8State), sizeof(Chip8State));
+    #endif
+    if (!s)
+        fprintf(stderr, "[chip8] ERROR: failed to allocate machine\n");
+    return s;
+}
 
-    if (state.PC >= CHIP8_MEMORY_SIZE - 1) {
-        fprintf(stderr, "[chip8] ERROR: attempt to read from an invalid memory address (out of bounds)\n");
+int chip8Init(const char* filepath) {
+    const Chip8Rom* rom = chip8LoadRom(filepath);
+    if (!rom)
         return 1;
-    }
+    resetMachine(&mainMachine, rom);
+    return 0;
+}
 
+//returns a new machine in the power-on state of rom; creating many machines from one ROM costs no file I/O nor decoding
+Chip8State* chip8CreateMachine(const Chip8Rom* rom) {
+    Chip8State* s = allocateMachine();
+    if (!s)
+        return NULL;
+    memset(s->pages, 0, sizeof(s->pages));
+    s->pageCount = 0;
+    resetMachine(s, rom);
+    return s;
+}
 
+Chip8State* chip8GetMachine() {
+    return &mainMachine;
+}
 
-    uint8_t instruction[2] = {state.memory[state.PC], state.memory[state.PC+1]};
-    //uint16_t opcode = instruction[0] + instruction[1]<<8;
-    uint16_t opcode = (instruction[0] << 8) | instruction[1];
+/* puts machine s in the exact state of source: registers and screen are copied, RAM pages are shared and only
+copied when one of the machines writes to them. Page table entries past pageCount and planes past planeCount
+are left out of the copy */
+static void copyMachine(Chip8State* s, const Chip8State* source) {
+    memcpy(s, source, offsetof(Chip8State, pages) + source->pageCount * sizeof(Chip8Page*));
+    memcpy(s->screen, source->screen, source->planeCount * sizeof(source->screen[0]));
+    for (int i = 0; i < s->pageCount; i++)
+        atomic_fetch_add_explicit(&s->pages[i]->refCount, 1, memory_order_relaxed);
+}
 
-    uint8_t first_nibble; //first nibble (4 bits)
-    uint8_t x;
-    uint8_t y;
-    uint8_t n;
-    uint8_t nn;
-    uint16_t nnn;
-    
-    first_nibble = instruction[0] >> 4;
-    x = instruction[0] & 0x0F;
-    y = instruction[1] >> 4;
-    n = instruction[1] & 0x0F;
-    nn = instruction[1];
-    nnn = ((instruction[0] & 0x0F) << 8) | instruction[1];
+//returns a new machine in the exact state of source
+Chip8State* chip8Fork(const Chip8State* source) {
+    uint64_t traceStart = monotonicNanoseconds();
+    Chip8State* fork = allocateMachine();
+    if (!fork)
+        return NULL;
+    copyMachine(fork, source);
+    traceRecord("snapshot (fork)", traceStart);
+    return fork;
+}
 
-    //generateTraceLog("tracelog", opcode);
+/* snapshot and restore without allocation: destination (any machine, the main one included) takes the exact
+state of source, its previous pages being released */
+void chip8CopyMachine(Chip8State* destination, const Chip8State* source) {
+    if (destination == source)
+        return;
+    uint64_t traceStart = monotonicNanoseconds();
+    for (int i = 0; i < destination->pageCount; i++)
+        chip8ReleasePage(destination->pages[i]);
+    copyMachine(destination, source);
+    traceRecord("snapshot", traceStart);
+}
 
-    state.PC += 2;
+//frees a machine returned by chip8Fork or chip8CreateMachine
+void chip8Free(Chip8State* s) {
+    if (!s || s == &mainMachine)
+        return;
+    for (int i = 0; i < s->pageCount; i++)
+        chip8ReleasePage(s->pages[i]);
+    #ifdef _WIN32
+        _aligned_free(s);
+    #else
+        free(s);
+    #endif
+}
 
-    switch (first_nibble) {
+const uint64_t* chip8GetScreen(const Chip8State* s) {
+    return &s->screen[0][0][0];
+}
 
-        case 0x0:
-            if(nnn==0x0E0) {
-                clearChip8Screen();
-                graphicsSetFrameChanged(true);
-            }
-            else if (nnn== 0x0EE) {
-                if (state.SP == 0) {
-                    fprintf(stderr, "[chip8] ERROR in executeInstruction: chip8 stack underflow\n");
-                    return 1;
-                }
-                state.SP--;
-                state.PC = state.stack[state.SP];
-            }
-            break;
+int chip8GetPlaneCount(const Chip8State* s) {
+    return s->planeCount;
+}
 
-        case 0x1:
-            state.PC=nnn;
-            break;
+uint64_t chip8GetInstructionCount(const Chip8State* s) {
+    return s->instructionCount;
+}
 
-        case 0x2:
-            if (state.SP>=STACK_SIZE) {
-                fprintf(stderr, "[chip8] ERROR in executeInstruction: chip8 stack overflow\n");
-                return 1;
-                break;
-            }
-            state.stack[state.SP]=state.PC;
-            state.SP++;
-            state.PC=nnn;
-            break;
+void chip8GetCodeWriteStats(const Chip8State* s, Chip8CodeWriteStats* stats) {
+    stats->codeWrites = s->codeWrites;
+    stats->executedLines = 0;
+    stats->modifiedLines = 0;
+    for (int i = 0; i < CHIP8_LINE_WORDS; i++) {
+        stats->executedLines += (uint32_t)__builtin_popcountll(s->executedLines[i]);
+        stats->modifiedLines += (uint32_t)__builtin_popcountll(s->executedLines[i] & s->writtenLines[i]);
+    }
+    stats->translated = findCompiledProgram(s->rom, (Chip8Profile)s->profile) != NULL;
+    stats->translationDropped = stats->translated && !s->compiled;
+}
 
-        case 0x3:
-            if (state.V[x]==nn)
-                state.PC+=2;
-            break;
+bool chip8IsSoundOn(const Chip8State* s) {
+    return s->sound_timer > 0;
+}
 
-        case 0x4:
-            if (state.V[x]!=nn)
-                state.PC+=2;
-            break;
+//an XO-CHIP program that never loaded a pattern (or only an empty one) gets the plain buzzer
+const uint8_t* chip8GetAudioPattern(const Chip8State* s, int* pitch) {
+    if (s->profile != CHIP8_PROFILE_XOCHIP)
+        return NULL;
+    for (int i = 0; i < (int)sizeof(s->audioPattern); i++) {
+        if (s->audioPattern[i] != 0) {
+            *pitch = s->pitch;
+            return s->audioPattern;
+        }
+    }
+    return NULL;
+}
 
+void chip8GetScreenSize(const Chip8State* s, int* width, int* height) {
+    *width = s->hires ? CHIP8_HIRES_DISPLAY_WIDTH : CHIP8_DISPLAY_WIDTH;
+    *height = s->hires ? CHIP8_HIRES_DISPLAY_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+}
+
+const uint64_t* getChip8Screen() {
+    return &mainMachine.screen[0][0][0];
+}
+
+bool chip8DidScreenChange() {
+    return mainMachine.screenChanged;
+}
+
+void chip8SetScreenChanged(bool newValue) {
+    mainMachine.screenChanged = newValue;
+}
+
+Chip8Instruction chip8DecodeInstruction(uint8_t high, uint8_t low) {
+    Chip8Instruction instruction = {
+        .op = CHIP8_OP_NOP,
+        .x = high & 0x0F,
+        .y = low >> 4,
+        .n = low & 0x0F,
+        .nnn = ((high & 0x0F) << 8) | low
+    };
+    uint8_t n = instruction.n;
+    uint8_t nn = low;
+
+    switch (high >> 4) {
+        case 0x0:
+            if (instruction.nnn == 0x0E0)
+                instruction.op = CHIP8_OP_CLS;
+            else if (instruction.nnn == 0x0EE)
+                instruction.op = CHIP8_OP_RET;
+            else if ((instruction.nnn & 0xFF0) == 0x0C0)
+                instruction.op = CHIP8_OP_SCD;
+            else if (instruction.nnn == 0x0FB)
+                instruction.op = CHIP8_OP_SCR;
+            else if (instruction.nnn == 0x0FC)
+                instruction.op = CHIP8_OP_SCL;
+            else if (instruction.nnn == 0x0FD)
+                instruction.op = CHIP8_OP_EXIT;
+            else if (instruction.nnn == 0x0FE)
+                instruction.op = CHIP8_OP_LOW;
+            else if (instruction.nnn == 0x0FF)
+                instruction.op = CHIP8_OP_HIGH;
+            else if ((instruction.nnn & 0xFF0) == 0x0D0)
+                instruction.op = CHIP8_OP_SCU;
+            break;
+        case 0x1: instruction.op = CHIP8_OP_JP; break;
+        case 0x2: instruction.op = CHIP8_OP_CALL; break;
+        case 0x3: instruction.op = CHIP8_OP_SE_IMM; break;
+        case 0x4: instruction.op = CHIP8_OP_SNE_IMM; break;
         case 0x5:
-            if (n==0) {
-                if (state.V[x]==state.V[y])
-                    state.PC+=2;
+            if (n == 0)
+                instruction.op = CHIP8_OP_SE_REG;
+            else if (n == 2)
+                instruction.op = CHIP8_OP_SAVE_RANGE;
+            else if (n == 3)
+                instruction.op = CHIP8_OP_LOAD_RANGE;
+            break;
+        case 0x6: instruction.op = CHIP8_OP_LD_IMM; break;
+        case 0x7: instruction.op = CHIP8_OP_ADD_IMM; break;
+        case 0x8:
+            switch (n) {
+                case 0x0: instruction.op = CHIP8_OP_LD_REG; break;
+                case 0x1: instruction.op = CHIP8_OP_OR; break;
+                case 0x2: instruction.op = CHIP8_OP_AND; break;
+                case 0x3: instruction.op = CHIP8_OP_XOR; break;
+                case 0x4: instruction.op = CHIP8_OP_ADD_REG; break;
+                case 0x5: instruction.op = CHIP8_OP_SUB; break;
+                case 0x6: instruction.op = CHIP8_OP_SHR; break;
+                case 0x7: instruction.op = CHIP8_OP_SUBN; break;
+                case 0xE: instruction.op = CHIP8_OP_SHL; break;
             }
             break;
-
-        case 0x6:
-            state.V[x]=nn;
+        case 0x9:
+            if (n == 0)
+                instruction.op = CHIP8_OP_SNE_REG;
             break;
-
-        case 0x7:
-            state.V[x]+=nn;
+        case 0xA: instruction.op = CHIP8_OP_LD_I; break;
+        case 0xB: instruction.op = CHIP8_OP_JP_V0; break;
+        case 0xC: instruction.op = CHIP8_OP_RND; break;
+        case 0xD: instruction.op = CHIP8_OP_DRW; break;
+        case 0xE:
+            if (nn == 0x9E)
+                instruction.op = CHIP8_OP_SKP;
+            else if (nn == 0xA1)
+                instruction.op = CHIP8_OP_SKNP;
             break;
-
-        case 0x8:
-            switch(n) {
-                case 0x0:
-                    state.V[x]=state.V[y];
-                    break;
-                case 0x1:
-                    state.V[x]|=state.V[y];
-                    break;
-                case 0x2:
-                    state.V[x]&=state.V[y];
-                    break;
-                case 0x3:
-                    state.V[x]^=state.V[y];
-                    break;
-                case 0x4:
-                    uint16_t result = state.V[x] + state.V[y];
-                    state.V[x] = (uint8_t) result;
-                    if (result>255)
-                        state.V[0xF]=1;
-                    else
-                        state.V[0xF]=0;
-                    break;
-                case 0x5:
-                    uint8_t tmp1 = state.V[x];
-                    state.V[x] = state.V[x] - state.V[y];
-                    state.V[0xF] = (tmp1 >= state.V[y]) ? 1 : 0;             
-                    break;
-                case 0x6: //right shift
-                    //state.V[x]=state.V[y];
-                    uint8_t tmp2 = state.V[x];
-                    state.V[x]>>=1;
-                    state.V[0xF]=tmp2 & 0b00000001;
-                    break;
-                case 0x7:
-                    state.V[x] = state.V[y] - state.V[x];               
-                    state.V[0xF] = (state.V[y] >= state.V[x]) ? 1 : 0;
+        case 0xF:
+            switch (nn) {
+                case 0x07: instruction.op = CHIP8_OP_LD_VX_DT; break;
+                case 0x0A: instruction.op = CHIP8_OP_LD_VX_K; break;
+                case 0x15: instruction.op = CHIP8_OP_LD_DT_VX; break;
+                case 0x18: instruction.op = CHIP8_OP_LD_ST_VX; break;
+                case 0x1E: instruction.op = CHIP8_OP_ADD_I; break;
+                case 0x29: instruction.op = CHIP8_OP_LD_F; break;
+                case 0x33: instruction.op = CHIP8_OP_LD_B; break;
+                case 0x55: instruction.op = CHIP8_OP_LD_MEM_VX; break;
+                case 0x65: instruction.op = CHIP8_OP_LD_VX_MEM; break;
+                case 0x30: instruction.op = CHIP8_OP_LD_HF; break;
+                case 0x75: instruction.op = CHIP8_OP_LD_R_VX; break;
+                case 0x85: instruction.op = CHIP8_OP_LD_VX_R; break;
+                case 0x3A: instruction.op = CHIP8_OP_PITCH; break;
+                case 0x01: instruction.op = CHIP8_OP_PLANE; break;
+                case 0x00:
+                    if (instruction.x == 0)
+                        instruction.op = CHIP8_OP_LD_I_LONG;
                     break;
-
-                case 0xE: //left shift
-                    //state.V[x]=state.V[y];
-                    uint8_t tmp3 = state.V[x];
-                    state.V[x]<<=1;
-                    state.V[0xF]=tmp3 >> 7;
+                case 0x02:
+                    if (instruction.x == 0)
+                        instruction.op = CHIP8_OP_AUDIO;
                     break;
             }
             break;
+    }
+    return instruction;
+}
 
-        case 0x9:
-            if (n==0) {
-                if (state.V[x]!=state.V[y])
-                    state.PC+=2;
-            }
-            break;
+/* the instruction at PC comes from the ROM's shared predecoded table as long as the line(s) holding it were never
+written by this machine, otherwise it is decoded from RAM; so is an instruction past the decoded part of the image
+or wrapping around the end of memory. Its line is recorded as executed, writes to it being self-modification */
+static inline Chip8Instruction fetchInstruction(Chip8State* s) {
+    uint16_t pc = s->PC & s->addressMask;
+    uint16_t next = (pc + 1) & s->addressMask;
+    s->executedLines[CHIP8_LINE_WORD(pc)] |= CHIP8_LINE_BIT(pc);
+    if (next > pc && next < s->rom->decodedSize
+        && !(s->writtenLines[CHIP8_LINE_WORD(pc)] & CHIP8_LINE_BIT(pc))
+        && !(s->writtenLines[CHIP8_LINE_WORD(next)] & CHIP8_LINE_BIT(next)))
+        return s->rom->decoded[pc];
+    return chip8DecodeInstruction(READ_MEMORY(s, pc), READ_MEMORY(s, next));
+}
 
-        case 0xA:
-            state.I=nnn;
-            break;
+static void buildSpriteRows(Chip8State* s, uint16_t I, uint8_t n, uint8_t x, bool clip, uint64_t* rows) {
+    for (int i = 0; i < n; i++) {
+        uint64_t row = (uint64_t)READ_MEMORY(s, I + i) << 56;
+        if (clip)
+            rows[i] = row >> x;
+        else
+            rows[i] = x ? (row >> x) | (row << (64 - x)) : row; //rotation: pixels past the right edge wrap around
+    }
+}
 
-        case 0xB:
-            state.PC=nnn+state.V[0];
-            break;
+/* returns the n row masks of the sprite stored at address I and drawn at column x,
+building (and caching) them if they are not cached yet */
+static const uint64_t* spriteCacheLookup(Chip8State* s, uint16_t I, uint8_t n, uint8_t x, bool clip) {
+    I &= s->addressMask;
+    uint8_t offset = I & (CHIP8_PAGE_SIZE - 1);
+    if (offset + n > CHIP8_PAGE_SIZE) { //sprites straddling two pages are not cached
+        static _Thread_local uint64_t rows[SPRITE_MAX_ROWS];
+        buildSpriteRows(s, I, n, x, clip, rows);
+        return rows;
+    }
 
-        case 0xC:
-            state.V[x]=(rand()%256)&nn;
-            break;
+    const Chip8Page* page = s->pages[I >> CHIP8_PAGE_SHIFT];
+    SpriteCacheEntry* entry = &spriteCache[(I ^ (I >> 6) ^ (x << 2) ^ n) & (SPRITE_CACHE_SIZE - 1)];
+    if (entry->page == page && entry->generation == page->generation && entry->offset == offset && entry->n == n && entry->x == x && entry->clip == clip)
+        return entry->rows;
+
+    buildSpriteRows(s, I, n, x, clip, entry->rows);
+    entry->page = page;
+    entry->generation = page->generation;
+    entry->offset = offset;
+    entry->n = n;
+    entry->x = x;
+    entry->clip = clip;
+    return entry->rows;
+}
 
-        case 0xD:
-            state.V[0xF] = 0;
-            uint8_t vx = state.V[x];
-            uint8_t vy = state.V[y];
-            for (int i = 0; i < n; i++) {
-                if (state.I + i >= CHIP8_MEMORY_SIZE) {
-                    fprintf(stderr, "[chip8] ERROR: attemp to draw sprite out of memory bounds\n");
-                    return 1;
-                }
-                uint8_t byte = state.memory[state.I + i];
-                for (int j = 0; j < 8; j++) {
-                    uint8_t bit = (byte >> (7 - j)) & 1;
-                    uint8_t xPos = (vx + j) % CHIP8_DISPLAY_WIDTH;
-                    uint8_t yPos = (vy + i) % CHIP8_DISPLAY_HEIGHT;
-                    if (bit) {
-                        if (state.screen[yPos][xPos])
-                            state.V[0xF] = 1;
-                        state.screen[yPos][xPos] ^= 1;
-                    }
-                }
-            }
-            graphicsSetFrameChanged(true);
-            break;
-        
-        case 0xE:
-            if (nn == 0x9E) {
-                if (state.keypad[state.V[x]])
-                    state.PC += 2;
-            }
-            else if (nn == 0xA1) {
-                if (!state.keypad[state.V[x]])
-                    state.PC += 2;
-            }
-            break;
+//(*hi, *lo) >>= x, with 0 <= x < 128
+static inline void shiftRight128(uint64_t* hi, uint64_t* lo, int x) {
+    if (x >= 64) {
+        *lo = *hi >> (x - 64);
+        *hi = 0;
+    }
+    else if (x > 0) {
+        *lo = (*lo >> x) | (*hi << (64 - x));
+        *hi >>= x;
+    }
+}
 
-        case 0xF:
-            if (nn==0x07)
-                state.V[x]=state.delay_timer;
-            else if (nn==0x15)
-                state.delay_timer=state.V[x];
-            else if (nn==0x18)
-                state.sound_timer=state.V[x];
-            else if (nn==0x1E)
-                state.I+=state.V[x];
-            else if (nn==0x0A) {
-
-                if (state.isHalted == false) {
-                    state.isHalted=true;
-                    state.keyPressedDuringHalt=-1;
-                    state.PC-=2;
-                    break;
-                }
-
-                if (state.keyPressedDuringHalt == -1) {
-                    for (int i=0; i<16; i++) {
-                        if (state.keypad[i]==true) {
-                            state.keyPressedDuringHalt=i;
-                            break;
-                        }
-                    }
-                    state.PC-=2;
-                    break;
-                }
-
-                if (state.keyPressedDuringHalt<0) {
-                    fprintf(stderr, "[chip8] ERROR: %d is an invalid value for state.keyPressedDuringHalt", state.keyPressedDuringHalt);
-                    return 1;
-                }
-                else {
-                    if (state.keypad[state.keyPressedDuringHalt] == false) {
-                        state.isHalted == false;
-                        state.V[x] = state.keyPressedDuringHalt;
-                        state.keyPressedDuringHalt = -1;
-                    }
-                    else {
-                        state.PC-=2;
-                    }
-                }
+/* DXYN for sprites the cache does not cover: 16x16 sprites (DXY0) and any sprite in high resolution.
+Every sprite row (read from address) is placed into a 128-bit row mask (two words) and XORed into plane */
+static bool drawWideSprite(Chip8State* s, uint64_t (*plane)[CHIP8_SCREEN_ROW_WORDS], uint16_t address, uint8_t vx, uint8_t vy, uint8_t n, bool clip) {
+    int width = s->hires ? CHIP8_HIRES_DISPLAY_WIDTH : CHIP8_DISPLAY_WIDTH;
+    int height = s->hires ? CHIP8_HIRES_DISPLAY_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+    bool wide = n == 0; //16x16 sprite, two bytes per row
+    int nbOfRows = wide ? 16 : n;
+    int x = vx % width;
+    int y = vy % height;
+    if (clip && y + nbOfRows > height)
+        nbOfRows = height - y;
+
+    uint64_t collisions = 0;
+    for (int i = 0; i < nbOfRows; i++) {
+        uint64_t bits = wide
+            ? (uint64_t)((READ_MEMORY(s, address + 2*i) << 8) | READ_MEMORY(s, address + 2*i + 1)) << 48
+            : (uint64_t)READ_MEMORY(s, address + i) << 56;
+        uint64_t hi = bits, lo = 0;
+        if (width == CHIP8_HIRES_DISPLAY_WIDTH) {
+            shiftRight128(&hi, &lo, x);
+            if (!clip && x > CHIP8_HIRES_DISPLAY_WIDTH - 16) //pixels past the right edge wrap around
+                hi |= bits << (CHIP8_HIRES_DISPLAY_WIDTH - x);
+        }
+        else {
+            hi = clip || x == 0 ? bits >> x : (bits >> x) | (bits << (64 - x));
+        }
+        uint64_t* row = plane[(y + i) % height];
+        collisions |= (row[0] & hi) | (row[1] & lo);
+        row[0] ^= hi;
+        row[1] ^= lo;
+    }
+    return collisions != 0;
+}
 
+/* DXYN into one plane, the sprite being read from address; returns whether a pixel was turned off.
+Low resolution 8-pixel-wide sprites (the common case) use the sprite cache: one XOR per row. Called with
+constant clip and schip arguments by the interpreters, so each one gets its own specialized copy */
+static inline bool drawSprite(Chip8State* s, uint64_t (*plane)[CHIP8_SCREEN_ROW_WORDS], uint16_t address, uint8_t vx, uint8_t vy, uint8_t n, bool clip, bool schip) {
+    if (schip && (s->hires || n == 0))
+        return drawWideSprite(s, plane, address, vx, vy, n, clip);
+
+    const uint64_t* rows = spriteCacheLookup(s, address, n, vx % CHIP8_DISPLAY_WIDTH, clip);
+    uint8_t y = vy % CHIP8_DISPLAY_HEIGHT;
+    int nbOfRows = (clip && y + n > CHIP8_DISPLAY_HEIGHT) ? CHIP8_DISPLAY_HEIGHT - y : n;
+    uint64_t collisions = 0;
+    for (int i = 0; i < nbOfRows; i++) {
+        uint64_t* screenRow = &plane[(y + i) % CHIP8_DISPLAY_HEIGHT][0];
+        collisions |= *screenRow & rows[i];
+        *screenRow ^= rows[i];
+    }
+    return collisions != 0;
+}
+
+//00E0: clears the selected planes
+static void clearPlanes(Chip8State* s, uint8_t planes) {
+    for (int p = 0; p < CHIP8_MAX_PLANES; p++)
+        if ((planes >> p) & 1)
+            memset(s->screen[p], 0, sizeof(s->screen[p]));
+    s->screenChanged = true;
+}
+
+//00CN and 00DN: scroll the selected planes down (n > 0) or up (n < 0) by |n| pixels (rows are whole words, so this is one memmove per plane)
+static void scrollVertically(Chip8State* s, int n, uint8_t planes) {
+    int height = s->hires ? CHIP8_HIRES_DISPLAY_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+    int distance = n > 0 ? n : -n;
+    if (distance > height)
+        distance = height;
+    for (int p = 0; p < CHIP8_MAX_PLANES; p++) {
+        if (!((planes >> p) & 1))
+            continue;
+        uint64_t (*plane)[CHIP8_SCREEN_ROW_WORDS] = s->screen[p];
+        if (n > 0) {
+            memmove(plane[distance], plane[0], (size_t)(height - distance) * sizeof(plane[0]));
+            memset(plane[0], 0, (size_t)distance * sizeof(plane[0]));
+        }
+        else {
+            memmove(plane[0], plane[distance], (size_t)(height - distance) * sizeof(plane[0]));
+            memset(plane[height - distance], 0, (size_t)distance * sizeof(plane[0]));
+        }
+    }
+    s->screenChanged = true;
+}
+
+//00FB and 00FC: scroll the selected planes 4 pixels right (n > 0) or left (n < 0), shifting each row's words
+static void scrollHorizontally(Chip8State* s, int n, uint8_t planes) {
+    int height = s->hires ? CHIP8_HIRES_DISPLAY_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+    for (int p = 0; p < CHIP8_MAX_PLANES; p++) {
+        if (!((planes >> p) & 1))
+            continue;
+        for (int y = 0; y < height; y++) {
+            uint64_t* row = s->screen[p][y];
+            if (!s->hires)
+                row[0] = n > 0 ? row[0] >> n : row[0] << -n;
+            else if (n > 0) {
+                row[1] = (row[1] >> n) | (row[0] << (64 - n));
+                row[0] >>= n;
             }
-            else if (nn==0x29) {
-                state.I = FONT_DATA_POSITION + (state.V[x]&((uint8_t)0x0F)) * 5;
-            }
-            else if (nn==0x33) {
-                /* if (state.I+2>=CHIP8_MEMORY_SIZE) {
-                    fprintf(stderr, "[chip8] ERROR: attempt to write out of memory bounds\n");
-                    return 1;
-                } */
-                uint8_t n = state.V[x];
-                state.memory[state.I]=n/100;
-                state.memory[state.I+1]=(n/10)%10;
-                state.memory[state.I+2]=n%10;
-            }
-            else if (nn==0x55) {
-                for (int k=0; k<=x; k++) {
-                    state.memory[state.I+k] = state.V[k];
-                }
-                state.I+=(x+1);
-            }
-            else if (nn==0x65) {
-                for (int k=0; k<=x; k++) {
-                    state.V[k]=state.memory[state.I+k];
-                }
-                state.I+=(x+1);
+            else {
+                row[0] = (row[0] << -n) | (row[1] >> (64 + n));
+                row[1] <<= -n;
             }
-            break;
+        }
+    }
+    s->screenChanged = true;
+}
 
-        default:
-            fprintf(stderr, "[chip8] ERROR in executeInstruction: unknown instruction: %x%x\n", instruction[0], instruction[1]);
-            return 1;
-            break;
+//00FE and 00FF: switching resolution clears every plane
+static void setResolution(Chip8State* s, bool hires) {
+    s->hires = hires;
+    memset(s->screen, 0, s->planeCount * sizeof(s->screen[0]));
+    s->screenChanged = true;
+}
+
+//FN01: selects the planes drawn by the display instructions; planes selected for the first time start cleared
+static void selectPlanes(Chip8State* s, uint8_t planes) {
+    int planeCount = planes ? 32 - __builtin_clz(planes) : 0;
+    if (planeCount > s->planeCount) {
+        memset(s->screen[s->planeCount], 0, (size_t)(planeCount - s->planeCount) * sizeof(s->screen[0]));
+        s->planeCount = (uint8_t)planeCount;
+    }
+    s->planeMask = planes;
+}
+
+static const Chip8CountedLoop* findCountedLoop(const Chip8Rom* rom, uint16_t head) {
+    uint32_t low = 0, high = rom->loopCount;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (rom->loops[middle].head < head)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return &rom->loops[low]; //head is a loop head
+}
+
+/* the iteration (from 1) in which the skip of a counting loop leaves it, its counter starting at value; 0 if it never
+does. For 3XNN, it is the first j with value + j*step = limit (mod 256): with step = 2^t * odd, j*odd = distance/2^t
+(mod 256/2^t), solved with the inverse of odd */
+static int countedLoopExit(const Chip8CountedLoop* loop, uint8_t value) {
+    uint8_t step = loop->step;
+    if (!loop->exitWhenEqual)
+        return (uint8_t)(value + step) != loop->limit ? 1 : step != 0 ? 2 : 0;
+    uint8_t distance = (uint8_t)(loop->limit - value);
+    if (step == 0)
+        return distance == 0 ? 1 : 0;
+    int t = __builtin_ctz(step);
+    if (distance & ((1u << t) - 1))
+        return 0;
+    uint32_t modulus = 256u >> t;
+    uint32_t odd = step >> t;
+    uint32_t inverse = odd; //Newton's iteration, each step doubling the correct low bits (3, 6, 12)
+    inverse *= 2 - odd * inverse;
+    inverse *= 2 - odd * inverse;
+    uint32_t j = ((uint32_t)(distance >> t) * inverse) & (modulus - 1);
+    return j == 0 ? (int)modulus : (int)j;
+}
+
+//whether the FX55 of an iteration of a fill loop starting with I = index writes over the loop's own code
+static bool fillOverwritesLoop(const Chip8State* s, const Chip8CountedLoop* loop, uint16_t index) {
+    uint16_t base = loop->storeFirst ? index : (uint16_t)(index + s->V[loop->increment]);
+    for (int k = 0; k <= loop->stored; k++)
+        if ((uint16_t)(((base + k) & s->addressMask) - loop->head) < 2 * loop->length)
+            return true;
+    return false;
+}
+
+int chip8RunCountedLoop(Chip8State* s, int budget) {
+    uint16_t head = s->PC;
+    if (!chip8IsCountedLoopHead(s->rom, head))
+        return 0;
+    const Chip8CountedLoop* loop = findCountedLoop(s->rom, head);
+    uint16_t last = (uint16_t)(head + 2 * loop->length - 1);
+    //the machine must still run the image's code there (a loop spans two lines at most)
+    if ((s->writtenLines[CHIP8_LINE_WORD(head)] & CHIP8_LINE_BIT(head))
+        || (s->writtenLines[CHIP8_LINE_WORD(last)] & CHIP8_LINE_BIT(last)))
+        return 0;
+
+    int exitIteration;
+    if (loop->kind == CHIP8_LOOP_TIMER_WAIT) //the delay timer only ticks between frames
+        exitIteration = (s->delay_timer == loop->limit) == loop->exitWhenEqual ? 1 : 0;
+    else
+        exitIteration = countedLoopExit(loop, s->V[loop->counter]);
+    //the iteration that leaves the loop skips its jump back
+    bool leaves = exitIteration > 0 && exitIteration * loop->length - 1 <= budget;
+    int iterations = leaves ? exitIteration : budget / loop->length;
+
+    if (loop->kind == CHIP8_LOOP_FILL) {
+        bool memoryIncrement = chip8ProfileQuirks[s->profile].memoryIncrement;
+        for (int i = 0; i < iterations; i++) {
+            if (fillOverwritesLoop(s, loop, s->I)) { //from there on, the interpreter runs what it wrote
+                iterations = i;
+                leaves = false;
+                break;
+            }
+            if (!loop->storeFirst)
+                s->I += s->V[loop->increment];
+            for (int k = 0; k <= loop->stored; k++)
+                writeMemory(s, (uint16_t)(s->I + k), s->V[k]);
+            if (memoryIncrement)
+                s->I += loop->stored + 1;
+            if (loop->storeFirst)
+                s->I += s->V[loop->increment];
+        }
     }
+    if (iterations == 0)
+        return 0;
+
+    if (loop->kind == CHIP8_LOOP_TIMER_WAIT)
+        s->V[loop->counter] = s->delay_timer;
+    else
+        s->V[loop->counter] = (uint8_t)(s->V[loop->counter] + iterations * loop->step);
+    int executed = iterations * loop->length - (leaves ? 1 : 0);
+    s->PC = leaves ? (uint16_t)(last + 1) : head;
+    s->instructionCount += (uint64_t)executed;
+    s->executedLines[CHIP8_LINE_WORD(head)] |= CHIP8_LINE_BIT(head);
+    s->executedLines[CHIP8_LINE_WORD(last)] |= CHIP8_LINE_BIT(last);
+    return executed;
+}
+
+/* one interpreter per quirk profile, generated from chip8_interpreter.inc
+(default: the behavior this interpreter always had, which the bundled ROMs expect) */
+#define INTERPRETER_NAME executeInstructionsDefault
+#define QUIRK_VF_RESET 0
+#define QUIRK_MEMORY_INCREMENT 1
+#define QUIRK_SHIFT_VX 1
+#define QUIRK_JUMP_VX 0
+#define QUIRK_CLIP 0
+#define QUIRK_DISPLAY_WAIT 0
+#define SUPPORTS_SCHIP 0
+#define SUPPORTS_XOCHIP 0
+#define TIMING_VIP_CYCLES 0
+#include "chip8_interpreter.inc"
+
+//execution cycles of every operation on the COSMAC VIP (fetch and decode, and data-dependent parts, excluded)
+static const int16_t vipCycleCosts[CHIP8_OP_COUNT] = {
+    [CHIP8_OP_CLS] = 3078, [CHIP8_OP_RET] = 10, [CHIP8_OP_JP] = 12, [CHIP8_OP_CALL] = 26,
+    [CHIP8_OP_SE_IMM] = 10, [CHIP8_OP_SNE_IMM] = 10, [CHIP8_OP_SE_REG] = 14, [CHIP8_OP_LD_IMM] = 6,
+    [CHIP8_OP_ADD_IMM] = 10, [CHIP8_OP_LD_REG] = 44, [CHIP8_OP_OR] = 44, [CHIP8_OP_AND] = 44,
+    [CHIP8_OP_XOR] = 44, [CHIP8_OP_ADD_REG] = 44, [CHIP8_OP_SUB] = 44, [CHIP8_OP_SHR] = 44,
+    [CHIP8_OP_SUBN] = 44, [CHIP8_OP_SHL] = 44, [CHIP8_OP_SNE_REG] = 14, [CHIP8_OP_LD_I] = 12,
+    [CHIP8_OP_JP_V0] = 22, [CHIP8_OP_RND] = 36, [CHIP8_OP_DRW] = 26, [CHIP8_OP_SKP] = 14,
+    [CHIP8_OP_SKNP] = 14, [CHIP8_OP_LD_VX_DT] = 10, [CHIP8_OP_LD_VX_K] = 18, [CHIP8_OP_LD_DT_VX] = 10,
+    [CHIP8_OP_LD_ST_VX] = 10, [CHIP8_OP_ADD_I] = 16, [CHIP8_OP_LD_F] = 16, [CHIP8_OP_LD_B] = 80,
+    [CHIP8_OP_LD_MEM_VX] = 14, [CHIP8_OP_LD_VX_MEM] = 14
+};
+
+//data-dependent part of the cost of DXYN: rows is the number of rows actually drawn
+static inline int vipSpriteCycles(uint8_t vx, int rows) {
+    int shift = vx % 8;
+    return rows * (VIP_SPRITE_ROW_CYCLES + shift * VIP_SPRITE_SHIFT_CYCLES + (shift ? VIP_SPRITE_SPLIT_CYCLES : 0));
+}
+
+//COSMAC VIP (original CHIP-8 interpreter)
+#define INTERPRETER_NAME executeInstructionsVip
+#define QUIRK_VF_RESET 1
+#define QUIRK_MEMORY_INCREMENT 1
+#define QUIRK_SHIFT_VX 0
+#define QUIRK_JUMP_VX 0
+#define QUIRK_CLIP 1
+#define QUIRK_DISPLAY_WAIT 1
+#define SUPPORTS_SCHIP 0
+#define SUPPORTS_XOCHIP 0
+#define TIMING_VIP_CYCLES 0
+#include "chip8_interpreter.inc"
+
+//COSMAC VIP with its timing: instructions run while the frame's machine cycles last (CHIP8_TIMING_VIP)
+#define INTERPRETER_NAME executeInstructionsVipCycles
+#define QUIRK_VF_RESET 1
+#define QUIRK_MEMORY_INCREMENT 1
+#define QUIRK_SHIFT_VX 0
+#define QUIRK_JUMP_VX 0
+#define QUIRK_CLIP 1
+#define QUIRK_DISPLAY_WAIT 1
+#define SUPPORTS_SCHIP 0
+#define SUPPORTS_XOCHIP 0
+#define TIMING_VIP_CYCLES 1
+#include "chip8_interpreter.inc"
+
+//SUPER-CHIP 1.1 (HP 48 calculators)
+#define INTERPRETER_NAME executeInstructionsSchip
+#define QUIRK_VF_RESET 0
+#define QUIRK_MEMORY_INCREMENT 0
+#define QUIRK_SHIFT_VX 1
+#define QUIRK_JUMP_VX 1
+#define QUIRK_CLIP 1
+#define QUIRK_DISPLAY_WAIT 0
+#define SUPPORTS_SCHIP 1
+#define SUPPORTS_XOCHIP 0
+#define TIMING_VIP_CYCLES 0
+#include "chip8_interpreter.inc"
+
+//XO-CHIP (Octo)
+#define INTERPRETER_NAME executeInstructionsXoChip
+#define QUIRK_VF_RESET 0
+#define QUIRK_MEMORY_INCREMENT 1
+#define QUIRK_SHIFT_VX 0
+#define QUIRK_JUMP_VX 0
+#define QUIRK_CLIP 0
+#define QUIRK_DISPLAY_WAIT 0
+#define SUPPORTS_SCHIP 1
+#define SUPPORTS_XOCHIP 1
+#define TIMING_VIP_CYCLES 0
+#include "chip8_interpreter.inc"
+
+static int (*const interpreters[CHIP8_PROFILE_COUNT])(Chip8State*, int) = {
+    [CHIP8_PROFILE_DEFAULT] = executeInstructionsDefault,
+    [CHIP8_PROFILE_VIP] = executeInstructionsVip,
+    [CHIP8_PROFILE_SCHIP] = executeInstructionsSchip,
+    [CHIP8_PROFILE_XOCHIP] = executeInstructionsXoChip
+};
+
+//must match the macros of the instantiations above
+const Chip8Quirks chip8ProfileQuirks[CHIP8_PROFILE_COUNT] = {
+    [CHIP8_PROFILE_DEFAULT] = {.vfReset = false, .memoryIncrement = true, .shiftVx = true, .jumpVx = false,
+        .clip = false, .displayWait = false, .schip = false, .xochip = false},
+    [CHIP8_PROFILE_VIP] = {.vfReset = true, .memoryIncrement = true, .shiftVx = false, .jumpVx = false,
+        .clip = true, .displayWait = true, .schip = false, .xochip = false},
+    [CHIP8_PROFILE_SCHIP] = {.vfReset = false, .memoryIncrement = false, .shiftVx = true, .jumpVx = true,
+        .clip = true, .displayWait = false, .schip = true, .xochip = false},
+    [CHIP8_PROFILE_XOCHIP] = {.vfReset = false, .memoryIncrement = true, .shiftVx = false, .jumpVx = false,
+        .clip = false, .displayWait = false, .schip = true, .xochip = true}
+};
+
+int chip8InterpretInstructions(Chip8State* s, int nbOfInstructions) {
+    return interpreters[s->profile](s, nbOfInstructions);
+}
 
+static const char* const profileNames[CHIP8_PROFILE_COUNT] = {
+    [CHIP8_PROFILE_DEFAULT] = "default",
+    [CHIP8_PROFILE_VIP] = "vip",
+    [CHIP8_PROFILE_SCHIP] = "schip",
+    [CHIP8_PROFILE_XOCHIP] = "xochip"
+};
+
+//returns the profile called name ("default", "vip", "schip" or "xochip"), or -1 if there is none
+int chip8ProfileFromName(const char* name) {
+    for (int i = 0; i < CHIP8_PROFILE_COUNT; i++)
+        if (strcmp(name, profileNames[i]) == 0)
+            return i;
+    return -1;
+}
+
+//selects the interpreter variant of machine s (or the translation of its ROM for that profile, if one is linked); the XO-CHIP profile also extends its memory to 64 KB
+void chip8SetProfile(Chip8State* s, Chip8Profile profile) {
+    s->profile = (uint8_t)profile;
+    if (profile != CHIP8_PROFILE_VIP)
+        s->timing = CHIP8_TIMING_FIXED;
+    setPageCount(s, profile == CHIP8_PROFILE_XOCHIP ? XOCHIP_PAGE_COUNT : CHIP8_PAGE_COUNT);
+
+    //a translation is only valid for the ROM's own memory: a machine that already wrote to it stays interpreted
+    bool unmodified = true;
+    for (int i = 0; i < s->pageCount; i++)
+        unmodified &= s->pages[i] == s->rom->pages[i];
+    s->compiled = unmodified ? findCompiledProgram(s->rom, profile) : NULL;
+    s->jit = chip8JitFor(s->rom, profile);
+}
+
+int chip8SetTiming(Chip8State* s, Chip8Timing timing) {
+    if (timing == CHIP8_TIMING_VIP && s->profile != CHIP8_PROFILE_VIP) {
+        fprintf(stderr, "[chip8] ERROR: the VIP timing model needs the VIP profile\n");
+        return 1;
+    }
+    s->timing = (uint8_t)timing;
+    s->cycleBudget = 0;
     return 0;
+}
+
+
+void chip8UpdateKeypadState(uint16_t keys) {
+    mainMachine.keypad = keys;
+}
 
+void chip8SetKeypad(Chip8State* s, uint16_t keys) {
+    s->keypad = keys;
 }
 
-static int executeInstructions(int nbOfInstructions) {
-    for (int i=0; i<nbOfInstructions; i++)
-        if (executeInstruction() != 0)
+/* runs one slice of a 60 Hz frame of machine s: slices share the frame's instructions (or VIP cycles) evenly,
+and the timers tick once the last one has run */
+int chip8RunFrameSlice(Chip8State* s, int slice, int nbOfSlices) {
+    if (!s->waitingForVblank) {
+        int result;
+        if (s->timing == CHIP8_TIMING_VIP) {
+            int budget = VIP_CYCLES_PER_FRAME - VIP_DISPLAY_CYCLES;
+            s->cycleBudget += (slice + 1) * budget / nbOfSlices - slice * budget / nbOfSlices;
+            result = executeInstructionsVipCycles(s, 0);
+        }
+        else {
+            int nbOfInstructions = (slice + 1) * INSTRUCTIONS_PER_FRAME / nbOfSlices - slice * INSTRUCTIONS_PER_FRAME / nbOfSlices;
+            if (s->compiled)
+                result = s->compiled->run(s, nbOfInstructions);
+            else if (s->jit)
+                result = chip8JitRun(s, nbOfInstructions);
+            else
+                result = interpreters[s->profile](s, nbOfInstructions);
+        }
+        if (result != 0)
             return 1;
+    }
+    if (slice == nbOfSlices - 1) {
+        s->waitingForVblank = false;
+        if (s->delay_timer>0)
+            s->delay_timer--;
+        if (s->sound_timer>0)
+            s->sound_timer--;
+    }
     return 0;
 }
 
-void chip8UpdateKeypadState(bool keys[16]) {
-    for (int i = 0; i<16; i++) {
-        state.keypad[i]=keys[i];
-    }
+//runs one 60 Hz frame of machine s: a frame's worth of instructions, then one tick of the timers
+int chip8RunFrame(Chip8State* s) {
+    return chip8RunFrameSlice(s, 0, 1);
 }
 
 int chip8Update() {
-    if (executeInstructions((int)INSTRUCTIONS_PER_SECOND/TARGET_FPS) != 0)
-        return 1;
-    return 0;
+    return chip8RunFrame(&mainMachine);
+}
+
+int chip8UpdateSlice(int slice, int nbOfSlices) {
+    return chip8RunFrameSlice(&mainMachine, slice, nbOfSlices);
 }
 
 void dumpMemory() {
     FILE* fp = fopen("memorydump", "w");
-    fwrite(state.memory, 1, CHIP8_MEMORY_SIZE, fp);
+    for (int i = 0; i < mainMachine.pageCount; i++)
+        fwrite(mainMachine.pages[i]->bytes, 1, CHIP8_PAGE_SIZE, fp);
     fclose(fp);
 }
 
@@ -427,8 +972,8 @@ void generateTraceLog(const char* filepath, int opcode) {
         fp = fopen(filepath, "a");
     }
     //[01:0000] V0:00 V1:00 V2:00 V3:00 V4:00 V5:00 V6:00 V7:00 V8:00 V9:00 VA:00 VB:00 VC:00 VD:00 VE:00 VF:00 I:0000 SP:0 PC:0200 O:120a
-    fprintf(fp, "[fn:%04x] V0:%02x V1:%02x V2:%02x V3:%02x V4:%02x V5:%02x V6:%02x V7:%02x V8:%02x V9:%02x VA:%02x VB:%02x VC:%02x VD:%02x VE:%02x VF:%02x I:%04x SP:%0x PC:%04x O:%04x\n", nbCycles, state.V[0],
-    state.V[1], state.V[2], state.V[3], state.V[4], state.V[5], state.V[6], state.V[7], state.V[8], state.V[9], state.V[10], state.V[11], state.V[12], state.V[13], state.V[14], state.V[15],
-    state.I, state.SP, state.PC, opcode);
+    fprintf(fp, "[fn:%04x] V0:%02x V1:%02x V2:%02x V3:%02x V4:%02x V5:%02x V6:%02x V7:%02x V8:%02x V9:%02x VA:%02x VB:%02x VC:%02x VD:%02x VE:%02x VF:%02x I:%04x SP:%0x PC:%04x O:%04x\n", nbCycles, mainMachine.V[0],
+    mainMachine.V[1], mainMachine.V[2], mainMachine.V[3], mainMachine.V[4], mainMachine.V[5], mainMachine.V[6], mainMachine.V[7], mainMachine.V[8], mainMachine.V[9], mainMachine.V[10], mainMachine.V[11], mainMachine.V[12], mainMachine.V[13], mainMachine.V[14], mainMachine.V[15],
+    mainMachine.I, mainMachine.SP, mainMachine.PC, opcode);
     nbCycles+=1;
-}
\ No newline at end of file
+}
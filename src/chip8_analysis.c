@@ -0,0 +1,355 @@
+/* this source file finds the code of a CHIP-8 program without running it: starting from the entry point, every
+instruction reachable through statically known successors is decoded (recursive descent, with an explicit stack),
+the first instruction of every basic block is marked, then the blocks are listed in address order */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <chip8_analysis.h>
+
+static uint32_t profileMemorySize(Chip8Profile profile) {
+    return chip8ProfileQuirks[profile].xochip ? XOCHIP_MEMORY_SIZE : CHIP8_MEMORY_SIZE;
+}
+
+//byte at address of the initial memory of the rom's machines (addresses wrap around like READ_MEMORY's)
+static uint8_t readInitialMemory(const Chip8Rom* rom, uint32_t memorySize, uint32_t address) {
+    address &= memorySize - 1;
+    return rom->pages[address >> CHIP8_PAGE_SHIFT]->bytes[address & (CHIP8_PAGE_SIZE - 1)];
+}
+
+static uint8_t instructionLength(const Chip8Rom* rom, Chip8Profile profile, uint32_t address) {
+    uint32_t memorySize = profileMemorySize(profile);
+    bool isLongLoad = readInitialMemory(rom, memorySize, address) == 0xF0 && readInitialMemory(rom, memorySize, address + 1) == 0x00;
+    return chip8ProfileQuirks[profile].xochip && isLongLoad ? 4 : 2;
+}
+
+Chip8InstructionInfo chip8AnalyzeInstruction(const Chip8Rom* rom, Chip8Profile profile, uint16_t address) {
+    uint32_t memorySize = profileMemorySize(profile);
+    uint16_t mask = (uint16_t)(memorySize - 1);
+    address &= mask;
+
+    uint8_t high = readInitialMemory(rom, memorySize, address);
+    uint8_t low = readInitialMemory(rom, memorySize, address + 1u);
+    Chip8InstructionInfo info = {
+        .instruction = chip8DecodeInstruction(high, low),
+        .opcode = (uint16_t)((high << 8) | low),
+        .longAddress = (uint16_t)((readInitialMemory(rom, memorySize, address + 2u) << 8) | readInitialMemory(rom, memorySize, address + 3u)),
+        .address = address,
+        .length = instructionLength(rom, profile, address),
+        .flow = CHIP8_FLOW_NEXT,
+        .successorCount = 0
+    };
+    uint16_t next = (uint16_t)((address + info.length) & mask);
+
+    switch (info.instruction.op) {
+        case CHIP8_OP_JP:
+            info.flow = CHIP8_FLOW_JUMP;
+            info.successors[info.successorCount++] = info.instruction.nnn & mask;
+            break;
+        case CHIP8_OP_CALL:
+            info.flow = CHIP8_FLOW_CALL;
+            info.successors[info.successorCount++] = info.instruction.nnn & mask;
+            info.successors[info.successorCount++] = next;
+            break;
+        case CHIP8_OP_SE_IMM:
+        case CHIP8_OP_SNE_IMM:
+        case CHIP8_OP_SE_REG:
+        case CHIP8_OP_SNE_REG:
+        case CHIP8_OP_SKP:
+        case CHIP8_OP_SKNP:
+            //a skip steps over a whole instruction: 4 bytes over F000 NNNN
+            info.flow = CHIP8_FLOW_SKIP;
+            info.successors[info.successorCount++] = next;
+            info.successors[info.successorCount++] = (uint16_t)((next + instructionLength(rom, profile, next)) & mask);
+            break;
+        case CHIP8_OP_RET:
+            info.flow = CHIP8_FLOW_RETURN;
+            break;
+        case CHIP8_OP_JP_V0:
+            info.flow = CHIP8_FLOW_INDIRECT;
+            break;
+        case CHIP8_OP_EXIT:
+            if (chip8ProfileQuirks[profile].schip) {
+                info.flow = CHIP8_FLOW_STOP;
+                break;
+            }
+            info.successors[info.successorCount++] = next;
+            break;
+        default:
+            info.successors[info.successorCount++] = next;
+            break;
+    }
+    return info;
+}
+
+uint32_t chip8JumpTableLength(const Chip8CodeAnalysis* analysis, uint16_t base) {
+    uint32_t length = 0;
+    for (uint32_t entry = base; length < CHIP8_MAX_JUMP_TABLE_ENTRIES; entry += 2, length++) {
+        bool inProgram = entry >= STARTING_MEMORY_ADDRESS && entry + 2 <= analysis->programEnd;
+        if (!inProgram || chip8AnalyzeInstruction(analysis->rom, analysis->profile, (uint16_t)entry).instruction.op != CHIP8_OP_JP)
+            break;
+    }
+    return length;
+}
+
+//a block runs from a leader to the first instruction that does not flow to the next one, or that precedes a leader
+static int findBasicBlocks(Chip8CodeAnalysis* analysis) {
+    const uint8_t* flags = analysis->flags;
+    uint32_t leaderCount = 0;
+    for (uint32_t address = STARTING_MEMORY_ADDRESS; address < analysis->programEnd; address++)
+        if (flags[address] & CHIP8_CODE_LEADER)
+            leaderCount++;
+
+    analysis->blockCount = 0;
+    analysis->blocks = malloc((leaderCount ? leaderCount : 1) * sizeof(Chip8BasicBlock));
+    if (!analysis->blocks)
+        return 1;
+
+    for (uint32_t address = STARTING_MEMORY_ADDRESS; address < analysis->programEnd; address++) {
+        if (!(flags[address] & CHIP8_CODE_LEADER))
+            continue;
+        Chip8BasicBlock* block = &analysis->blocks[analysis->blockCount++];
+        block->start = (uint16_t)address;
+        block->instructionCount = 0;
+        Chip8InstructionInfo info = chip8AnalyzeInstruction(analysis->rom, analysis->profile, (uint16_t)address);
+        while (true) {
+            block->instructionCount++;
+            uint32_t next = (uint32_t)info.address + info.length;
+            bool continues = info.flow == CHIP8_FLOW_NEXT && next < analysis->programEnd
+                && (flags[next] & (CHIP8_CODE_INSTRUCTION | CHIP8_CODE_LEADER)) == CHIP8_CODE_INSTRUCTION;
+            if (!continues)
+                break;
+            info = chip8AnalyzeInstruction(analysis->rom, analysis->profile, (uint16_t)next);
+        }
+        block->last = info.address;
+        block->end = (uint16_t)(info.address + info.length);
+    }
+    return 0;
+}
+
+const Chip8BasicBlock* chip8FindBasicBlock(const Chip8CodeAnalysis* analysis, uint16_t address) {
+    uint32_t low = 0;
+    uint32_t high = analysis->blockCount;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (analysis->blocks[middle].start < address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < analysis->blockCount && analysis->blocks[low].start == address ? &analysis->blocks[low] : NULL;
+}
+
+int chip8AnalyzeCode(const Chip8Rom* rom, Chip8Profile profile, Chip8CodeAnalysis* analysis) {
+    analysis->rom = rom;
+    analysis->profile = profile;
+    analysis->memorySize = profileMemorySize(profile);
+    analysis->programEnd = STARTING_MEMORY_ADDRESS + (uint32_t)rom->size;
+    if (analysis->programEnd > analysis->memorySize)
+        analysis->programEnd = analysis->memorySize;
+    analysis->instructionCount = 0;
+    analysis->blocks = NULL;
+    analysis->blockCount = 0;
+    analysis->flags = calloc(analysis->memorySize, 1);
+    //every address is pushed at most once (when first seen), so the stack never holds more than the program's addresses
+    uint16_t* pending = malloc(analysis->memorySize * sizeof(uint16_t));
+    if (!analysis->flags || !pending) {
+        fprintf(stderr, "[chip8_analysis] ERROR: failed to allocate the analysis of a program\n");
+        free(analysis->flags);
+        free(pending);
+        analysis->flags = NULL;
+        return 1;
+    }
+
+    uint8_t* flags = analysis->flags;
+    int pendingCount = 0;
+    if (analysis->programEnd > STARTING_MEMORY_ADDRESS) {
+        pending[pendingCount++] = STARTING_MEMORY_ADDRESS;
+        flags[STARTING_MEMORY_ADDRESS] = CHIP8_CODE_INSTRUCTION | CHIP8_CODE_LEADER;
+    }
+
+    while (pendingCount > 0) {
+        Chip8InstructionInfo info = chip8AnalyzeInstruction(rom, profile, pending[--pendingCount]);
+        analysis->instructionCount++;
+        for (int i = 0; i < info.length; i++)
+            flags[(info.address + i) & (analysis->memorySize - 1)] |= CHIP8_CODE_BYTE;
+
+        for (int i = 0; i < info.successorCount; i++) {
+            uint16_t successor = info.successors[i];
+            bool inProgram = successor >= STARTING_MEMORY_ADDRESS && successor < analysis->programEnd;
+            if (!inProgram)
+                continue;
+            if (info.flow != CHIP8_FLOW_NEXT)
+                flags[successor] |= CHIP8_CODE_LEADER;
+            if (!(flags[successor] & CHIP8_CODE_INSTRUCTION)) {
+                flags[successor] |= CHIP8_CODE_INSTRUCTION;
+                pending[pendingCount++] = successor;
+            }
+        }
+
+        if (info.flow == CHIP8_FLOW_INDIRECT) {
+            uint16_t base = info.instruction.nnn;
+            uint32_t entryCount = chip8JumpTableLength(analysis, base);
+            for (uint32_t i = 0; i < entryCount; i++) {
+                uint16_t entry = (uint16_t)(base + 2 * i);
+                flags[entry] |= CHIP8_CODE_LEADER | CHIP8_CODE_TABLE;
+                if (!(flags[entry] & CHIP8_CODE_INSTRUCTION)) {
+                    flags[entry] |= CHIP8_CODE_INSTRUCTION;
+                    pending[pendingCount++] = entry;
+                }
+            }
+        }
+    }
+
+    free(pending);
+    if (findBasicBlocks(analysis) != 0) {
+        fprintf(stderr, "[chip8_analysis] ERROR: failed to allocate the basic blocks of a program\n");
+        chip8FreeCodeAnalysis(analysis);
+        return 1;
+    }
+    return 0;
+}
+
+void chip8FreeCodeAnalysis(Chip8CodeAnalysis* analysis) {
+    free(analysis->flags);
+    free(analysis->blocks);
+    analysis->flags = NULL;
+    analysis->blocks = NULL;
+    analysis->blockCount = 0;
+}
+
+void chip8FormatInstruction(const Chip8InstructionInfo* info, char* buffer, size_t size) {
+    int x = info->instruction.x;
+    int y = info->instruction.y;
+    int n = info->instruction.n;
+    int nn = info->instruction.nnn & 0xFF;
+    int nnn = info->instruction.nnn;
+
+    switch (info->instruction.op) {
+        case CHIP8_OP_NOP:
+            if (info->opcode >> 12 == 0)
+                snprintf(buffer, size, "SYS 0x%03X", nnn);
+            else
+                snprintf(buffer, size, "DW 0x%04X", info->opcode);
+            break;
+        case CHIP8_OP_CLS: snprintf(buffer, size, "CLS"); break;
+        case CHIP8_OP_RET: snprintf(buffer, size, "RET"); break;
+        case CHIP8_OP_JP: snprintf(buffer, size, "JP 0x%03X", nnn); break;
+        case CHIP8_OP_CALL: snprintf(buffer, size, "CALL 0x%03X", nnn); break;
+        case CHIP8_OP_SE_IMM: snprintf(buffer, size, "SE V%X, 0x%02X", x, nn); break;
+        case CHIP8_OP_SNE_IMM: snprintf(buffer, size, "SNE V%X, 0x%02X", x, nn); break;
+        case CHIP8_OP_SE_REG: snprintf(buffer, size, "SE V%X, V%X", x, y); break;
+        case CHIP8_OP_LD_IMM: snprintf(buffer, size, "LD V%X, 0x%02X", x, nn); break;
+        case CHIP8_OP_ADD_IMM: snprintf(buffer, size, "ADD V%X, 0x%02X", x, nn); break;
+        case CHIP8_OP_LD_REG: snprintf(buffer, size, "LD V%X, V%X", x, y); break;
+        case CHIP8_OP_OR: snprintf(buffer, size, "OR V%X, V%X", x, y); break;
+        case CHIP8_OP_AND: snprintf(buffer, size, "AND V%X, V%X", x, y); break;
+        case CHIP8_OP_XOR: snprintf(buffer, size, "XOR V%X, V%X", x, y); break;
+        case CHIP8_OP_ADD_REG: snprintf(buffer, size, "ADD V%X, V%X", x, y); break;
+        case CHIP8_OP_SUB: snprintf(buffer, size, "SUB V%X, V%X", x, y); break;
+        case CHIP8_OP_SHR: snprintf(buffer, size, "SHR V%X, V%X", x, y); break;
+        case CHIP8_OP_SUBN: snprintf(buffer, size, "SUBN V%X, V%X", x, y); break;
+        case CHIP8_OP_SHL: snprintf(buffer, size, "SHL V%X, V%X", x, y); break;
+        case CHIP8_OP_SNE_REG: snprintf(buffer, size, "SNE V%X, V%X", x, y); break;
+        case CHIP8_OP_LD_I: snprintf(buffer, size, "LD I, 0x%03X", nnn); break;
+        case CHIP8_OP_JP_V0: snprintf(buffer, size, "JP V0, 0x%03X", nnn); break;
+        case CHIP8_OP_RND: snprintf(buffer, size, "RND V%X, 0x%02X", x, nn); break;
+        case CHIP8_OP_DRW: snprintf(buffer, size, "DRW V%X, V%X, %d", x, y, n); break;
+        case CHIP8_OP_SKP: snprintf(buffer, size, "SKP V%X", x); break;
+        case CHIP8_OP_SKNP: snprintf(buffer, size, "SKNP V%X", x); break;
+        case CHIP8_OP_LD_VX_DT: snprintf(buffer, size, "LD V%X, DT", x); break;
+        case CHIP8_OP_LD_VX_K: snprintf(buffer, size, "LD V%X, K", x); break;
+        case CHIP8_OP_LD_DT_VX: snprintf(buffer, size, "LD DT, V%X", x); break;
+        case CHIP8_OP_LD_ST_VX: snprintf(buffer, size, "LD ST, V%X", x); break;
+        case CHIP8_OP_ADD_I: snprintf(buffer, size, "ADD I, V%X", x); break;
+        case CHIP8_OP_LD_F: snprintf(buffer, size, "LD F, V%X", x); break;
+        case CHIP8_OP_LD_B: snprintf(buffer, size, "LD B, V%X", x); break;
+        case CHIP8_OP_LD_MEM_VX: snprintf(buffer, size, "LD [I], V%X", x); break;
+        case CHIP8_OP_LD_VX_MEM: snprintf(buffer, size, "LD V%X, [I]", x); break;
+        case CHIP8_OP_SCD: snprintf(buffer, size, "SCD %d", n); break;
+        case CHIP8_OP_SCR: snprintf(buffer, size, "SCR"); break;
+        case CHIP8_OP_SCL: snprintf(buffer, size, "SCL"); break;
+        case CHIP8_OP_EXIT: snprintf(buffer, size, "EXIT"); break;
+        case CHIP8_OP_LOW: snprintf(buffer, size, "LOW"); break;
+        case CHIP8_OP_HIGH: snprintf(buffer, size, "HIGH"); break;
+        case CHIP8_OP_LD_HF: snprintf(buffer, size, "LD HF, V%X", x); break;
+        case CHIP8_OP_LD_R_VX: snprintf(buffer, size, "LD R, V%X", x); break;
+        case CHIP8_OP_LD_VX_R: snprintf(buffer, size, "LD V%X, R", x); break;
+        case CHIP8_OP_SCU: snprintf(buffer, size, "SCU %d", n); break;
+        case CHIP8_OP_SAVE_RANGE: snprintf(buffer, size, "SAVE V%X-V%X", x, y); break;
+        case CHIP8_OP_LOAD_RANGE: snprintf(buffer, size, "LOAD V%X-V%X", x, y); break;
+        case CHIP8_OP_LD_I_LONG: snprintf(buffer, size, "LD I, 0x%04X", info->longAddress); break;
+        case CHIP8_OP_PLANE: snprintf(buffer, size, "PLANE %d", x); break;
+        case CHIP8_OP_AUDIO: snprintf(buffer, size, "AUDIO"); break;
+        case CHIP8_OP_PITCH: snprintf(buffer, size, "PITCH V%X", x); break;
+        default: snprintf(buffer, size, "DW 0x%04X", info->opcode); break;
+    }
+}
+
+//instruction at of a loop ends it: a 3XNN or 4XNN testing counter, then the jump back to head
+static bool matchLoopExit(const Chip8Instruction* at, uint8_t counter, uint16_t head, Chip8CountedLoop* loop) {
+    if ((at[0].op != CHIP8_OP_SE_IMM && at[0].op != CHIP8_OP_SNE_IMM) || at[0].x != counter
+        || at[2].op != CHIP8_OP_JP || at[2].nnn != head)
+        return false;
+    loop->counter = counter;
+    loop->limit = (uint8_t)at[0].nnn;
+    loop->exitWhenEqual = at[0].op == CHIP8_OP_SE_IMM;
+    return true;
+}
+
+static bool matchCountedLoop(const Chip8Instruction* decoded, uint32_t size, uint16_t head, Chip8CountedLoop* loop) {
+    const Chip8Instruction* body = &decoded[head]; //body[2*i]: instruction i of the loop
+    *loop = (Chip8CountedLoop){.head = head};
+    if (head + 6u <= size && body[0].op == CHIP8_OP_LD_VX_DT && matchLoopExit(&body[2], body[0].x, head, loop)) {
+        loop->kind = CHIP8_LOOP_TIMER_WAIT;
+        loop->length = 3;
+        return true;
+    }
+    if (head + 6u <= size && body[0].op == CHIP8_OP_ADD_IMM && matchLoopExit(&body[2], body[0].x, head, loop)) {
+        loop->kind = CHIP8_LOOP_COUNT;
+        loop->step = (uint8_t)body[0].nnn;
+        loop->length = 3;
+        return true;
+    }
+    if (head + 10u > size)
+        return false;
+    const Chip8Instruction* store = body[0].op == CHIP8_OP_LD_MEM_VX ? &body[0] : &body[2];
+    const Chip8Instruction* increment = body[0].op == CHIP8_OP_LD_MEM_VX ? &body[2] : &body[0];
+    const Chip8Instruction* count = &body[4];
+    if (store->op != CHIP8_OP_LD_MEM_VX || increment->op != CHIP8_OP_ADD_I || count->op != CHIP8_OP_ADD_IMM
+        || count->x <= store->x || count->x == increment->x || !matchLoopExit(&body[6], count->x, head, loop))
+        return false;
+    loop->kind = CHIP8_LOOP_FILL;
+    loop->step = (uint8_t)count->nnn;
+    loop->storeFirst = store == &body[0];
+    loop->stored = store->x;
+    loop->increment = increment->x;
+    loop->length = 5;
+    return true;
+}
+
+Chip8CountedLoop* chip8FindCountedLoops(const Chip8Instruction* decoded, uint32_t size, uint32_t* count) {
+    *count = 0;
+    Chip8CountedLoop* loops = NULL;
+    uint32_t capacity = 0;
+    Chip8CountedLoop loop;
+    //a loop jumps back to its head with a 1NNN: heads are in the first 4 KB
+    for (uint32_t head = 0; head < size && head < CHIP8_MEMORY_SIZE; head++) {
+        if (!matchCountedLoop(decoded, size, (uint16_t)head, &loop))
+            continue;
+        if (*count == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            Chip8CountedLoop* grown = realloc(loops, capacity * sizeof(Chip8CountedLoop));
+            if (!grown) {
+                free(loops);
+                *count = 0;
+                return NULL;
+            }
+            loops = grown;
+        }
+        loops[(*count)++] = loop;
+    }
+    return loops;
+}
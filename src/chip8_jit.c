@@ -0,0 +1,409 @@
+/* this source file runs the execution tiers: the interpreter runs a program block by block, counting the entries of
+each block; hot blocks are queued for the compiler thread, which generates their native code into an executable
+arena and publishes it, and the machines switch to the native block on their next entry into it */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <chip8_jit.h>
+#include <chip8_compiled.h>
+#include <monotonic_clock.h>
+#include <trace.h>
+
+#if CHIP8_JIT_SUPPORTED
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#define CODE_ARENA_SIZE (16 << 20) //in bytes
+#define CODE_ALIGNMENT 16
+#define QUEUE_SIZE 1024 //pending compile requests
+#define NOT_COMPILABLE 0x80 //flag of chunkLengths: the chunk starts with an instruction left to the interpreter
+
+typedef struct {
+    Chip8Jit* jit;
+    uint16_t address;
+} CompileRequest;
+
+static bool enabled = false;
+static int hotnessThreshold = CHIP8_JIT_DEFAULT_THRESHOLD;
+static Chip8Jit* jits = NULL; //every ROM and profile run so far
+
+//the queue of compile requests and the list of jits, shared by the emulation threads and the compiler thread
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requestQueued = PTHREAD_COND_INITIALIZER;
+static CompileRequest queue[QUEUE_SIZE];
+static unsigned queueHead = 0; //next request to compile
+static unsigned queueTail = 0; //next free slot
+static bool stopping = false;
+static pthread_t compilerThread;
+
+/* executable memory, written under arenaLock by the compiler thread and by the machines that load blocks from the
+cache: the code is written through a read-write view of the arena and run through a read-execute view of the same
+pages, so no page is ever writable and executable at once */
+static pthread_mutex_t arenaLock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t* arena = NULL; //read-write view
+static uint8_t* arenaCode = NULL; //read-execute view
+static size_t arenaUsed = 0;
+
+//compiler statistics, read by chip8JitReport
+static atomic_uint_fast64_t compiledBlocks;
+static atomic_uint_fast64_t codeBytes;
+static atomic_uint_fast64_t compileNanoseconds;
+static atomic_uint_fast64_t maxCompileNanoseconds;
+static atomic_uint_fast64_t droppedRequests; //the queue was full
+static atomic_uint_fast64_t cachedBlocks; //read from the cache directory
+
+
+const uint8_t* chip8JitAllocateCode(const uint8_t* code, uint32_t codeSize) {
+    static bool warned = false;
+    const uint8_t* executable = NULL;
+    pthread_mutex_lock(&arenaLock);
+    if (arenaUsed + codeSize <= CODE_ARENA_SIZE) {
+        memcpy(arena + arenaUsed, code, codeSize);
+        executable = arenaCode + arenaUsed;
+        arenaUsed = (arenaUsed + codeSize + CODE_ALIGNMENT - 1) & ~(size_t)(CODE_ALIGNMENT - 1);
+    }
+    else if (!warned) {
+        fprintf(stderr, "[chip8_jit] WARNING: the code arena is full, new blocks stay interpreted\n");
+        warned = true;
+    }
+    pthread_mutex_unlock(&arenaLock);
+    return executable;
+}
+
+static void compileBlock(Chip8Jit* jit, uint16_t address) {
+    uint64_t start = monotonicNanoseconds();
+    Chip8JitSource source;
+    if (chip8JitScanBlock(jit->rom, (Chip8Profile)jit->profile, address, &source) == 0)
+        return;
+    uint8_t code[CHIP8_JIT_MAX_CODE_SIZE];
+    uint32_t codeSize = chip8JitEmitBlock(&source, (Chip8Profile)jit->profile, code);
+    Chip8JitBlock* block = malloc(sizeof(Chip8JitBlock));
+    if (!block)
+        return;
+    const uint8_t* executable = chip8JitAllocateCode(code, codeSize);
+    if (!executable) {
+        free(block);
+        return;
+    }
+
+    block->code = (Chip8JitCode)(void*)executable;
+    block->codeSize = codeSize;
+    block->start = source.start;
+    block->end = source.end;
+    block->checkedEnd = source.checkedEnd;
+    block->instructionCount = (uint8_t)source.instructionCount;
+    //the code is written before the block is published: a machine that sees the block sees its code
+    atomic_store_explicit(&jit->blocks[address], block, memory_order_release);
+    jit->compiledBlockCount++;
+    chip8JitPerfRecord(block);
+
+    traceRecord("JIT compile", start);
+    uint64_t duration = monotonicNanoseconds() - start;
+    atomic_fetch_add_explicit(&compiledBlocks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&codeBytes, codeSize, memory_order_relaxed);
+    atomic_fetch_add_explicit(&compileNanoseconds, duration, memory_order_relaxed);
+    if (duration > atomic_load_explicit(&maxCompileNanoseconds, memory_order_relaxed))
+        atomic_store_explicit(&maxCompileNanoseconds, duration, memory_order_relaxed);
+}
+
+//maps the two views of the arena; returns 0 on success
+static int mapArena(void) {
+    int fd = (int)syscall(SYS_memfd_create, "chip8-jit", MFD_CLOEXEC);
+    if (fd < 0)
+        return 1;
+    void* writable = MAP_FAILED;
+    void* executable = MAP_FAILED;
+    if (ftruncate(fd, CODE_ARENA_SIZE) == 0) {
+        writable = mmap(NULL, CODE_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        executable = mmap(NULL, CODE_ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    }
+    close(fd); //the mappings keep the memory
+    if (writable == MAP_FAILED || executable == MAP_FAILED) {
+        if (writable != MAP_FAILED)
+            munmap(writable, CODE_ARENA_SIZE);
+        if (executable != MAP_FAILED)
+            munmap(executable, CODE_ARENA_SIZE);
+        return 1;
+    }
+    arena = writable;
+    arenaCode = executable;
+    return 0;
+}
+
+static void unmapArena(void) {
+    munmap(arena, CODE_ARENA_SIZE);
+    munmap(arenaCode, CODE_ARENA_SIZE);
+    arena = NULL;
+    arenaCode = NULL;
+    arenaUsed = 0;
+}
+
+static void* compilerThreadMain(void* unused) {
+    (void)unused;
+    traceSetThreadName("jit compiler");
+    pthread_mutex_lock(&lock);
+    while (true) {
+        while (queueHead == queueTail && !stopping)
+            pthread_cond_wait(&requestQueued, &lock);
+        if (stopping)
+            break;
+        CompileRequest request = queue[queueHead % QUEUE_SIZE];
+        queueHead++;
+        pthread_mutex_unlock(&lock);
+        compileBlock(request.jit, request.address);
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int chip8JitInit(int threshold, const char* cacheDirectory) {
+    if (enabled)
+        return 0;
+    if (cacheDirectory && chip8JitCacheSetDirectory(cacheDirectory) != 0)
+        return 1;
+    //the system may forbid executable memory (SELinux execmem, PaX): the machines are then interpreted
+    if (mapArena() != 0) {
+        fprintf(stderr, "[chip8_jit] WARNING: could not map executable memory, the JIT is disabled\n");
+        return 0;
+    }
+    stopping = false;
+    if (pthread_create(&compilerThread, NULL, compilerThreadMain, NULL) != 0) {
+        fprintf(stderr, "[chip8_jit] WARNING: could not start the compiler thread, the JIT is disabled\n");
+        unmapArena();
+        return 0;
+    }
+    hotnessThreshold = threshold > 0 ? threshold : 1;
+    enabled = true;
+    return 0;
+}
+
+void chip8JitTerminate(void) {
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&requestQueued);
+    pthread_mutex_unlock(&lock);
+    pthread_join(compilerThread, NULL);
+    chip8JitPerfTerminate();
+
+    while (jits) {
+        Chip8Jit* jit = jits;
+        jits = jit->next;
+        chip8JitCacheSave(jit);
+        for (uint32_t a = 0; a < jit->memorySize; a++)
+            free((void*)atomic_load_explicit(&jit->blocks[a], memory_order_relaxed));
+        free(jit->blocks);
+        free(jit->chunkLengths);
+        free(jit->hotness);
+        chip8JitCacheClose(jit);
+        free(jit);
+    }
+    unmapArena();
+    enabled = false;
+}
+
+bool chip8JitIsEnabled(void) {
+    return enabled;
+}
+
+Chip8Jit* chip8JitFor(const Chip8Rom* rom, Chip8Profile profile) {
+    if (!enabled)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    Chip8Jit* jit = jits;
+    while (jit && (jit->rom != rom || jit->profile != profile))
+        jit = jit->next;
+    if (!jit && (jit = calloc(1, sizeof(Chip8Jit))) != NULL) {
+        jit->rom = rom;
+        jit->profile = (uint8_t)profile;
+        jit->memorySize = chip8ProfileQuirks[profile].xochip ? XOCHIP_MEMORY_SIZE : CHIP8_MEMORY_SIZE;
+        jit->blocks = calloc(jit->memorySize, sizeof(*jit->blocks));
+        jit->chunkLengths = calloc(jit->memorySize, sizeof(*jit->chunkLengths));
+        jit->hotness = calloc(jit->memorySize, sizeof(*jit->hotness));
+        if (!jit->blocks || !jit->chunkLengths || !jit->hotness) {
+            fprintf(stderr, "[chip8_jit] ERROR: failed to allocate the tiers of a ROM, it is interpreted\n");
+            free(jit->blocks);
+            free(jit->chunkLengths);
+            free(jit->hotness);
+            free(jit);
+            jit = NULL;
+        }
+        else {
+            chip8JitCacheOpen(jit);
+            jit->next = jits;
+            jits = jit;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return jit;
+}
+
+static void requestCompilation(Chip8Jit* jit, uint16_t address) {
+    pthread_mutex_lock(&lock);
+    if (queueTail - queueHead < QUEUE_SIZE) {
+        queue[queueTail % QUEUE_SIZE] = (CompileRequest){jit, address};
+        queueTail++;
+        pthread_cond_signal(&requestQueued);
+    }
+    else {
+        atomic_store_explicit(&jit->hotness[address], 0, memory_order_relaxed); //counted again from 0, queued again later
+        atomic_fetch_add_explicit(&droppedRequests, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+//instructions the interpreter runs from address in one go: up to the end of the block at address (1 if none starts there)
+static uint8_t chunkLength(Chip8Jit* jit, uint16_t address) {
+    uint8_t length = atomic_load_explicit(&jit->chunkLengths[address], memory_order_relaxed);
+    if (length == 0) {
+        Chip8JitSource source;
+        int count = chip8JitScanBlock(jit->rom, (Chip8Profile)jit->profile, address, &source);
+        length = count > 0 ? (uint8_t)count : (1 | NOT_COMPILABLE);
+        atomic_store_explicit(&jit->chunkLengths[address], length, memory_order_relaxed);
+        //first run of the address: the block a previous run compiled there is used from now on
+        const Chip8JitBlock* cached = jit->cacheFile && count > 0 ? chip8JitCacheLookup(jit, address) : NULL;
+        const Chip8JitBlock* expected = NULL;
+        if (cached && !atomic_compare_exchange_strong(&jit->blocks[address], &expected, cached))
+            free((void*)cached); //compiled meanwhile
+        else if (cached) {
+            atomic_fetch_add_explicit(&cachedBlocks, 1, memory_order_relaxed);
+            chip8JitPerfRecord(cached);
+        }
+    }
+    return length;
+}
+
+static inline bool isLineWritten(const Chip8State* s, uint16_t address) {
+    return (s->writtenLines[CHIP8_LINE_WORD(address)] & CHIP8_LINE_BIT(address)) != 0;
+}
+
+//a native block is only valid for a machine that never wrote to its lines (it spans two lines at most)
+static inline bool isBlockValid(const Chip8State* s, const Chip8JitBlock* block) {
+    return !isLineWritten(s, block->start) && !isLineWritten(s, (uint16_t)(block->checkedEnd - 1));
+}
+
+int chip8JitRun(Chip8State* s, int nbOfInstructions) {
+    Chip8Jit* jit = s->jit;
+    uint64_t startCount = s->instructionCount;
+    uint64_t native = 0;
+    int result = 0;
+
+    while (nbOfInstructions > 0) {
+        uint16_t pc = s->PC & s->addressMask;
+        if (s->PC == pc && chip8IsCountedLoopHead(s->rom, pc)) { //faster than any block
+            int executed = chip8RunCountedLoop(s, nbOfInstructions);
+            nbOfInstructions -= executed;
+            if (executed > 0)
+                continue;
+        }
+        const Chip8JitBlock* block = atomic_load_explicit(&jit->blocks[pc], memory_order_acquire);
+        if (block && s->PC == pc && isBlockValid(s, block)) {
+            uint16_t last = (uint16_t)(block->end - 1);
+            s->executedLines[CHIP8_LINE_WORD(pc)] |= CHIP8_LINE_BIT(pc);
+            s->executedLines[CHIP8_LINE_WORD(last)] |= CHIP8_LINE_BIT(last);
+            int executed = block->code(s, nbOfInstructions);
+            native += (uint64_t)executed;
+            nbOfInstructions -= executed;
+            if (executed < block->instructionCount && nbOfInstructions > 0) { //stack overflow or underflow: the interpreter reports it
+                result = chip8InterpretInstructions(s, 1);
+                break;
+            }
+            continue;
+        }
+
+        uint8_t length = chunkLength(jit, pc);
+        //code this machine modified is not counted: its native block could not be used
+        if (!block && !(length & NOT_COMPILABLE) && !isLineWritten(s, pc)) {
+            uint16_t hotness = atomic_load_explicit(&jit->hotness[pc], memory_order_relaxed);
+            if (hotness < hotnessThreshold) {
+                atomic_store_explicit(&jit->hotness[pc], (uint16_t)(hotness + 1), memory_order_relaxed);
+                if (hotness + 1 == hotnessThreshold)
+                    requestCompilation(jit, pc);
+            }
+        }
+        int count = length & ~NOT_COMPILABLE;
+        if (count > nbOfInstructions)
+            count = nbOfInstructions;
+        result = chip8InterpretInstructions(s, count);
+        nbOfInstructions -= count;
+        if (result != 0 || s->waitingForVblank)
+            break;
+        if (s->PC == pc && nbOfInstructions > 0) { //a jump to itself or a key wait (FX0A): the interpreter spins through the budget at once
+            result = chip8InterpretInstructions(s, nbOfInstructions);
+            break;
+        }
+    }
+
+    //not a read-modify-write: machines running on other threads may lose a few counts, but none pays for a locked add
+    atomic_store_explicit(&jit->nativeInstructions,
+        atomic_load_explicit(&jit->nativeInstructions, memory_order_relaxed) + native, memory_order_relaxed);
+    atomic_store_explicit(&jit->interpretedInstructions,
+        atomic_load_explicit(&jit->interpretedInstructions, memory_order_relaxed) + (s->instructionCount - startCount - native), memory_order_relaxed);
+    return result;
+}
+
+void chip8JitReport(FILE* fp) {
+    uint64_t native = 0;
+    uint64_t interpreted = 0;
+    pthread_mutex_lock(&lock);
+    for (const Chip8Jit* jit = jits; jit; jit = jit->next) {
+        native += atomic_load_explicit(&jit->nativeInstructions, memory_order_relaxed);
+        interpreted += atomic_load_explicit(&jit->interpretedInstructions, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lock);
+    uint64_t total = native + interpreted;
+    uint64_t blocks = atomic_load_explicit(&compiledBlocks, memory_order_relaxed);
+
+    fprintf(fp, "[jit] tiers: %llu instructions interpreted (%.1f%%), %llu native (%.1f%%)\n",
+        (unsigned long long)interpreted, total ? 100.0 * interpreted / total : 0.0,
+        (unsigned long long)native, total ? 100.0 * native / total : 0.0);
+    fprintf(fp, "[jit] %llu blocks compiled (%.1f KB of code), %llu read from the cache, compile time mean %.1f us, max %.1f us, %llu requests dropped\n",
+        (unsigned long long)blocks, atomic_load_explicit(&codeBytes, memory_order_relaxed) / 1024.0,
+        (unsigned long long)atomic_load_explicit(&cachedBlocks, memory_order_relaxed),
+        blocks ? atomic_load_explicit(&compileNanoseconds, memory_order_relaxed) / 1e3 / blocks : 0.0,
+        atomic_load_explicit(&maxCompileNanoseconds, memory_order_relaxed) / 1e3,
+        (unsigned long long)atomic_load_explicit(&droppedRequests, memory_order_relaxed));
+}
+
+#else
+
+int chip8JitInit(int threshold, const char* cacheDirectory) {
+    (void)threshold;
+    (void)cacheDirectory;
+    fprintf(stderr, "[chip8_jit] ERROR: native code generation is only available on x86-64 Linux\n");
+    return 1;
+}
+
+void chip8JitTerminate(void) {
+}
+
+bool chip8JitIsEnabled(void) {
+    return false;
+}
+
+void chip8JitReport(FILE* fp) {
+    (void)fp;
+}
+
+Chip8Jit* chip8JitFor(const Chip8Rom* rom, Chip8Profile profile) {
+    (void)rom;
+    (void)profile;
+    return NULL;
+}
+
+int chip8JitRun(Chip8State* s, int nbOfInstructions) {
+    return chip8InterpretInstructions(s, nbOfInstructions);
+}
+
+#endif
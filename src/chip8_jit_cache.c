@@ -0,0 +1,296 @@
+/* this source file keeps the native blocks of a ROM across runs: on exit, the blocks of every ROM and profile are
+written to a file of the cache directory, named after the ROM's hash, the profile and the code generator's version.
+The next run maps that file (read only) when the ROM is loaded. The first time the address of a block is run, the
+block is checked against the ROM image and its code against the hash saved with it, then copied to the code arena and
+used right away instead of waiting to be hot. The code of a block only addresses the machine through rdi and jumps
+within itself, so it runs at any address: the file holds no relocations. Since the files hold code the emulator runs,
+the cache directory is private (0700) and only the files owned by the user are read.
+
+File layout: a CacheHeader, blockCount CacheEntry sorted by start address, then the code of the blocks */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <chip8_jit.h>
+
+#if CHIP8_JIT_SUPPORTED
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "C8JITBK2" //of the second layout, with the hash of the code
+
+typedef struct {
+    char magic[8];
+    uint32_t version; //CHIP8_JIT_CODE_VERSION
+    uint32_t stateLayout; //CHIP8_JIT_STATE_LAYOUT: a build that moved a field can't use the files of another one
+    uint64_t romHash;
+    uint32_t profile;
+    uint32_t blockCount;
+} CacheHeader;
+
+typedef struct {
+    uint16_t start;
+    uint16_t end;
+    uint16_t checkedEnd;
+    uint8_t instructionCount;
+    uint8_t unused;
+    uint32_t codeOffset; //from the start of the file
+    uint32_t codeSize;
+    uint64_t sourceHash; //hash of the guest bytes from start to checkedEnd the code was generated from
+    uint64_t codeHash; //hash of the codeSize bytes of code (damaged files)
+} CacheEntry;
+
+static char directory[512] = "";
+#define FILEPATH_SIZE (sizeof(directory) + 64) //the directory, then a file name
+
+
+static uint64_t hashBytes(const uint8_t* bytes, uint32_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL; //FNV-1a
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hashGuestBytes(const Chip8Rom* rom, uint16_t start, uint16_t end) {
+    uint64_t hash = 0xcbf29ce484222325ULL; //FNV-1a
+    for (uint32_t a = start; a < end; a++) {
+        hash ^= rom->pages[a >> CHIP8_PAGE_SHIFT]->bytes[a & (CHIP8_PAGE_SIZE - 1)];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void cacheFilepath(const Chip8Jit* jit, char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%016llx-p%u-v%u.bin", directory, (unsigned long long)jit->rom->hash, jit->profile,
+        CHIP8_JIT_CODE_VERSION);
+}
+
+//a file or directory of the cache must be the user's, and nobody else may write to it
+static bool isPrivate(const struct stat* status) {
+    return status->st_uid == geteuid() && (status->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+//creates path and its missing parents (like mkdir -p)
+static int createDirectories(const char* path) {
+    char partial[sizeof(directory)];
+    size_t length = strlen(path);
+    if (length >= sizeof(partial))
+        return 1;
+    for (size_t i = 1; i <= length; i++) {
+        if (path[i] != '/' && path[i] != '\0')
+            continue;
+        memcpy(partial, path, i);
+        partial[i] = '\0';
+        if (mkdir(partial, 0700) != 0 && errno != EEXIST)
+            return 1;
+    }
+    return 0;
+}
+
+int chip8JitCacheSetDirectory(const char* path) {
+    if (strlen(path) >= sizeof(directory)) {
+        fprintf(stderr, "[chip8_jit] ERROR: the cache directory path is too long\n");
+        return 1;
+    }
+    if (createDirectories(path) != 0) {
+        fprintf(stderr, "[chip8_jit] ERROR: could not create the cache directory %s\n", path);
+        return 1;
+    }
+    struct stat status;
+    if (stat(path, &status) != 0 || !S_ISDIR(status.st_mode) || !isPrivate(&status)) {
+        fprintf(stderr, "[chip8_jit] ERROR: the cache directory %s must be owned by the user and writable by nobody else\n", path);
+        return 1;
+    }
+    strcpy(directory, path);
+    return 0;
+}
+
+//the header is checked here, the blocks when they are first looked up
+void chip8JitCacheOpen(Chip8Jit* jit) {
+    if (directory[0] == '\0')
+        return;
+    char filepath[FILEPATH_SIZE];
+    cacheFilepath(jit, filepath, sizeof(filepath));
+    int fd = open(filepath, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+        return; //not cached yet
+    struct stat status;
+    if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) || (size_t)status.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return;
+    }
+    if (!isPrivate(&status)) {
+        fprintf(stderr, "[chip8_jit] WARNING: ignoring the cache file %s (not owned by the user, or writable by others)\n", filepath);
+        close(fd);
+        return;
+    }
+    void* file = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+        return;
+
+    const CacheHeader* header = file;
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != CHIP8_JIT_CODE_VERSION
+        || header->stateLayout != CHIP8_JIT_STATE_LAYOUT || header->romHash != jit->rom->hash || header->profile != jit->profile
+        || header->blockCount > ((size_t)status.st_size - sizeof(CacheHeader)) / sizeof(CacheEntry)) {
+        fprintf(stderr, "[chip8_jit] WARNING: ignoring the cache file %s (damaged, or written by another build)\n", filepath);
+        munmap(file, (size_t)status.st_size);
+        return;
+    }
+    jit->cacheFile = file;
+    jit->cacheFileSize = (size_t)status.st_size;
+}
+
+void chip8JitCacheClose(Chip8Jit* jit) {
+    if (jit->cacheFile)
+        munmap((void*)jit->cacheFile, jit->cacheFileSize);
+    jit->cacheFile = NULL;
+    jit->cacheFileSize = 0;
+}
+
+static const CacheEntry* findEntry(const Chip8Jit* jit, uint16_t address) {
+    if (!jit->cacheFile)
+        return NULL;
+    const CacheHeader* header = (const CacheHeader*)jit->cacheFile;
+    const CacheEntry* entries = (const CacheEntry*)(jit->cacheFile + sizeof(CacheHeader));
+    uint32_t low = 0, high = header->blockCount;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (entries[middle].start < address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < header->blockCount && entries[low].start == address ? &entries[low] : NULL;
+}
+
+const Chip8JitBlock* chip8JitCacheLookup(const Chip8Jit* jit, uint16_t address) {
+    const CacheEntry* entry = findEntry(jit, address);
+    if (!entry)
+        return NULL;
+    /* a block is only trusted if its code is in the file, unchanged since it was saved, and was generated from the
+    bytes the ROM holds there; the code that was checked is copied out of the file, which may change afterwards */
+    if (entry->end <= entry->start || entry->checkedEnd < entry->end || entry->checkedEnd > jit->memorySize
+        || entry->instructionCount == 0 || entry->instructionCount > CHIP8_JIT_MAX_BLOCK_INSTRUCTIONS
+        || entry->codeSize == 0 || entry->codeSize > CHIP8_JIT_MAX_CODE_SIZE
+        || entry->codeOffset < sizeof(CacheHeader) || entry->codeOffset > jit->cacheFileSize
+        || entry->codeSize > jit->cacheFileSize - entry->codeOffset
+        || entry->sourceHash != hashGuestBytes(jit->rom, entry->start, entry->checkedEnd))
+        return NULL;
+    uint8_t code[CHIP8_JIT_MAX_CODE_SIZE];
+    memcpy(code, jit->cacheFile + entry->codeOffset, entry->codeSize);
+    if (hashBytes(code, entry->codeSize) != entry->codeHash)
+        return NULL;
+
+    Chip8JitBlock* block = malloc(sizeof(Chip8JitBlock));
+    if (!block)
+        return NULL;
+    const uint8_t* executable = chip8JitAllocateCode(code, entry->codeSize);
+    if (!executable) {
+        free(block);
+        return NULL;
+    }
+    block->code = (Chip8JitCode)(void*)executable;
+    block->codeSize = entry->codeSize;
+    block->start = entry->start;
+    block->end = entry->end;
+    block->checkedEnd = entry->checkedEnd;
+    block->instructionCount = entry->instructionCount;
+    return block;
+}
+
+/* writes the blocks of jit to its cache file: the ones run or compiled in this session, and the entries of the
+previous file that were not looked up (the file is replaced atomically) */
+void chip8JitCacheSave(const Chip8Jit* jit) {
+    if (directory[0] == '\0' || jit->compiledBlockCount == 0)
+        return;
+
+    uint32_t blockCount = 0;
+    for (uint32_t a = 0; a < jit->memorySize; a++)
+        if (atomic_load_explicit(&jit->blocks[a], memory_order_relaxed) || findEntry(jit, (uint16_t)a))
+            blockCount++;
+    CacheEntry* entries = calloc(blockCount, sizeof(CacheEntry));
+    const uint8_t** codes = calloc(blockCount, sizeof(uint8_t*));
+    if (!entries || !codes) {
+        free(entries);
+        free(codes);
+        return;
+    }
+
+    uint32_t i = 0;
+    for (uint32_t a = 0; a < jit->memorySize; a++) {
+        const Chip8JitBlock* block = atomic_load_explicit(&jit->blocks[a], memory_order_relaxed);
+        const CacheEntry* previous = block ? NULL : findEntry(jit, (uint16_t)a);
+        if (block) {
+            entries[i] = (CacheEntry){.start = block->start, .end = block->end, .checkedEnd = block->checkedEnd,
+                .instructionCount = block->instructionCount, .codeSize = block->codeSize,
+                .sourceHash = hashGuestBytes(jit->rom, block->start, block->checkedEnd),
+                .codeHash = hashBytes((const uint8_t*)(void*)block->code, block->codeSize)};
+            codes[i] = (const uint8_t*)(void*)block->code;
+        }
+        else if (previous && previous->codeOffset <= jit->cacheFileSize && previous->codeSize <= jit->cacheFileSize - previous->codeOffset) {
+            entries[i] = *previous;
+            codes[i] = jit->cacheFile + previous->codeOffset;
+        }
+        else
+            continue;
+        i++;
+    }
+    blockCount = i;
+    uint32_t codeOffset = (uint32_t)(sizeof(CacheHeader) + blockCount * sizeof(CacheEntry));
+    for (i = 0; i < blockCount; i++) {
+        entries[i].codeOffset = codeOffset;
+        codeOffset += entries[i].codeSize;
+    }
+
+    char filepath[FILEPATH_SIZE];
+    char temporaryFilepath[FILEPATH_SIZE + 16];
+    cacheFilepath(jit, filepath, sizeof(filepath));
+    snprintf(temporaryFilepath, sizeof(temporaryFilepath), "%s.%d", filepath, (int)getpid());
+    FILE* fp = fopen(temporaryFilepath, "wb");
+    if (!fp) {
+        fprintf(stderr, "[chip8_jit] WARNING: could not write the cache file %s\n", temporaryFilepath);
+        free(entries);
+        free(codes);
+        return;
+    }
+    CacheHeader header = {.version = CHIP8_JIT_CODE_VERSION, .stateLayout = CHIP8_JIT_STATE_LAYOUT, .romHash = jit->rom->hash,
+        .profile = jit->profile, .blockCount = blockCount};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(entries, sizeof(CacheEntry), blockCount, fp) == blockCount;
+    for (i = 0; i < blockCount && written; i++)
+        written = fwrite(codes[i], 1, entries[i].codeSize, fp) == entries[i].codeSize;
+    written &= fclose(fp) == 0;
+    //rename replaces the file atomically: a process that mapped the previous one keeps its own copy
+    if (!written || rename(temporaryFilepath, filepath) != 0) {
+        fprintf(stderr, "[chip8_jit] WARNING: could not write the cache file %s\n", filepath);
+        remove(temporaryFilepath);
+    }
+    free(entries);
+    free(codes);
+}
+
+#endif
+
+const char* chip8JitDefaultCacheDirectory(void) {
+    static char path[512];
+    const char* base = getenv("XDG_CACHE_HOME");
+    if (base && base[0] == '/')
+        snprintf(path, sizeof(path), "%s/chip8-c", base);
+    else if ((base = getenv("HOME")) != NULL && base[0] != '\0')
+        snprintf(path, sizeof(path), "%s/.cache/chip8-c", base);
+    else
+        return NULL;
+    return path;
+}
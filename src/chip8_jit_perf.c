@@ -0,0 +1,144 @@
+/* this source file tells Linux perf where the native blocks are, so that host profiles name the guest code they run:
+every block is appended to /tmp/perf-<pid>.map (read by perf report) as chip8_block_<start>_<end>, its guest address
+range, and optionally recorded in a jitdump file, /tmp/jit-<pid>.dump, which also holds the code (perf inject --jit
+turns it into ELF images, for perf annotate). See tools/perf/Documentation/jitdump-specification.txt in the kernel */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <chip8_jit.h>
+#include <monotonic_clock.h>
+
+#if CHIP8_JIT_SUPPORTED
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define JITDUMP_MAGIC 0x4A695444 //"JiTD"
+#define JITDUMP_VERSION 1
+#define JITDUMP_ELF_MACHINE 62 //EM_X86_64
+#define JITDUMP_CODE_LOAD 0
+#define JITDUMP_CODE_CLOSE 3
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t totalSize; //of the header
+    uint32_t elfMachine;
+    uint32_t unused;
+    uint32_t pid;
+    uint64_t timestamp; //CLOCK_MONOTONIC nanoseconds (record with perf record -k mono)
+    uint64_t flags;
+} JitdumpHeader;
+
+typedef struct {
+    uint32_t id;
+    uint32_t totalSize; //of the record, with the name and the code that follow
+    uint64_t timestamp;
+} JitdumpRecordHeader;
+
+//followed by the name (with its terminating 0) and the code
+typedef struct {
+    JitdumpRecordHeader header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t codeAddress;
+    uint64_t codeSize;
+    uint64_t codeIndex;
+} JitdumpCodeLoad;
+
+//the blocks are recorded by the compiler thread and, for the ones read from the cache, by the emulation threads
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* perfMap = NULL;
+static FILE* jitdump = NULL;
+static void* jitdumpMarker = NULL; //perf record finds the jitdump file through this executable mapping of it
+static uint64_t codeIndex = 0;
+
+
+int chip8JitPerfInit(bool withJitdump) {
+    char filepath[64];
+    snprintf(filepath, sizeof(filepath), "/tmp/perf-%d.map", (int)getpid());
+    perfMap = fopen(filepath, "w");
+    if (!perfMap) {
+        fprintf(stderr, "[chip8_jit] ERROR: could not create %s\n", filepath);
+        return 1;
+    }
+    if (!withJitdump)
+        return 0;
+
+    snprintf(filepath, sizeof(filepath), "/tmp/jit-%d.dump", (int)getpid());
+    int fd = open(filepath, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0 || (jitdump = fdopen(fd, "w+")) == NULL) {
+        fprintf(stderr, "[chip8_jit] ERROR: could not create %s\n", filepath);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    jitdumpMarker = mmap(NULL, (size_t)sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (jitdumpMarker == MAP_FAILED) {
+        jitdumpMarker = NULL;
+        fprintf(stderr, "[chip8_jit] WARNING: could not map %s, perf record will not find it\n", filepath);
+    }
+    JitdumpHeader header = {.magic = JITDUMP_MAGIC, .version = JITDUMP_VERSION, .totalSize = sizeof(JitdumpHeader),
+        .elfMachine = JITDUMP_ELF_MACHINE, .pid = (uint32_t)getpid(), .timestamp = monotonicNanoseconds()};
+    fwrite(&header, sizeof(header), 1, jitdump);
+    fflush(jitdump);
+    return 0;
+}
+
+void chip8JitPerfRecord(const Chip8JitBlock* block) {
+    if (!perfMap)
+        return;
+    char name[48];
+    snprintf(name, sizeof(name), "chip8_block_0x%x_0x%x", block->start, block->end);
+    uintptr_t address = (uintptr_t)(void*)block->code;
+
+    pthread_mutex_lock(&lock);
+    fprintf(perfMap, "%llx %x %s\n", (unsigned long long)address, block->codeSize, name);
+    fflush(perfMap); //perf may read it while the program runs, or after it was killed
+    if (jitdump) {
+        size_t nameSize = strlen(name) + 1;
+        JitdumpCodeLoad record = {
+            .header = {.id = JITDUMP_CODE_LOAD, .totalSize = (uint32_t)(sizeof(record) + nameSize + block->codeSize),
+                .timestamp = monotonicNanoseconds()},
+            .pid = (uint32_t)getpid(), .tid = (uint32_t)syscall(SYS_gettid), .vma = address, .codeAddress = address,
+            .codeSize = block->codeSize, .codeIndex = codeIndex++};
+        fwrite(&record, sizeof(record), 1, jitdump);
+        fwrite(name, 1, nameSize, jitdump);
+        fwrite((const void*)block->code, 1, block->codeSize, jitdump);
+        fflush(jitdump);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void chip8JitPerfTerminate(void) {
+    if (perfMap)
+        fclose(perfMap);
+    perfMap = NULL;
+    if (jitdump) {
+        JitdumpRecordHeader record = {.id = JITDUMP_CODE_CLOSE, .totalSize = sizeof(record), .timestamp = monotonicNanoseconds()};
+        fwrite(&record, sizeof(record), 1, jitdump);
+        fclose(jitdump);
+    }
+    jitdump = NULL;
+    if (jitdumpMarker)
+        munmap(jitdumpMarker, (size_t)sysconf(_SC_PAGESIZE));
+    jitdumpMarker = NULL;
+}
+
+#else
+
+int chip8JitPerfInit(bool withJitdump) {
+    (void)withJitdump;
+    fprintf(stderr, "[chip8_jit] ERROR: perf maps need the native code generator (x86-64 Linux)\n");
+    return 1;
+}
+
+#endif
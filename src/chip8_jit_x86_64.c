@@ -0,0 +1,512 @@
+/* this source file generates the x86-64 code of the native blocks (System V calling convention: the machine is in
+rdi, the budget in esi, the number of instructions run is returned in eax). The code only addresses the machine through rdi and never
+calls out, so a block runs wherever it is copied. Every guest instruction reads its operands from the machine and
+writes its results back, in the interpreter's order (it matters when X or Y is F) */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <chip8_jit.h>
+
+#if CHIP8_JIT_SUPPORTED
+
+typedef enum {
+    KIND_NATIVE, //runs natively and flows to the next instruction
+    KIND_IGNORED, //does nothing with this profile (0NNN, undefined encodings, instructions of other platforms)
+    KIND_TERMINATOR, //runs natively and ends the block (jumps, calls, returns, skips)
+    KIND_INTERPRETED //left to the interpreter (display, memory, input, random numbers): the block ends before it
+} InstructionKind;
+
+static InstructionKind instructionKind(uint8_t op, const Chip8Quirks* q) {
+    switch (op) {
+        case CHIP8_OP_CLS:
+        case CHIP8_OP_RND:
+        case CHIP8_OP_DRW:
+        case CHIP8_OP_LD_VX_K:
+        case CHIP8_OP_LD_B:
+        case CHIP8_OP_LD_MEM_VX:
+        case CHIP8_OP_LD_VX_MEM:
+            return KIND_INTERPRETED;
+        case CHIP8_OP_SCD:
+        case CHIP8_OP_SCR:
+        case CHIP8_OP_SCL:
+        case CHIP8_OP_EXIT:
+        case CHIP8_OP_LOW:
+        case CHIP8_OP_HIGH:
+        case CHIP8_OP_LD_R_VX:
+        case CHIP8_OP_LD_VX_R:
+            return q->schip ? KIND_INTERPRETED : KIND_IGNORED;
+        case CHIP8_OP_SCU:
+        case CHIP8_OP_SAVE_RANGE:
+        case CHIP8_OP_LOAD_RANGE:
+        case CHIP8_OP_PLANE:
+        case CHIP8_OP_AUDIO:
+            return q->xochip ? KIND_INTERPRETED : KIND_IGNORED;
+        case CHIP8_OP_LD_HF:
+            return q->schip ? KIND_NATIVE : KIND_IGNORED;
+        case CHIP8_OP_LD_I_LONG:
+        case CHIP8_OP_PITCH:
+            return q->xochip ? KIND_NATIVE : KIND_IGNORED;
+        case CHIP8_OP_JP:
+        case CHIP8_OP_CALL:
+        case CHIP8_OP_RET:
+        case CHIP8_OP_SE_IMM:
+        case CHIP8_OP_SNE_IMM:
+        case CHIP8_OP_SE_REG:
+        case CHIP8_OP_SNE_REG:
+        case CHIP8_OP_SKP:
+        case CHIP8_OP_SKNP:
+        case CHIP8_OP_JP_V0:
+            return KIND_TERMINATOR;
+        case CHIP8_OP_NOP:
+            return KIND_IGNORED;
+        default:
+            return KIND_NATIVE;
+    }
+}
+
+int chip8JitScanBlock(const Chip8Rom* rom, Chip8Profile profile, uint16_t address, Chip8JitSource* source) {
+    const Chip8Quirks* q = &chip8ProfileQuirks[profile];
+    uint32_t memorySize = q->xochip ? XOCHIP_MEMORY_SIZE : CHIP8_MEMORY_SIZE;
+    source->start = address;
+    source->instructionCount = 0;
+
+    uint32_t a = address;
+    while (source->instructionCount < CHIP8_JIT_MAX_BLOCK_INSTRUCTIONS) {
+        Chip8InstructionInfo info = chip8AnalyzeInstruction(rom, profile, (uint16_t)a);
+        InstructionKind kind = instructionKind(info.instruction.op, q);
+        if (kind == KIND_INTERPRETED)
+            break;
+        //the block never wraps around the end of memory, and a skip depends on the length of the next instruction
+        uint32_t end = a + info.length;
+        uint32_t checkedEnd = info.flow == CHIP8_FLOW_SKIP ? end + 2 : end;
+        if (checkedEnd > memorySize || checkedEnd - address > CHIP8_JIT_MAX_BLOCK_BYTES)
+            break;
+        source->instructions[source->instructionCount++] = info;
+        source->end = (uint16_t)end;
+        source->checkedEnd = (uint16_t)checkedEnd;
+        a = end;
+        if (kind == KIND_TERMINATOR)
+            break;
+    }
+    if (source->instructionCount == 0)
+        source->end = source->checkedEnd = address;
+    return source->instructionCount;
+}
+
+
+#define REG_EAX 0
+#define REG_ECX 1
+#define REG_EDX 2
+#define REG_ESI 6 //the budget argument
+#define REG_RDI 7
+
+#define CONDITION_C 0x2
+#define CONDITION_NC 0x3
+#define CONDITION_E 0x4
+#define CONDITION_NE 0x5
+
+//the fields addressed here are listed in CHIP8_JIT_STATE_LAYOUT (chip8_jit.h), which keys the cached code
+#define OFFSET_V(x) ((int32_t)(offsetof(Chip8State, V) + (x)))
+#define OFFSET_VF OFFSET_V(0xF)
+#define OFFSET(field) ((int32_t)offsetof(Chip8State, field))
+
+typedef struct {
+    uint8_t* code;
+    uint32_t size;
+} Emitter;
+
+static void emit8(Emitter* e, uint8_t byte) {
+    e->code[e->size++] = byte;
+}
+
+static void emit16(Emitter* e, uint16_t value) {
+    emit8(e, (uint8_t)value);
+    emit8(e, (uint8_t)(value >> 8));
+}
+
+static void emit32(Emitter* e, uint32_t value) {
+    emit16(e, (uint16_t)value);
+    emit16(e, (uint16_t)(value >> 16));
+}
+
+//ModRM byte of [rdi + disp32] with reg as the register operand
+static void emitMemory(Emitter* e, int reg, int32_t displacement) {
+    emit8(e, (uint8_t)(0x80 | (reg << 3) | REG_RDI));
+    emit32(e, (uint32_t)displacement);
+}
+
+//movzx reg, byte [rdi + displacement]
+static void loadByte(Emitter* e, int reg, int32_t displacement) {
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emitMemory(e, reg, displacement);
+}
+
+//mov byte [rdi + displacement], reg8
+static void storeByte(Emitter* e, int reg, int32_t displacement) {
+    emit8(e, 0x88);
+    emitMemory(e, reg, displacement);
+}
+
+//mov byte [rdi + displacement], value
+static void storeByteImmediate(Emitter* e, int32_t displacement, uint8_t value) {
+    emit8(e, 0xC6);
+    emitMemory(e, 0, displacement);
+    emit8(e, value);
+}
+
+//add (/0) or cmp (/7) byte [rdi + displacement], value
+static void byteImmediateOperation(Emitter* e, int extension, int32_t displacement, uint8_t value) {
+    emit8(e, 0x80);
+    emitMemory(e, extension, displacement);
+    emit8(e, value);
+}
+
+//or (0x08), and (0x20), xor (0x30) or cmp reg8 (0x3A) with byte [rdi + displacement]
+static void byteRegisterOperation(Emitter* e, uint8_t opcode, int reg, int32_t displacement) {
+    emit8(e, opcode);
+    emitMemory(e, reg, displacement);
+}
+
+//movzx reg, word [rdi + displacement]
+static void loadWord(Emitter* e, int reg, int32_t displacement) {
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    emitMemory(e, reg, displacement);
+}
+
+//mov word [rdi + displacement], reg16
+static void storeWord(Emitter* e, int reg, int32_t displacement) {
+    emit8(e, 0x66);
+    emit8(e, 0x89);
+    emitMemory(e, reg, displacement);
+}
+
+//mov word [rdi + displacement], value
+static void storeWordImmediate(Emitter* e, int32_t displacement, uint16_t value) {
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emitMemory(e, 0, displacement);
+    emit16(e, value);
+}
+
+//add word [rdi + displacement], reg16
+static void addWord(Emitter* e, int reg, int32_t displacement) {
+    emit8(e, 0x66);
+    emit8(e, 0x01);
+    emitMemory(e, reg, displacement);
+}
+
+//add qword [rdi + displacement], value
+static void addQwordImmediate(Emitter* e, int32_t displacement, int8_t value) {
+    emit8(e, 0x48);
+    emit8(e, 0x83);
+    emitMemory(e, 0, displacement);
+    emit8(e, (uint8_t)value);
+}
+
+//mov reg, value
+static void loadImmediate(Emitter* e, int reg, uint32_t value) {
+    emit8(e, (uint8_t)(0xB8 + reg));
+    emit32(e, value);
+}
+
+//an operation between two registers: opcode /r with destination in r/m (add 0x01, sub 0x29, cmp 0x39, mov 0x89)
+static void registerOperation(Emitter* e, uint8_t opcode, int destination, int source) {
+    emit8(e, opcode);
+    emit8(e, (uint8_t)(0xC0 | (source << 3) | destination));
+}
+
+/* the block's epilogue: PC is already set, the instructions run are counted and returned. Also the stub a call or
+return jumps to when the stack would overflow or underflow (count is then the number of instructions before it) */
+static void emitExit(Emitter* e, int count) {
+    if (count > 0)
+        addQwordImmediate(e, OFFSET(instructionCount), (int8_t)count);
+    loadImmediate(e, REG_EAX, (uint32_t)count);
+    emit8(e, 0xC3); //ret
+}
+
+//jcc rel32 to a stub emitted later: returns the position of the displacement, patched by patchJump
+static uint32_t emitConditionalJump(Emitter* e, int condition) {
+    emit8(e, 0x0F);
+    emit8(e, (uint8_t)(0x80 | condition));
+    emit32(e, 0);
+    return e->size - 4;
+}
+
+static void patchJump(Emitter* e, uint32_t position) {
+    uint32_t displacement = e->size - (position + 4);
+    memcpy(e->code + position, &displacement, 4);
+}
+
+//cmp esi, value: compares the budget with the instructions run so far
+static void compareBudget(Emitter* e, int value) {
+    emit8(e, 0x83);
+    emit8(e, (uint8_t)(0xC0 | (7 << 3) | REG_ESI));
+    emit8(e, (uint8_t)value);
+}
+
+//and reg, value (a sign-extended byte)
+static void andImmediate(Emitter* e, int reg, uint8_t value) {
+    emit8(e, 0x83);
+    emit8(e, (uint8_t)(0xE0 | reg));
+    emit8(e, value);
+}
+
+//VF = eax >= ecx
+static void emitNoBorrow(Emitter* e) {
+    registerOperation(e, 0x39, REG_EAX, REG_ECX);
+    emit8(e, 0x0F); //setae dl
+    emit8(e, 0x93);
+    emit8(e, 0xC0 | REG_EDX);
+    storeByte(e, REG_EDX, OFFSET_VF);
+}
+
+//PC is next, or skipTarget when condition holds (the flags are set by the caller)
+static void emitSkip(Emitter* e, int condition, uint16_t next, uint16_t skipTarget) {
+    loadImmediate(e, REG_ECX, next);
+    loadImmediate(e, REG_EDX, skipTarget);
+    emit8(e, 0x0F);
+    emit8(e, (uint8_t)(0x40 | condition)); //cmovcc ecx, edx
+    emit8(e, (uint8_t)(0xC0 | (REG_ECX << 3) | REG_EDX));
+    storeWord(e, REG_ECX, OFFSET(PC));
+}
+
+static void emitInstruction(Emitter* e, const Chip8InstructionInfo* info, const Chip8Quirks* q) {
+    int x = info->instruction.x;
+    int y = info->instruction.y;
+    uint8_t nn = (uint8_t)info->instruction.nnn;
+    uint16_t nnn = info->instruction.nnn;
+
+    switch (info->instruction.op) {
+        case CHIP8_OP_LD_IMM:
+            storeByteImmediate(e, OFFSET_V(x), nn);
+            break;
+        case CHIP8_OP_ADD_IMM:
+            byteImmediateOperation(e, 0, OFFSET_V(x), nn);
+            break;
+        case CHIP8_OP_LD_REG:
+            loadByte(e, REG_EAX, OFFSET_V(y));
+            storeByte(e, REG_EAX, OFFSET_V(x));
+            break;
+        case CHIP8_OP_OR:
+        case CHIP8_OP_AND:
+        case CHIP8_OP_XOR:
+            loadByte(e, REG_EAX, OFFSET_V(y));
+            byteRegisterOperation(e, info->instruction.op == CHIP8_OP_OR ? 0x08 : info->instruction.op == CHIP8_OP_AND ? 0x20 : 0x30, REG_EAX, OFFSET_V(x));
+            if (q->vfReset)
+                storeByteImmediate(e, OFFSET_VF, 0);
+            break;
+        case CHIP8_OP_ADD_REG:
+            loadByte(e, REG_EAX, OFFSET_V(x));
+            loadByte(e, REG_ECX, OFFSET_V(y));
+            registerOperation(e, 0x01, REG_EAX, REG_ECX);
+            storeByte(e, REG_EAX, OFFSET_V(x));
+            emit8(e, 0xC1); //shr eax, 8: the carry
+            emit8(e, 0xE8);
+            emit8(e, 8);
+            storeByte(e, REG_EAX, OFFSET_VF);
+            break;
+        case CHIP8_OP_SUB:
+            //VF = VX >= VY, with VX read before and VY after VX is written
+            loadByte(e, REG_EAX, OFFSET_V(x));
+            loadByte(e, REG_ECX, OFFSET_V(y));
+            registerOperation(e, 0x89, REG_EDX, REG_EAX);
+            registerOperation(e, 0x29, REG_EDX, REG_ECX);
+            storeByte(e, REG_EDX, OFFSET_V(x));
+            loadByte(e, REG_ECX, OFFSET_V(y));
+            emitNoBorrow(e);
+            break;
+        case CHIP8_OP_SUBN:
+            //VF = VY >= VX, both read after VX is written
+            loadByte(e, REG_EAX, OFFSET_V(y));
+            loadByte(e, REG_ECX, OFFSET_V(x));
+            registerOperation(e, 0x29, REG_EAX, REG_ECX);
+            storeByte(e, REG_EAX, OFFSET_V(x));
+            loadByte(e, REG_EAX, OFFSET_V(y));
+            loadByte(e, REG_ECX, OFFSET_V(x));
+            emitNoBorrow(e);
+            break;
+        case CHIP8_OP_SHR:
+        case CHIP8_OP_SHL:
+            loadByte(e, REG_EAX, OFFSET_V(q->shiftVx ? x : y));
+            registerOperation(e, 0x89, REG_ECX, REG_EAX);
+            if (info->instruction.op == CHIP8_OP_SHR) {
+                emit8(e, 0xD1); //shr ecx, 1
+                emit8(e, 0xE9);
+                storeByte(e, REG_ECX, OFFSET_V(x));
+                andImmediate(e, REG_EAX, 1);
+            }
+            else {
+                registerOperation(e, 0x01, REG_ECX, REG_ECX);
+                storeByte(e, REG_ECX, OFFSET_V(x));
+                emit8(e, 0xC1); //shr eax, 7
+                emit8(e, 0xE8);
+                emit8(e, 7);
+            }
+            storeByte(e, REG_EAX, OFFSET_VF);
+            break;
+        case CHIP8_OP_LD_I:
+            storeWordImmediate(e, OFFSET(I), nnn);
+            break;
+        case CHIP8_OP_LD_I_LONG:
+            if (q->xochip)
+                storeWordImmediate(e, OFFSET(I), info->longAddress);
+            break;
+        case CHIP8_OP_ADD_I:
+            loadByte(e, REG_EAX, OFFSET_V(x));
+            addWord(e, REG_EAX, OFFSET(I));
+            break;
+        case CHIP8_OP_LD_VX_DT:
+            loadByte(e, REG_EAX, OFFSET(delay_timer));
+            storeByte(e, REG_EAX, OFFSET_V(x));
+            break;
+        case CHIP8_OP_LD_DT_VX:
+        case CHIP8_OP_LD_ST_VX:
+            loadByte(e, REG_EAX, OFFSET_V(x));
+            storeByte(e, REG_EAX, info->instruction.op == CHIP8_OP_LD_DT_VX ? OFFSET(delay_timer) : OFFSET(sound_timer));
+            break;
+        case CHIP8_OP_LD_F:
+        case CHIP8_OP_LD_HF: {
+            bool big = info->instruction.op == CHIP8_OP_LD_HF;
+            if (big && !q->schip)
+                break;
+            loadByte(e, REG_EAX, OFFSET_V(x));
+            andImmediate(e, REG_EAX, 0x0F);
+            emit8(e, 0x6B); //imul eax, eax, glyph size
+            emit8(e, 0xC0);
+            emit8(e, big ? 10 : 5);
+            emit8(e, 0x05); //add eax, font position
+            emit32(e, big ? BIG_FONT_DATA_POSITION : FONT_DATA_POSITION);
+            storeWord(e, REG_EAX, OFFSET(I));
+            break;
+        }
+        case CHIP8_OP_PITCH:
+            if (q->xochip) {
+                loadByte(e, REG_EAX, OFFSET_V(x));
+                storeByte(e, REG_EAX, OFFSET(pitch));
+            }
+            break;
+        default: //ignored
+            break;
+    }
+}
+
+/* the last instruction of a block that ends with a jump, call, return or skip; a call or return sets *stub to the
+jump to its stack error exit */
+static void emitTerminator(Emitter* e, const Chip8InstructionInfo* info, const Chip8Quirks* q, uint32_t* stub) {
+    int x = info->instruction.x;
+    int y = info->instruction.y;
+    uint8_t nn = (uint8_t)info->instruction.nnn;
+    uint16_t nnn = info->instruction.nnn;
+    uint16_t next = (uint16_t)(info->address + info->length);
+    //the skip target as the interpreter computes it (not wrapped around): past the next instruction, whose length the analysis found
+    uint16_t addressMask = q->xochip ? XOCHIP_ADDRESS_MASK : CHIP8_ADDRESS_MASK;
+    uint16_t skipTarget = (uint16_t)(next + ((info->successors[1] - info->successors[0]) & addressMask));
+
+    switch (info->instruction.op) {
+        case CHIP8_OP_JP:
+            storeWordImmediate(e, OFFSET(PC), nnn);
+            break;
+        case CHIP8_OP_CALL:
+            byteImmediateOperation(e, 7, OFFSET(SP), STACK_SIZE);
+            *stub = emitConditionalJump(e, CONDITION_NC); //jae: SP >= STACK_SIZE
+            loadByte(e, REG_EAX, OFFSET(SP));
+            emit8(e, 0x66); //mov word [rdi + rax*2 + stack], next
+            emit8(e, 0xC7);
+            emit8(e, 0x84);
+            emit8(e, 0x47);
+            emit32(e, (uint32_t)OFFSET(stack));
+            emit16(e, next);
+            byteImmediateOperation(e, 0, OFFSET(SP), 1);
+            storeWordImmediate(e, OFFSET(PC), nnn);
+            break;
+        case CHIP8_OP_RET:
+            loadByte(e, REG_EAX, OFFSET(SP));
+            emit8(e, 0x85); //test eax, eax
+            emit8(e, 0xC0);
+            *stub = emitConditionalJump(e, CONDITION_E);
+            emit8(e, 0xFF); //dec eax
+            emit8(e, 0xC8);
+            storeByte(e, REG_EAX, OFFSET(SP));
+            emit8(e, 0x0F); //movzx ecx, word [rdi + rax*2 + stack]
+            emit8(e, 0xB7);
+            emit8(e, 0x8C);
+            emit8(e, 0x47);
+            emit32(e, (uint32_t)OFFSET(stack));
+            storeWord(e, REG_ECX, OFFSET(PC));
+            break;
+        case CHIP8_OP_SE_IMM:
+        case CHIP8_OP_SNE_IMM:
+            byteImmediateOperation(e, 7, OFFSET_V(x), nn);
+            emitSkip(e, info->instruction.op == CHIP8_OP_SE_IMM ? CONDITION_E : CONDITION_NE, next, skipTarget);
+            break;
+        case CHIP8_OP_SE_REG:
+        case CHIP8_OP_SNE_REG:
+            loadByte(e, REG_EAX, OFFSET_V(x));
+            byteRegisterOperation(e, 0x3A, REG_EAX, OFFSET_V(y));
+            emitSkip(e, info->instruction.op == CHIP8_OP_SE_REG ? CONDITION_E : CONDITION_NE, next, skipTarget);
+            break;
+        case CHIP8_OP_SKP:
+        case CHIP8_OP_SKNP:
+            loadByte(e, REG_EAX, OFFSET_V(x));
+            andImmediate(e, REG_EAX, 0x0F);
+            loadWord(e, REG_EDX, OFFSET(keypad));
+            emit8(e, 0x0F); //bt edx, eax: the key's bit in CF
+            emit8(e, 0xA3);
+            emit8(e, (uint8_t)(0xC0 | (REG_EAX << 3) | REG_EDX));
+            emitSkip(e, info->instruction.op == CHIP8_OP_SKP ? CONDITION_C : CONDITION_NC, next, skipTarget);
+            break;
+        case CHIP8_OP_JP_V0:
+            loadByte(e, REG_EAX, OFFSET_V(q->jumpVx ? x : 0));
+            emit8(e, 0x05); //add eax, nnn
+            emit32(e, nnn);
+            storeWord(e, REG_EAX, OFFSET(PC));
+            break;
+        default:
+            break;
+    }
+}
+
+uint32_t chip8JitEmitBlock(const Chip8JitSource* source, Chip8Profile profile, uint8_t* code) {
+    const Chip8Quirks* q = &chip8ProfileQuirks[profile];
+    Emitter e = {code, 0};
+    int last = source->instructionCount - 1;
+    const Chip8InstructionInfo* terminator = &source->instructions[last];
+    bool endsWithTerminator = instructionKind(terminator->instruction.op, q) == KIND_TERMINATOR;
+
+    //the budget exits: the block stops after as many instructions as the budget allows
+    uint32_t budgetExits[CHIP8_JIT_MAX_BLOCK_INSTRUCTIONS];
+    for (int i = 0; i < (endsWithTerminator ? last : source->instructionCount); i++) {
+        emitInstruction(&e, &source->instructions[i], q);
+        if (i < last) {
+            compareBudget(&e, i + 1);
+            budgetExits[i] = emitConditionalJump(&e, CONDITION_E);
+        }
+    }
+
+    uint32_t stub = 0;
+    if (endsWithTerminator)
+        emitTerminator(&e, terminator, q, &stub);
+    else
+        storeWordImmediate(&e, OFFSET(PC), source->end);
+    emitExit(&e, source->instructionCount);
+
+    for (int i = 0; i < last; i++) {
+        patchJump(&e, budgetExits[i]);
+        storeWordImmediate(&e, OFFSET(PC), source->instructions[i + 1].address);
+        emitExit(&e, i + 1);
+    }
+    //the stack error exit: the machine stops at the call or return, which has not run
+    if (stub != 0) {
+        patchJump(&e, stub);
+        storeWordImmediate(&e, OFFSET(PC), terminator->address);
+        emitExit(&e, last);
+    }
+    return e.size;
+}
+
+#endif
@@ -13,11 +13,12 @@
 
 #endif
 
+#include <graphics.h>
 #include <shader_manager.h>
 #include <input.h>
 #include <chip8.h>
-
-static void chip8ScreenToRGBA(void);
+#include <profiler.h>
+#include <overlay.h>
 
 
 //GLOBAL VARIABLES (accessible outside of this file)
@@ -34,16 +35,36 @@ static GLFWwindow* window = NULL;
 
 static bool frameChanged = true;
 
-/*points to the chip8Screen bool array of the chip8 module,
+/*points to the bit-packed screen planes of the chip8 module,
 and is initialized using the getChip8Screen of the chip8 module (in graphicsInit)*/
-static bool (*chip8Screen)[CHIP8_DISPLAY_WIDTH];
-
-//the raw RGBA bytes of the image representing the chip8Screen that will converted to a texture by OpenGL
-unsigned char* screenBytes;
-
-//colors used by the rendering system to represent ON and OFF pixels on the CHIP-8 screen
-static float screenOnColor[4] = {1.0f, 1.0f, 1.0f, 1.0f};
-static float screenOffColor[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+static const uint64_t* chip8Screen;
+
+/* the screen texture holds the bit-packed planes as they are (one 32-bit unsigned integer texel per half word,
+CHIP8_HIRES_DISPLAY_HEIGHT texel rows per plane): the fragment shader extracts each pixel's plane bits and
+looks its color up in the palette, so no per-pixel work is done on the CPU */
+#define TEXTURE_WIDTH (CHIP8_SCREEN_ROW_WORDS * 2)
+#define TEXTURE_HEIGHT (CHIP8_HIRES_DISPLAY_HEIGHT * CHIP8_MAX_PLANES)
+
+/* colors of the pixels, indexed by their plane bits (bit p set: the pixel is on in plane p);
+CHIP-8 and SUPER-CHIP programs only use the first two */
+static const float palette[16][4] = {
+    {0.0f, 0.0f, 0.0f, 1.0f}, //off
+    {1.0f, 1.0f, 1.0f, 1.0f}, //on (plane 0)
+    {0.67f, 0.67f, 0.67f, 1.0f}, //plane 1
+    {0.33f, 0.33f, 0.33f, 1.0f}, //planes 0 and 1
+    {1.0f, 0.0f, 0.0f, 1.0f},
+    {0.0f, 1.0f, 0.0f, 1.0f},
+    {0.0f, 0.0f, 1.0f, 1.0f},
+    {1.0f, 1.0f, 0.0f, 1.0f},
+    {0.53f, 0.0f, 0.0f, 1.0f},
+    {0.0f, 0.53f, 0.0f, 1.0f},
+    {0.0f, 0.0f, 0.53f, 1.0f},
+    {0.53f, 0.53f, 0.0f, 1.0f},
+    {1.0f, 0.0f, 1.0f, 1.0f},
+    {0.0f, 1.0f, 1.0f, 1.0f},
+    {0.53f, 0.0f, 0.53f, 1.0f},
+    {0.0f, 0.53f, 0.53f, 1.0f}
+};
 
 typedef struct {
     unsigned int shaderProgram;
@@ -51,6 +72,8 @@ typedef struct {
     unsigned int screenQuadId; //vbo
     unsigned int ebo;
     unsigned int texture;
+    int resolutionLocation; //uniforms of the shader program
+    int planeCountLocation;
 } OpenGlState;
 static OpenGlState renderState;
 
@@ -70,11 +93,6 @@ void graphicsSetFrameChanged(bool newValue) {
 
 int graphicsInit() {
     chip8Screen = getChip8Screen();
-    screenBytes = malloc(CHIP8_DISPLAY_HEIGHT * CHIP8_DISPLAY_WIDTH * 4 * sizeof(unsigned char));
-    if (!screenBytes) {
-        fprintf(stderr, "[graphics] ERROR in graphicsInit(): Failed to allocate screenBytes.\n");
-        return -1;
-    }   
 
     //part 1: initializing the GLFW window and GLAD (the library that will load OpenGL's functions)
 
@@ -114,8 +132,8 @@ int graphicsInit() {
 
 
     /* part2: initializing OpenGL's state to be able to draw the CHIP-8 screen: it will scale up
-    a 64x32 raw RGBA image representing the CHIP-8 display to the whole window by applying
-    it as a texture to a quad (two OpenGL triangles forming a rectangle) */
+    the bit-packed CHIP-8 display planes to the whole window by applying them as a texture
+    to a quad (two OpenGL triangles forming a rectangle) */
 
     const float screenQuad[] = {
         //positions     //texture coordinates
@@ -151,42 +169,69 @@ int graphicsInit() {
     glGenTextures(1, &(renderState.texture));
     glBindTexture(GL_TEXTURE_2D, renderState.texture);
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, clearColor);  
-    
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    //integer textures can't be filtered (they are read with texelFetch anyway)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, CHIP8_DISPLAY_WIDTH, CHIP8_DISPLAY_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, screenBytes);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, TEXTURE_WIDTH, TEXTURE_HEIGHT, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, chip8Screen);
 
     //shader program
     renderState.shaderProgram = getShaderProgram();
+    renderState.resolutionLocation = glGetUniformLocation(renderState.shaderProgram, "resolution");
+    renderState.planeCountLocation = glGetUniformLocation(renderState.shaderProgram, "planeCount");
+
+    if (overlayInit() != 0)
+        return -1;
 
     //setting up the OpenGL context for subsequent graphicsUpdate calls
     glBindVertexArray(renderState.vao);
     glBindTexture(GL_TEXTURE_2D, renderState.texture);
     glUseProgram(renderState.shaderProgram);
+    glUniform1i(glGetUniformLocation(renderState.shaderProgram, "screen"), 0);
+    glUniform4fv(glGetUniformLocation(renderState.shaderProgram, "palette"), 16, &palette[0][0]);
 
     return 0;
 }
 
 void graphicsUpdate() {
+    graphicsPresent(chip8GetMachine());
+}
+
+void graphicsPresent(const Chip8State* machine) {
 
-    chip8ScreenToRGBA();
+    int width, height;
+    chip8GetScreenSize(machine, &width, &height);
+    int planeCount = chip8GetPlaneCount(machine);
 
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CHIP8_DISPLAY_WIDTH, CHIP8_DISPLAY_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, screenBytes);
+    /* the phases are timed on the CPU side: the driver may defer the GPU work of the upload and the draw, which then
+    shows up in the buffer swap */
+    uint64_t phaseStart = monotonicNanoseconds();
+    //only the planes in use are uploaded, the shader does not read the others
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TEXTURE_WIDTH, CHIP8_HIRES_DISPLAY_HEIGHT * planeCount, GL_RED_INTEGER, GL_UNSIGNED_INT, chip8GetScreen(machine));
+    profilerRecord(PROFILER_PHASE_TEXTURE_UPLOAD, phaseStart);
+
+    phaseStart = monotonicNanoseconds();
+    glBindVertexArray(renderState.vao); //the overlay binds its own vertex array and program
+    glUseProgram(renderState.shaderProgram);
+    glUniform2i(renderState.resolutionLocation, width, height);
+    glUniform1i(renderState.planeCountLocation, planeCount);
 
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, (const void*) 0);
+    overlayDraw();
+    profilerRecord(PROFILER_PHASE_DRAW, phaseStart);
 
+    phaseStart = monotonicNanoseconds();
     glfwSwapBuffers(window);
+    profilerRecord(PROFILER_PHASE_SWAP_BUFFERS, phaseStart);
 }
 
 void graphicsTerminate() {
 
-    free(screenBytes);
-
     //deletes data sent to GPU via OpenGL
+    overlayTerminate();
     glDeleteVertexArrays(1, &renderState.vao);
     glDeleteBuffers(1, &renderState.screenQuadId);
     glDeleteBuffers(1, &renderState.ebo);
@@ -197,18 +242,3 @@ void graphicsTerminate() {
     glfwDestroyWindow(window);
     glfwTerminate();
 }
-
-/* updates screenBytes (RGBA buffer that will be passed as a texture to the OpenGL context)
-using chip8Screen (bool array) */
-static void chip8ScreenToRGBA() {
-    for (unsigned int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
-        for (unsigned int x = 0; x < CHIP8_DISPLAY_WIDTH; x++) {
-            float* color = chip8Screen[y][x] ? screenOnColor : screenOffColor;
-            int index = (y * CHIP8_DISPLAY_WIDTH + x) * 4;
-                screenBytes[index + 0] = (unsigned char)(color[0] * 255.0f); // R
-                screenBytes[index + 1] = (unsigned char)(color[1] * 255.0f); // G
-                screenBytes[index + 2] = (unsigned char)(color[2] * 255.0f); // B
-                screenBytes[index + 3] = (unsigned char)(color[3] * 255.0f); // A
-        }
-    }
-}
\ No newline at end of file
@@ -7,8 +7,19 @@
 #include <stdbool.h>
 
 #include <chip8.h>
+#include <overlay.h>
+
+//keys of the emulator itself, handled once per press (the CHIP-8 keypad is sampled by processInput)
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    (void)window;
+    (void)scancode;
+    (void)mods;
+    if (key == GLFW_KEY_F1 && action == GLFW_PRESS)
+        overlayToggle();
+}
 
 void framebufferSizeCallback(GLFWwindow* window, int width, int height);
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
 
 static GLFWwindow* window = NULL;
 
@@ -40,17 +51,19 @@ void inputInit() {
     }
 
     glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
+    glfwSetKeyCallback(window, keyCallback);
 
 }
 
-void processInput() {
+uint16_t processInput() {
     //static int ticks = 0;
     if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
         glfwSetWindowShouldClose(window, true);
 
-    bool keypadState[16];
+    uint16_t keypadState = 0;
     for (int i = 0; i < 16; i++) {
-        keypadState[i]=glfwGetKey(window, keyBindings[i])==GLFW_PRESS;
+        if (glfwGetKey(window, keyBindings[i])==GLFW_PRESS)
+            keypadState |= (uint16_t)(1u << i);
         
         /*
         if (ticks==60) {
@@ -71,6 +84,7 @@ void processInput() {
     */
 
     chip8UpdateKeypadState(keypadState);
+    return keypadState;
 }
 
 bool inputShouldClose(void) {
@@ -3,10 +3,17 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <graphics.h>
 #include <input.h>
+#include <audio.h>
 #include <chip8.h>
+#include <chip8_jit.h>
+#include <profiler.h>
+#include <trace.h>
+#include <overlay.h>
 
 #ifdef _WIN32
     #include <windows.h>
@@ -23,47 +30,460 @@
 
 
 /* functions whose name begin with "graphics" are from the graphics.c module ;
-same with "input" and "chip8" */
+same with "input", "audio" and "chip8" */
+
+/* with --sync audio, a frame is emulated whenever the audio buffer falls to this many samples (about 2 frames),
+and the dynamic rate control keeps it there: the sound card's clock paces the emulation */
+#define AUDIO_SYNC_BUFFERED_SAMPLES (2 * AUDIO_SAMPLE_RATE / 60)
+
+typedef enum {
+    SYNC_VIDEO, //frames are paced by glfwGetTime and sleep
+    SYNC_AUDIO //frames are paced by the consumption of the audio backend
+} SyncMode;
+
+#define MAX_SLICES 8 //INSTRUCTIONS_PER_FRAME: a slice runs at least one instruction
+#define MAX_RUN_AHEAD 8 //in frames
+
+/* frame skipping: a frame whose instructions end after its deadline is not presented (its instructions always run),
+but never more than MAX_CONSECUTIVE_SKIPS frames in a row; a host later than MAX_LAG frames gives up catching up */
+#define MAX_CONSECUTIVE_SKIPS 4
+#define MAX_LAG 8
+#define SKIP_REPORT_INTERVAL 5.0 //in seconds
+
+#define OVERLAY_UPDATE_INTERVAL 0.5 //in seconds: the overlay's numbers are averages over this interval
+
+static void sleepSeconds(double seconds) {
+    if (seconds <= 0.0)
+        return;
+    #ifdef _WIN32
+        Sleep((DWORD)(seconds * 1000));
+    #elif defined(__linux__)
+        usleep((useconds_t)(seconds * 1e6));
+    #endif
+}
+
+/* input-to-present latency, measured from the last input poll that did not see a keypad change yet (the change
+happened after it) to the present of the frame that sampled it: an upper bound of the input-to-photon latency
+left to the host (the display's own latency excluded) */
+typedef struct {
+    double sum;
+    double worst;
+    int count;
+} LatencyStatistics;
+
+typedef struct {
+    long skipped;
+    int consecutive; //current run of skipped frames
+    int worstConsecutive;
+    long skippedSinceReport;
+    double lastReportTime;
+    double frameCost; //total time spent emulating and presenting, in seconds
+    long frames;
+} FrameSkipStatistics;
+
+//accumulated between two updates of the performance overlay
+typedef struct {
+    double lastUpdateTime;
+    uint64_t lastInstructionCount;
+    double frameCost;
+    long frames;
+} OverlayInterval;
+
+static void printUsage(const char* program) {
+    fprintf(stderr, "[main] ERROR: expected format: %s [options] <filepath>\n", program);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "    --profile default|vip|schip|xochip   platform quirks to reproduce (default: default)\n");
+    fprintf(stderr, "    --audio native|null|wav:<file>       sound output (default: native, null if there is no audio device)\n");
+    fprintf(stderr, "    --timing fixed|vip                   instructions per frame: fixed, or COSMAC VIP cycle costs (needs --profile vip)\n");
+    fprintf(stderr, "    --slices 1-%d                         instruction slices per frame, input being sampled before each one (default: 1)\n", MAX_SLICES);
+    fprintf(stderr, "    --run-ahead 0-%d                      frames emulated ahead of the presented one, then rolled back (default: 0)\n", MAX_RUN_AHEAD);
+    fprintf(stderr, "    --frame-skip auto|off                skip presents when the host can't keep up (default: auto)\n");
+    fprintf(stderr, "    --sync video|audio                   clock pacing the emulation (default: video)\n");
+    fprintf(stderr, "    --overlay                            show the performance overlay (toggled with F1): instructions per second,\n");
+    fprintf(stderr, "                                         frame time (us), skipped presents and speed (%%), one per row\n");
+    fprintf(stderr, "    --phase-stats <seconds>              time the phases of each frame, reporting every <seconds> (0: at exit only)\n");
+    fprintf(stderr, "    --trace-timeline <file>              write a timeline of every thread's scopes on exit (Chrome trace-event JSON)\n");
+    fprintf(stderr, "    --jit on|off                         compile hot blocks to native code, x86-64 Linux only (default: on where available)\n");
+    fprintf(stderr, "    --jit-threshold <n>                  times a block is interpreted before it is compiled (default: %d)\n", CHIP8_JIT_DEFAULT_THRESHOLD);
+    fprintf(stderr, "    --jit-cache <directory>|default|off  keep the compiled blocks across runs in <directory>, or in ~/.cache/chip8-c\n");
+    fprintf(stderr, "                                         with default (default: off, nothing is written to disk)\n");
+    fprintf(stderr, "    --perf-map map|jitdump               name the compiled blocks for Linux perf in /tmp/perf-<pid>.map\n");
+    fprintf(stderr, "                                         (jitdump: also write /tmp/jit-<pid>.dump, for perf inject --jit)\n");
+}
 
 int main(int argc, char* argv[]) {
 
-    if (argc != 2) {
-        fprintf(stderr, "[main] ERROR: expected format: %s <filepath>\n", argv[0]);
+    const char* filepath = NULL;
+    int profile = CHIP8_PROFILE_DEFAULT;
+    AudioBackend audioBackend = AUDIO_BACKEND_NATIVE;
+    const char* wavFilepath = NULL;
+    SyncMode syncMode = SYNC_VIDEO;
+    Chip8Timing timing = CHIP8_TIMING_FIXED;
+    int nbOfSlices = 1;
+    int runAhead = 0;
+    bool frameSkip = true;
+    double phaseStatsInterval = -1.0; //negative: phases are not timed
+    const char* traceFilepath = NULL;
+    bool showOverlay = false;
+    bool jit = CHIP8_JIT_SUPPORTED;
+    int jitThreshold = CHIP8_JIT_DEFAULT_THRESHOLD;
+    const char* jitCacheDirectory = NULL; //opt-in: the cache holds code the emulator runs
+    int perfMap = 0; //0: none, 1: perf map, 2: perf map and jitdump
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile = chip8ProfileFromName(argv[++i]);
+            if (profile < 0) {
+                fprintf(stderr, "[main] ERROR: unknown profile %s\n", argv[i]);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "native") == 0)
+                audioBackend = AUDIO_BACKEND_NATIVE;
+            else if (strcmp(name, "null") == 0)
+                audioBackend = AUDIO_BACKEND_NULL;
+            else if (strncmp(name, "wav:", 4) == 0 && name[4] != '\0') {
+                audioBackend = AUDIO_BACKEND_WAV;
+                wavFilepath = name + 4;
+            }
+            else {
+                fprintf(stderr, "[main] ERROR: unknown audio output %s\n", name);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--timing") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "fixed") == 0)
+                timing = CHIP8_TIMING_FIXED;
+            else if (strcmp(name, "vip") == 0)
+                timing = CHIP8_TIMING_VIP;
+            else {
+                fprintf(stderr, "[main] ERROR: unknown timing model %s\n", name);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--slices") == 0 && i + 1 < argc) {
+            nbOfSlices = atoi(argv[++i]);
+            if (nbOfSlices < 1 || nbOfSlices > MAX_SLICES) {
+                fprintf(stderr, "[main] ERROR: the number of slices must be between 1 and %d\n", MAX_SLICES);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+            runAhead = atoi(argv[++i]);
+            if (runAhead < 0 || runAhead > MAX_RUN_AHEAD) {
+                fprintf(stderr, "[main] ERROR: run-ahead must be between 0 and %d frames\n", MAX_RUN_AHEAD);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--frame-skip") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "auto") == 0 || strcmp(name, "off") == 0)
+                frameSkip = strcmp(name, "auto") == 0;
+            else {
+                fprintf(stderr, "[main] ERROR: unknown frame skip mode %s\n", name);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--phase-stats") == 0 && i + 1 < argc) {
+            phaseStatsInterval = atof(argv[++i]);
+            if (phaseStatsInterval < 0.0) {
+                fprintf(stderr, "[main] ERROR: the phase statistics interval can't be negative\n");
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--trace-timeline") == 0 && i + 1 < argc) {
+            traceFilepath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jit") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "on") == 0 || strcmp(name, "off") == 0)
+                jit = strcmp(name, "on") == 0;
+            else {
+                fprintf(stderr, "[main] ERROR: unknown JIT mode %s\n", name);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < argc) {
+            jitThreshold = atoi(argv[++i]);
+            if (jitThreshold < 1 || jitThreshold > 65535) {
+                fprintf(stderr, "[main] ERROR: the JIT threshold must be between 1 and 65535\n");
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--jit-cache") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "off") == 0)
+                jitCacheDirectory = NULL;
+            else if (strcmp(name, "default") == 0) {
+                jitCacheDirectory = chip8JitDefaultCacheDirectory();
+                if (!jitCacheDirectory) {
+                    fprintf(stderr, "[main] ERROR: --jit-cache default needs a home directory\n");
+                    return 1;
+                }
+            }
+            else
+                jitCacheDirectory = name;
+        }
+        else if (strcmp(argv[i], "--perf-map") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "map") == 0 || strcmp(name, "jitdump") == 0)
+                perfMap = strcmp(name, "map") == 0 ? 1 : 2;
+            else {
+                fprintf(stderr, "[main] ERROR: unknown perf map format %s\n", name);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--overlay") == 0) {
+            showOverlay = true;
+        }
+        else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            if (strcmp(name, "video") == 0)
+                syncMode = SYNC_VIDEO;
+            else if (strcmp(name, "audio") == 0)
+                syncMode = SYNC_AUDIO;
+            else {
+                fprintf(stderr, "[main] ERROR: unknown sync mode %s\n", name);
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (filepath == NULL && argv[i][0] != '-') {
+            filepath = argv[i];
+        }
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (filepath == NULL) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (syncMode == SYNC_AUDIO && audioBackend == AUDIO_BACKEND_WAV) {
+        fprintf(stderr, "[main] ERROR: --sync audio needs a backend consuming samples in real time (native or null)\n");
+        return 1;
+    }
+
+    //before the audio thread starts
+    if (traceFilepath) {
+        traceInit();
+        traceSetThreadName("main (emulation and rendering)");
+    }
+    //before the machines are created, which pick their tiers up
+    if (jit && chip8JitInit(jitThreshold, jitCacheDirectory) != 0)
+        return 1;
+    if (perfMap > 0 && (!chip8JitIsEnabled() || chip8JitPerfInit(perfMap == 2) != 0)) {
+        if (!chip8JitIsEnabled())
+            fprintf(stderr, "[main] ERROR: --perf-map needs the JIT\n");
         return 1;
     }
 
     //graphicsInit should always be before inputInit, because the latter retrieves the GLFW window pointer from the graphics module
     graphicsInit();
     inputInit();
-    chip8Init(argv[1]);
+    if (chip8Init(filepath) != 0)
+        return 1;
+    chip8SetProfile(chip8GetMachine(), (Chip8Profile)profile);
+    if (chip8SetTiming(chip8GetMachine(), timing) != 0)
+        return 1;
+    if (audioInit(audioBackend, wavFilepath) != 0) {
+        if (audioBackend != AUDIO_BACKEND_NATIVE)
+            return 1;
+        fprintf(stderr, "[main] WARNING: no audio device, running without sound\n");
+        audioInit(AUDIO_BACKEND_NULL, NULL);
+    }
+    if (syncMode == SYNC_AUDIO)
+        audioSetRateControl(true, AUDIO_SYNC_BUFFERED_SAMPLES);
+    if (phaseStatsInterval >= 0.0)
+        profilerInit(stdout, phaseStatsInterval);
+    if (phaseStatsInterval >= 0.0 && chip8JitIsEnabled())
+        profilerAddReportSection(chip8JitReport);
+
+    /* run-ahead: every frame, a copy of the machine (a snapshot, sharing its RAM pages) emulates runAhead more frames
+    with the current input and is presented, then thrown away: the game reacts on screen runAhead frames earlier */
+    Chip8State* aheadMachine = NULL;
+    if (runAhead > 0 && (aheadMachine = chip8Fork(chip8GetMachine())) == NULL)
+        return 1;
+    double runAheadTime = 0.0; //total time spent in run-ahead frames, in seconds
+    long runAheadFrames = 0;
+
+    LatencyStatistics latency = {0};
+    uint16_t lastKeypad = 0;
+    double lastPollTime = glfwGetTime();
+    double keypadChangeTime = -1.0; //poll preceding the pending keypad change, -1 if there is none
+
+    FrameSkipStatistics skipping = {0};
+    skipping.lastReportTime = glfwGetTime();
+    double frameDuration = 1.0/TARGET_FPS;
+    double nextFrameTime = glfwGetTime(); //frames start on an absolute schedule, so that late frames are caught up
+
+    overlaySetVisible(showOverlay);
+    OverlayInterval overlayInterval = {glfwGetTime(), chip8GetInstructionCount(chip8GetMachine()), 0.0, 0};
 
     while (!inputShouldClose()) {
 
-        double startTime = glfwGetTime();
+        double startTime = syncMode == SYNC_VIDEO ? nextFrameTime : glfwGetTime();
+        double workStart = glfwGetTime();
+        uint64_t frameStart = monotonicNanoseconds();
 
-        glfwPollEvents();
-        processInput();
+        /* the frame's instructions are split in slices spread evenly over the frame, the last one running just
+        before the present: input is sampled before each slice instead of once per frame */
+        for (int slice = 0; slice < nbOfSlices; slice++) {
+            uint64_t phaseStart = monotonicNanoseconds();
+            if (slice > 0 && syncMode == SYNC_VIDEO) {
+                sleepSeconds(startTime + slice * frameDuration / nbOfSlices - glfwGetTime());
+                profilerRecord(PROFILER_PHASE_SLEEP, phaseStart);
+            }
 
-        if (chip8Update() != 0)
-            return 1;
+            phaseStart = monotonicNanoseconds();
+            glfwPollEvents();
+            profilerRecord(PROFILER_PHASE_POLL_EVENTS, phaseStart);
+            phaseStart = monotonicNanoseconds();
+            uint16_t keypad = processInput();
+            profilerRecord(PROFILER_PHASE_PROCESS_INPUT, phaseStart);
+            if (keypad != lastKeypad && keypadChangeTime < 0.0)
+                keypadChangeTime = lastPollTime;
+            lastKeypad = keypad;
+            lastPollTime = glfwGetTime();
+
+            phaseStart = monotonicNanoseconds();
+            if (chip8UpdateSlice(slice, nbOfSlices) != 0)
+                return 1;
+            profilerRecord(PROFILER_PHASE_EMULATION, phaseStart);
+        }
+        audioGenerateFrame(chip8GetMachine());
+
+        if (chip8DidScreenChange()) {
+            graphicsSetFrameChanged(true);
+            chip8SetScreenChanged(false);
+        }
+
+        /* the host is behind when this frame's instructions end after its deadline (video sync) or when the audio
+        buffer holds less than a frame of samples (audio sync): the present is skipped to catch up */
+        bool behind = syncMode == SYNC_VIDEO
+            ? glfwGetTime() > startTime + frameDuration
+            : audioGetBufferedSamples() < AUDIO_SAMPLE_RATE / 60;
+        bool skipPresent = frameSkip && behind && skipping.consecutive < MAX_CONSECUTIVE_SKIPS;
+
+        const Chip8State* presented = chip8GetMachine();
+        if (aheadMachine && !skipPresent) {
+            double runAheadStart = glfwGetTime();
+            uint64_t phaseStart = monotonicNanoseconds();
+            chip8CopyMachine(aheadMachine, chip8GetMachine());
+            for (int i = 0; i < runAhead; i++)
+                if (chip8RunFrame(aheadMachine) != 0)
+                    break;
+            runAheadTime += glfwGetTime() - runAheadStart;
+            profilerRecord(PROFILER_PHASE_RUN_AHEAD, phaseStart);
+            runAheadFrames += runAhead;
+            presented = aheadMachine;
+            graphicsSetFrameChanged(true); //the screen ahead can change while the main machine's doesn't
+        }
 
-        if (graphicsDidFrameChange()==true) {
-            graphicsUpdate();
+        if (skipPresent) {
+            skipping.skipped++;
+            skipping.skippedSinceReport++;
+            skipping.consecutive++;
+            if (skipping.consecutive > skipping.worstConsecutive)
+                skipping.worstConsecutive = skipping.consecutive;
+        }
+        else if (graphicsDidFrameChange()==true) {
+            skipping.consecutive = 0;
+            graphicsPresent(presented);
             graphicsSetFrameChanged(false);
+            if (keypadChangeTime >= 0.0) {
+                double elapsed = glfwGetTime() - keypadChangeTime;
+                latency.sum += elapsed;
+                latency.worst = elapsed > latency.worst ? elapsed : latency.worst;
+                latency.count++;
+            }
+        }
+        keypadChangeTime = -1.0; //a change that didn't lead to a present is not measured
+
+        double frameCost = glfwGetTime() - workStart;
+        skipping.frameCost += frameCost;
+        skipping.frames++;
+
+        overlayInterval.frameCost += frameCost;
+        overlayInterval.frames++;
+        double overlayElapsed = glfwGetTime() - overlayInterval.lastUpdateTime;
+        if (overlayElapsed >= OVERLAY_UPDATE_INTERVAL) {
+            uint64_t instructionCount = chip8GetInstructionCount(chip8GetMachine());
+            OverlayStats stats = {
+                .instructionsPerSecond = (double)(instructionCount - overlayInterval.lastInstructionCount) / overlayElapsed,
+                .frameTime = overlayInterval.frameCost / overlayInterval.frames,
+                .skippedPresents = skipping.skipped,
+                .speed = overlayInterval.frames / (overlayElapsed * TARGET_FPS)
+            };
+            overlaySetStats(&stats);
+            overlayInterval = (OverlayInterval){glfwGetTime(), instructionCount, 0.0, 0};
+        }
+        if (glfwGetTime() - skipping.lastReportTime >= SKIP_REPORT_INTERVAL) {
+            if (skipping.skippedSinceReport > 0)
+                fprintf(stderr, "[main] WARNING: the host can't keep up, %ld presents skipped in the last %.0f s\n", skipping.skippedSinceReport, SKIP_REPORT_INTERVAL);
+            skipping.skippedSinceReport = 0;
+            skipping.lastReportTime = glfwGetTime();
         }
 
-        double elapsed = glfwGetTime() - startTime;
-        double sleepTime = 1.0/TARGET_FPS - elapsed;
-        if (sleepTime > 0.0)
-            //glfwWaitEventsTimeout(sleepTime);
-            #ifdef _WIN32
-                Sleep(sleepTime * 1000);
-            #elif defined(__linux__)
-                sleep(sleepTime);
-            #endif
+        uint64_t sleepStart = monotonicNanoseconds();
+        if (syncMode == SYNC_AUDIO) {
+            //the next frame starts once the backend has played enough of the buffered samples
+            while (audioGetBufferedSamples() > AUDIO_SYNC_BUFFERED_SAMPLES && !inputShouldClose())
+                sleepSeconds(0.001);
+        }
+        else {
+            nextFrameTime += frameDuration;
+            if (glfwGetTime() > nextFrameTime + MAX_LAG * frameDuration)
+                nextFrameTime = glfwGetTime(); //too late to catch up: emulation slows down instead
+            //glfwWaitEventsTimeout could be used instead, but it would also return on every input event
+            sleepSeconds(nextFrameTime - glfwGetTime());
+        }
+        profilerRecord(PROFILER_PHASE_SLEEP, sleepStart);
+        profilerRecord(PROFILER_PHASE_FRAME, frameStart);
+        profilerFrameEnd();
 
     }
 
+    if (skipping.frames > 0)
+        printf("[main] frame skip: %ld of %ld frames not presented (%.1f%%), at most %d in a row, mean frame cost %.2f ms\n",
+            skipping.skipped, skipping.frames, 100.0 * skipping.skipped / skipping.frames, skipping.worstConsecutive,
+            1000.0 * skipping.frameCost / skipping.frames);
+
+    if (runAheadFrames > 0)
+        printf("[main] run-ahead of %d frame(s): %.1f us of CPU per extra frame (%.2f%% of a frame's time)\n",
+            runAhead, 1e6 * runAheadTime / runAheadFrames, 100.0 * runAheadTime / runAheadFrames * TARGET_FPS);
+    chip8Free(aheadMachine);
+
+    if (latency.count > 0)
+        printf("[main] input-to-present latency over %d keypad changes (%d slice(s) per frame): mean %.1f ms, worst %.1f ms\n",
+            latency.count, nbOfSlices, 1000.0 * latency.sum / latency.count, 1000.0 * latency.worst);
+
+    Chip8CodeWriteStats codeWriteStats;
+    chip8GetCodeWriteStats(chip8GetMachine(), &codeWriteStats);
+    if (codeWriteStats.codeWrites > 0)
+        printf("[main] self-modifying code: %llu writes, to %u of the %u executed 64-byte lines%s\n",
+            (unsigned long long)codeWriteStats.codeWrites, codeWriteStats.modifiedLines, codeWriteStats.executedLines,
+            codeWriteStats.translationDropped ? " (the translated ROM was dropped for the interpreter)" : "");
+
+    profilerReport();
+
+    audioTerminate(); //the audio thread stops recording scopes
+    chip8JitTerminate(); //so does the compiler thread
+    if (traceFilepath)
+        traceWrite(traceFilepath);
     graphicsTerminate();
 
     return 0;
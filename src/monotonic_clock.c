@@ -0,0 +1,31 @@
+//this source file provides the monotonic clock shared by every module that measures time (profiler, audio)
+
+#include <stdint.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+
+#else
+    #include <time.h>
+
+#endif
+
+#include <monotonic_clock.h>
+
+uint64_t monotonicNanoseconds(void) {
+    #ifdef _WIN32
+        static LARGE_INTEGER frequency = {0};
+        if (frequency.QuadPart == 0)
+            QueryPerformanceFrequency(&frequency);
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        //split to avoid overflowing 64 bits with counter * 1e9
+        uint64_t seconds = (uint64_t)(counter.QuadPart / frequency.QuadPart);
+        uint64_t remainder = (uint64_t)(counter.QuadPart % frequency.QuadPart);
+        return seconds * 1000000000ULL + remainder * 1000000000ULL / (uint64_t)frequency.QuadPart;
+    #else
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    #endif
+}
@@ -0,0 +1,173 @@
+/* this source file draws the performance overlay: the 16 glyphs of the CHIP-8 font are packed once in a small
+texture atlas, and the characters on screen are instances of a single quad, so a frame costs one draw call and the
+text is only uploaded again when the numbers change */
+
+#include <glad/glad.h>
+#include <glfw3.h>
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <overlay.h>
+#include <graphics.h>
+#include <shader_manager.h>
+#include <chip8.h>
+
+#define OVERLAY_ROWS 4 //one per field of OverlayStats
+#define OVERLAY_COLUMNS 10 //digits per number, larger values show 9999999999
+#define BLANK_GLYPH 16
+
+#define GLYPH_WIDTH 4
+#define GLYPH_HEIGHT 5
+#define ATLAS_WIDTH (16 * GLYPH_WIDTH)
+
+/* in normalized device coordinates: a font pixel is 1/320 of the window's width and 1/180 of its height (square,
+the window keeps a 16:9 ratio), and a character cell is 5x7 font pixels */
+#define CELL_WIDTH (5 * 2.0f / 320.0f)
+#define CELL_HEIGHT (7 * 2.0f / 180.0f)
+#define MARGIN (2.0f / 160.0f)
+
+//one per character cell, read by the vertex shader as a uvec3 (the last byte is padding)
+typedef struct {
+    uint8_t glyph;
+    uint8_t column;
+    uint8_t row;
+    uint8_t unused;
+} OverlayCharacter;
+
+typedef struct {
+    unsigned int shaderProgram;
+    unsigned int vao;
+    unsigned int cornerVbo;
+    unsigned int characterVbo; //instances
+    unsigned int atlas;
+} OverlayGlState;
+static OverlayGlState overlayState;
+
+static bool visible = false;
+static OverlayCharacter characters[OVERLAY_ROWS * OVERLAY_COLUMNS];
+
+
+int overlayInit() {
+
+    //atlas: one byte per font pixel (255: lit), glyph g at x = 4*g
+    uint8_t atlasPixels[GLYPH_HEIGHT][ATLAS_WIDTH];
+    for (int glyph = 0; glyph < 16; glyph++)
+        for (int y = 0; y < GLYPH_HEIGHT; y++)
+            for (int x = 0; x < GLYPH_WIDTH; x++)
+                atlasPixels[y][glyph * GLYPH_WIDTH + x] = (fontData[glyph * GLYPH_HEIGHT + y] >> (7 - x)) & 1 ? 255 : 0;
+
+    //the atlas lives on texture unit 1, so that the screen texture stays bound to unit 0
+    glGenTextures(1, &overlayState.atlas);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, overlayState.atlas);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, ATLAS_WIDTH, GLYPH_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, atlasPixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glActiveTexture(GL_TEXTURE0);
+
+    //a unit quad (triangle strip), placed and scaled per instance by the vertex shader
+    const float corners[] = {
+        0.0f, 0.0f,
+        1.0f, 0.0f,
+        0.0f, 1.0f,
+        1.0f, 1.0f
+    };
+
+    glGenVertexArrays(1, &overlayState.vao);
+    glBindVertexArray(overlayState.vao);
+
+    glGenBuffers(1, &overlayState.cornerVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, overlayState.cornerVbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2*sizeof(float), (const void*)0);
+    glEnableVertexAttribArray(0);
+
+    for (int i = 0; i < OVERLAY_ROWS * OVERLAY_COLUMNS; i++)
+        characters[i] = (OverlayCharacter){BLANK_GLYPH, (uint8_t)(i % OVERLAY_COLUMNS), (uint8_t)(i / OVERLAY_COLUMNS), 0};
+    glGenBuffers(1, &overlayState.characterVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, overlayState.characterVbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(characters), characters, GL_DYNAMIC_DRAW);
+    glVertexAttribIPointer(1, 3, GL_UNSIGNED_BYTE, sizeof(OverlayCharacter), (const void*)0);
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(1);
+
+    overlayState.shaderProgram = getOverlayShaderProgram();
+    glUseProgram(overlayState.shaderProgram);
+    glUniform1i(glGetUniformLocation(overlayState.shaderProgram, "font"), 1);
+    glUniform2f(glGetUniformLocation(overlayState.shaderProgram, "origin"), -1.0f + MARGIN, 1.0f - MARGIN);
+    glUniform2f(glGetUniformLocation(overlayState.shaderProgram, "cellSize"), CELL_WIDTH, CELL_HEIGHT);
+
+    if (glGetError() != GL_NO_ERROR) {
+        fprintf(stderr, "[overlay] ERROR: could not create the overlay's OpenGL objects\n");
+        return -1;
+    }
+    return 0;
+}
+
+void overlaySetVisible(bool newValue) {
+    visible = newValue;
+    graphicsSetFrameChanged(true);
+}
+
+bool overlayIsVisible() {
+    return visible;
+}
+
+void overlayToggle() {
+    overlaySetVisible(!visible);
+}
+
+//writes value right-aligned in row, in decimal
+static void setRow(int row, double value) {
+    uint64_t number = value <= 0.0 ? 0 : value >= 9999999999.0 ? 9999999999ULL : (uint64_t)(value + 0.5);
+    OverlayCharacter* characterRow = &characters[row * OVERLAY_COLUMNS];
+    for (int column = OVERLAY_COLUMNS - 1; column >= 0; column--) {
+        bool leadingZero = number == 0 && column < OVERLAY_COLUMNS - 1;
+        characterRow[column].glyph = leadingZero ? BLANK_GLYPH : (uint8_t)(number % 10);
+        number /= 10;
+    }
+}
+
+void overlaySetStats(const OverlayStats* stats) {
+    OverlayCharacter previous[OVERLAY_ROWS * OVERLAY_COLUMNS];
+    memcpy(previous, characters, sizeof(characters));
+
+    setRow(0, stats->instructionsPerSecond);
+    setRow(1, stats->frameTime * 1e6); //in microseconds
+    setRow(2, (double)stats->skippedPresents);
+    setRow(3, stats->speed * 100.0); //in percent
+
+    if (memcmp(previous, characters, sizeof(characters)) != 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, overlayState.characterVbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(characters), characters);
+        if (visible)
+            graphicsSetFrameChanged(true);
+    }
+}
+
+void overlayDraw() {
+    if (!visible)
+        return;
+
+    glBindVertexArray(overlayState.vao);
+    glUseProgram(overlayState.shaderProgram);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, OVERLAY_ROWS * OVERLAY_COLUMNS);
+    glDisable(GL_BLEND);
+}
+
+void overlayTerminate() {
+    glDeleteVertexArrays(1, &overlayState.vao);
+    glDeleteBuffers(1, &overlayState.cornerVbo);
+    glDeleteBuffers(1, &overlayState.characterVbo);
+    glDeleteTextures(1, &overlayState.atlas);
+    glDeleteProgram(overlayState.shaderProgram);
+}
@@ -0,0 +1,135 @@
+/* this source file measures where frame time goes: the main loop and the graphics module time their phases with
+the monotonic clock, and every duration is counted in a fixed-bucket HDR (high dynamic range) histogram per phase */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <profiler.h>
+#include <monotonic_clock.h>
+#include <trace.h>
+
+/* log-linear buckets: values below 2^SUB_BUCKET_BITS nanoseconds have one bucket each, then every power of 2 is split
+in 2^SUB_BUCKET_BITS buckets, so a value is known within 1/16 (6%) from 1 ns to centuries, in a fixed-size array
+where recording is a count-leading-zeros and an increment */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+#define BUCKET_COUNT ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT)
+#define MAX_REPORT_SECTIONS 4
+
+typedef struct {
+    uint64_t count;
+    uint64_t max; //exact, in nanoseconds
+    uint32_t buckets[BUCKET_COUNT];
+} Histogram;
+
+static const char* const phaseNames[PROFILER_PHASE_COUNT] = {
+    [PROFILER_PHASE_POLL_EVENTS] = "poll events",
+    [PROFILER_PHASE_PROCESS_INPUT] = "process input",
+    [PROFILER_PHASE_EMULATION] = "emulation",
+    [PROFILER_PHASE_RUN_AHEAD] = "run-ahead",
+    [PROFILER_PHASE_TEXTURE_UPLOAD] = "texture upload",
+    [PROFILER_PHASE_DRAW] = "draw",
+    [PROFILER_PHASE_SWAP_BUFFERS] = "swap buffers",
+    [PROFILER_PHASE_SLEEP] = "sleep",
+    [PROFILER_PHASE_FRAME] = "whole frame"
+};
+
+static Histogram histograms[PROFILER_PHASE_COUNT];
+static bool enabled = false;
+static FILE* output = NULL;
+static uint64_t dumpInterval = 0; //in nanoseconds, 0: no periodic report
+static uint64_t lastDumpTime = 0;
+static void (*reportSections[MAX_REPORT_SECTIONS])(FILE*);
+static int reportSectionCount = 0;
+
+
+static int bucketIndex(uint64_t value) {
+    if (value < SUB_BUCKET_COUNT)
+        return (int)value;
+    int magnitude = 63 - __builtin_clzll(value); //>= SUB_BUCKET_BITS
+    int subBucket = (int)(value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1);
+    return (magnitude - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT + subBucket;
+}
+
+//highest value counted in a bucket
+static uint64_t bucketValue(int index) {
+    if (index < SUB_BUCKET_COUNT)
+        return (uint64_t)index;
+    int shift = index / SUB_BUCKET_COUNT - 1;
+    uint64_t lowest = (uint64_t)(SUB_BUCKET_COUNT + index % SUB_BUCKET_COUNT) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+static uint64_t percentile(const Histogram* histogram, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->count);
+    if (rank >= histogram->count)
+        rank = histogram->count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+            return bucketValue(i) < histogram->max ? bucketValue(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+void profilerInit(FILE* fp, double interval) {
+    memset(histograms, 0, sizeof(histograms));
+    output = fp;
+    dumpInterval = (uint64_t)(interval * 1e9);
+    lastDumpTime = monotonicNanoseconds();
+    enabled = true;
+}
+
+bool profilerIsEnabled(void) {
+    return enabled;
+}
+
+void profilerRecord(ProfilerPhase phase, uint64_t start) {
+    traceRecord(phaseNames[phase], start); //the phases are also scopes of the timeline
+    if (!enabled)
+        return;
+    uint64_t duration = monotonicNanoseconds() - start;
+    Histogram* histogram = &histograms[phase];
+    histogram->buckets[bucketIndex(duration)]++;
+    histogram->count++;
+    if (duration > histogram->max)
+        histogram->max = duration;
+}
+
+void profilerFrameEnd(void) {
+    if (!enabled || dumpInterval == 0)
+        return;
+    uint64_t now = monotonicNanoseconds();
+    if (now - lastDumpTime >= dumpInterval) {
+        profilerReport();
+        lastDumpTime = now;
+    }
+}
+
+//the histograms are cumulative: a periodic report covers the whole session so far
+void profilerReport(void) {
+    if (!enabled)
+        return;
+    fprintf(output, "[profiler] %-15s %10s %12s %12s %12s\n", "phase", "count", "p50 (us)", "p99 (us)", "max (us)");
+    for (int phase = 0; phase < PROFILER_PHASE_COUNT; phase++) {
+        const Histogram* histogram = &histograms[phase];
+        if (histogram->count == 0)
+            continue;
+        fprintf(output, "[profiler] %-15s %10llu %12.1f %12.1f %12.1f\n", phaseNames[phase], (unsigned long long)histogram->count,
+            percentile(histogram, 0.50) / 1e3, percentile(histogram, 0.99) / 1e3, histogram->max / 1e3);
+    }
+    for (int i = 0; i < reportSectionCount; i++)
+        reportSections[i](output);
+    fflush(output);
+}
+
+void profilerAddReportSection(void (*report)(FILE* fp)) {
+    if (reportSectionCount == MAX_REPORT_SECTIONS) {
+        fprintf(stderr, "[profiler] WARNING: too many report sections, one is ignored\n");
+        return;
+    }
+    reportSections[reportSectionCount++] = report;
+}
@@ -0,0 +1,156 @@
+/* this source file keeps one immutable image per distinct ROM loaded by the process, keyed by a hash of its content:
+a batch of machines running the same ROM reads the file once, shares its RAM pages (copied per machine only when written)
+and shares its predecoded instructions */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+
+#elif defined(__linux__)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+
+#endif
+
+#include <chip8_internal.h>
+#include <chip8_analysis.h>
+
+#define MAX_ROM_SIZE (XOCHIP_MEMORY_SIZE - STARTING_MEMORY_ADDRESS) //CHIP-8 and SUPER-CHIP machines only see the first 4 KB
+
+//registered images; the registry is not thread-safe, ROMs should be loaded before machines are spread over threads
+static Chip8Rom* registry = NULL;
+
+static uint64_t hashBytes(const uint8_t* bytes, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL; //FNV-1a
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static Chip8Rom* createRom(const uint8_t* bytes, size_t size, uint64_t hash) {
+    //the image is paged and decoded up to the end of the program (at least the 4 KB of a CHIP-8 machine)
+    size_t imageSize = STARTING_MEMORY_ADDRESS + size;
+    imageSize = (imageSize + CHIP8_PAGE_SIZE - 1) & ~(size_t)(CHIP8_PAGE_SIZE - 1);
+    if (imageSize < CHIP8_MEMORY_SIZE)
+        imageSize = CHIP8_MEMORY_SIZE;
+
+    Chip8Rom* rom = malloc(sizeof(Chip8Rom));
+    uint8_t* data = malloc(size ? size : 1);
+    uint8_t* image = calloc(imageSize, 1);
+    Chip8Instruction* decoded = malloc(imageSize * sizeof(Chip8Instruction));
+    if (!rom || !data || !image || !decoded) {
+        fprintf(stderr, "[rom_registry] ERROR: failed to allocate ROM image\n");
+        free(rom);
+        free(data);
+        free(image);
+        free(decoded);
+        return NULL;
+    }
+    memcpy(data, bytes, size);
+    rom->hash = hash;
+    rom->size = size;
+    rom->data = data;
+
+    memcpy(image + FONT_DATA_POSITION, fontData, sizeof(fontData));
+    memcpy(image + BIG_FONT_DATA_POSITION, bigFontData, sizeof(bigFontData));
+    memcpy(image + STARTING_MEMORY_ADDRESS, bytes, size);
+    int imagePageCount = (int)(imageSize / CHIP8_PAGE_SIZE);
+    for (int i = 0; i < imagePageCount; i++) {
+        rom->pages[i] = chip8AllocatePage();
+        memcpy(rom->pages[i]->bytes, image + i * CHIP8_PAGE_SIZE, CHIP8_PAGE_SIZE);
+    }
+    if (imagePageCount < XOCHIP_PAGE_COUNT) {
+        Chip8Page* zeroPage = chip8AllocatePage();
+        memset(zeroPage->bytes, 0, CHIP8_PAGE_SIZE);
+        atomic_store(&zeroPage->refCount, (unsigned)(XOCHIP_PAGE_COUNT - imagePageCount));
+        for (int i = imagePageCount; i < XOCHIP_PAGE_COUNT; i++)
+            rom->pages[i] = zeroPage;
+    }
+
+    //the last address is never fetched from this table (its second byte depends on the machine's memory size)
+    for (size_t address = 0; address < imageSize; address++)
+        decoded[address] = chip8DecodeInstruction(image[address], address + 1 < imageSize ? image[address + 1] : 0);
+    rom->decoded = decoded;
+    rom->decodedSize = (uint32_t)imageSize;
+    free(image);
+
+    //found once per image, the counted loops are run in closed form by every machine (while their code is unchanged)
+    rom->loops = chip8FindCountedLoops(decoded, (uint32_t)imageSize, &rom->loopCount);
+    rom->loopHeads = calloc((imageSize + 63) / 64, sizeof(uint64_t));
+    if (!rom->loopHeads) {
+        static uint64_t noLoopHeads[XOCHIP_MEMORY_SIZE / 64];
+        rom->loopHeads = noLoopHeads; //the loops are interpreted
+        rom->loopCount = 0;
+    }
+    for (uint32_t i = 0; i < rom->loopCount; i++)
+        rom->loopHeads[rom->loops[i].head >> 6] |= (uint64_t)1 << (rom->loops[i].head & 63);
+
+    rom->next = registry;
+    registry = rom;
+    return rom;
+}
+
+//returns the registered image with this content, registering it first if needed
+static const Chip8Rom* registerRom(const uint8_t* bytes, size_t size) {
+    if (size > MAX_ROM_SIZE) {
+        fprintf(stderr, "[rom_registry] WARNING: ROM size too big for memory\n");
+        size = MAX_ROM_SIZE;
+    }
+    uint64_t hash = hashBytes(bytes, size);
+    for (Chip8Rom* rom = registry; rom != NULL; rom = rom->next)
+        if (rom->hash == hash && rom->size == size && memcmp(rom->data, bytes, size) == 0)
+            return rom;
+    return createRom(bytes, size, hash);
+}
+
+const Chip8Rom* chip8LoadRom(const char* filepath) {
+
+    #ifdef __linux__
+        int fd = open(filepath, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "[rom_registry] ERROR: could not open specified file\n");
+            return NULL;
+        }
+        struct stat fileInfo;
+        if (fstat(fd, &fileInfo) != 0) {
+            fprintf(stderr, "[rom_registry] ERROR: could not read the size of the specified file\n");
+            close(fd);
+            return NULL;
+        }
+        size_t size = (size_t)fileInfo.st_size;
+        if (size == 0) {
+            close(fd);
+            return registerRom((const uint8_t*)"", 0);
+        }
+        const uint8_t* bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (bytes == MAP_FAILED) {
+            fprintf(stderr, "[rom_registry] ERROR: could not map the specified file\n");
+            return NULL;
+        }
+        const Chip8Rom* rom = registerRom(bytes, size);
+        munmap((void*)bytes, size);
+        return rom;
+
+    #else
+        FILE* fp = fopen(filepath, "rb");
+        if (!fp) {
+            fprintf(stderr, "[rom_registry] ERROR: could not open specified file\n");
+            return NULL;
+        }
+        static uint8_t bytes[MAX_ROM_SIZE + 1]; //one extra byte to detect ROMs that are too big
+        size_t size = fread(bytes, 1, sizeof(bytes), fp);
+        fclose(fp);
+        return registerRom(bytes, size);
+
+    #endif
+}
@@ -11,13 +11,57 @@ static const char* vertexShaderSource =
     "   texCoord=aTexCoord;\n"
     "}";
 
+/* the screen texture holds the display planes bit-packed as by the chip8 module: 64-bit words split in two
+32-bit texels (low half first, as laid out in memory on little-endian hosts), CHIP8_HIRES_DISPLAY_HEIGHT (64)
+texel rows per plane. A pixel's plane bits index the palette */
 static const char* fragmentShaderSource =
     "#version 330 core\n"
     "in vec2 texCoord;\n"
     "out vec4 fragColor;\n"
-    "uniform sampler2D tex;\n"
+    "uniform usampler2D screen;\n"
+    "uniform ivec2 resolution;\n"
+    "uniform int planeCount;\n"
+    "uniform vec4 palette[16];\n"
     "void main() {\n"
-    "   fragColor = texture(tex, texCoord);\n"
+    "   ivec2 pixel = min(ivec2(texCoord * vec2(resolution)), resolution - 1);\n"
+    "   int bit = 63 - pixel.x % 64;\n"
+    "   int column = (pixel.x / 64) * 2 + bit / 32;\n"
+    "   int index = 0;\n"
+    "   for (int p = 0; p < planeCount; p++) {\n"
+    "       uint word = texelFetch(screen, ivec2(column, p * 64 + pixel.y), 0).r;\n"
+    "       index |= int((word >> uint(bit % 32)) & 1u) << p;\n"
+    "   }\n"
+    "   fragColor = palette[index];\n"
+    "}";
+
+/* performance overlay: one instance per character, drawn as a cell of 5x7 font pixels (a 4x5 glyph and its spacing,
+on a translucent background) placed from the character's column and row; the font atlas holds the 16 glyphs side
+by side, texel (4*glyph + x, y) being pixel (x, y) of the glyph (glyph 16 is a blank) */
+static const char* overlayVertexShaderSource =
+    "#version 330 core\n"
+    "layout (location = 0) in vec2 aCorner;\n"
+    "layout (location = 1) in uvec3 aCharacter;\n" //glyph, column, row
+    "uniform vec2 origin;\n"
+    "uniform vec2 cellSize;\n"
+    "out vec2 cellCoord;\n"
+    "flat out uint glyph;\n"
+    "void main() {\n"
+    "   vec2 position = origin + vec2(float(aCharacter.y) + aCorner.x, -(float(aCharacter.z) + aCorner.y)) * cellSize;\n"
+    "   gl_Position = vec4(position, 0.0f, 1.0f);\n"
+    "   cellCoord = aCorner * vec2(5.0f, 7.0f);\n"
+    "   glyph = aCharacter.x;\n"
+    "}";
+
+static const char* overlayFragmentShaderSource =
+    "#version 330 core\n"
+    "in vec2 cellCoord;\n"
+    "flat in uint glyph;\n"
+    "out vec4 fragColor;\n"
+    "uniform sampler2D font;\n"
+    "void main() {\n"
+    "   ivec2 pixel = ivec2(cellCoord);\n"
+    "   bool lit = glyph < 16u && pixel.x < 4 && pixel.y < 5 && texelFetch(font, ivec2(int(glyph) * 4 + pixel.x, pixel.y), 0).r > 0.5f;\n"
+    "   fragColor = lit ? vec4(1.0f, 0.85f, 0.0f, 1.0f) : vec4(0.0f, 0.0f, 0.0f, 0.6f);\n"
     "}";
 
 static unsigned int compileShader(unsigned int type, const char* source) {
@@ -47,4 +91,8 @@ static unsigned int createShaderProgram(const char* vertexShaderSource, const ch
 
 unsigned int getShaderProgram() {
     return createShaderProgram(vertexShaderSource, fragmentShaderSource);
+}
+
+unsigned int getOverlayShaderProgram() {
+    return createShaderProgram(overlayVertexShaderSource, overlayFragmentShaderSource);
 }
\ No newline at end of file
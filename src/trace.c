@@ -0,0 +1,126 @@
+/* this source file records the timeline of the emulator: each thread appends the scopes it measures to a buffer
+that only it writes, so recording takes no lock; the buffers are chained in a list when a thread records its
+first scope, and traceWrite turns them into Chrome trace-event JSON */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <trace.h>
+#include <monotonic_clock.h>
+
+#define TRACE_BUFFER_EVENTS (1 << 20) //per thread (24 MB): about 20 minutes of frames at 60 Hz, a dozen scopes each
+
+typedef struct {
+    const char* name;
+    uint64_t start; //in nanoseconds, monotonicNanoseconds value
+    uint64_t duration;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer* next;
+    int threadId;
+    const char* threadName;
+    atomic_size_t count; //published with release ordering, so traceWrite sees complete events
+    size_t dropped; //scopes recorded while the buffer was full
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+static bool enabled = false;
+static uint64_t originTime = 0; //timestamps in the file are relative to traceInit
+static _Atomic(TraceBuffer*) buffers = NULL;
+static atomic_int nextThreadId = 1;
+static _Thread_local TraceBuffer* threadBuffer = NULL;
+
+
+//the calling thread's buffer, allocated and chained on first use; NULL if the allocation failed
+static TraceBuffer* getThreadBuffer(void) {
+    if (threadBuffer)
+        return threadBuffer;
+    TraceBuffer* buffer = malloc(sizeof(TraceBuffer));
+    if (!buffer)
+        return NULL;
+    buffer->threadId = atomic_fetch_add(&nextThreadId, 1);
+    buffer->threadName = NULL;
+    atomic_init(&buffer->count, 0);
+    buffer->dropped = 0;
+    buffer->next = atomic_load(&buffers);
+    while (!atomic_compare_exchange_weak(&buffers, &buffer->next, buffer))
+        ;
+    threadBuffer = buffer;
+    return buffer;
+}
+
+void traceInit(void) {
+    originTime = monotonicNanoseconds();
+    enabled = true;
+}
+
+bool traceIsEnabled(void) {
+    return enabled;
+}
+
+void traceSetThreadName(const char* name) {
+    if (!enabled)
+        return;
+    TraceBuffer* buffer = getThreadBuffer();
+    if (buffer)
+        buffer->threadName = name;
+}
+
+void traceRecord(const char* name, uint64_t start) {
+    if (!enabled)
+        return;
+    uint64_t end = monotonicNanoseconds();
+    TraceBuffer* buffer = getThreadBuffer();
+    if (!buffer)
+        return;
+    size_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    if (count == TRACE_BUFFER_EVENTS) {
+        buffer->dropped++;
+        return;
+    }
+    buffer->events[count] = (TraceEvent){name, start, end - start};
+    atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+int traceWrite(const char* filepath) {
+    if (!enabled)
+        return 0;
+    FILE* fp = fopen(filepath, "w");
+    if (!fp) {
+        fprintf(stderr, "[trace] ERROR: could not create %s\n", filepath);
+        return 1;
+    }
+
+    //complete ("X") events, timestamps and durations in microseconds
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"chip8\"}}");
+    size_t total = 0, dropped = 0;
+    for (TraceBuffer* buffer = atomic_load(&buffers); buffer; buffer = buffer->next) {
+        if (buffer->threadName)
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                buffer->threadId, buffer->threadName);
+        size_t count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            const TraceEvent* event = &buffer->events[i];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                event->name, buffer->threadId, (double)(int64_t)(event->start - originTime) / 1e3, (double)event->duration / 1e3);
+        }
+        total += count;
+        dropped += buffer->dropped;
+    }
+    fprintf(fp, "\n]}\n");
+
+    bool failed = ferror(fp) != 0;
+    if (fclose(fp) != 0 || failed) {
+        fprintf(stderr, "[trace] ERROR: could not write %s\n", filepath);
+        return 1;
+    }
+    if (dropped > 0)
+        fprintf(stderr, "[trace] WARNING: %zu scopes not recorded, the per-thread buffer (%d events) was full\n", dropped, TRACE_BUFFER_EVENTS);
+    printf("[trace] %zu scopes written to %s\n", total, filepath);
+    return 0;
+}
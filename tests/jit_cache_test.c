@@ -0,0 +1,80 @@
+/* checks of the JIT cache's validation of damaged files (chip8_jit_cache.c is included to reach its file layout):
+a cache file truncated after the header and one entry whose code would lie past its end must be rejected without
+reading out of the mapping (the page after it is made inaccessible, so an out-of-bounds read crashes the test).
+
+    make test */
+
+#include "../src/chip8_jit_cache.c"
+
+#if CHIP8_JIT_SUPPORTED
+
+static int failures = 0;
+
+static void check(bool condition, const char* description) {
+    printf("[jit_cache_test] %s: %s\n", condition ? "ok" : "FAILED", description);
+    if (!condition)
+        failures++;
+}
+
+//writes a ROM of a single block (LD V0, 0x01 then JP 0x202) and loads it
+static const Chip8Rom* loadTestRom(void) {
+    char filepath[] = "/tmp/chip8_jit_cache_test_XXXXXX";
+    int fd = mkstemp(filepath);
+    if (fd < 0)
+        return NULL;
+    const uint8_t program[] = {0x60, 0x01, 0x12, 0x02};
+    bool written = write(fd, program, sizeof(program)) == (ssize_t)sizeof(program);
+    close(fd);
+    const Chip8Rom* rom = written ? chip8LoadRom(filepath) : NULL;
+    remove(filepath);
+    return rom;
+}
+
+static void testTruncatedFile(const Chip8Rom* rom) {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t* pages = mmap(NULL, 2 * pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED || mprotect(pages + pageSize, pageSize, PROT_NONE) != 0) {
+        check(false, "map a file followed by a guard page");
+        return;
+    }
+    //the file ends right before the guard page: the header and one entry, without any code
+    size_t fileSize = sizeof(CacheHeader) + sizeof(CacheEntry);
+    uint8_t* file = pages + pageSize - fileSize;
+    CacheHeader header = {.version = CHIP8_JIT_CODE_VERSION, .stateLayout = CHIP8_JIT_STATE_LAYOUT,
+        .romHash = rom->hash, .profile = CHIP8_PROFILE_DEFAULT, .blockCount = 1};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    CacheEntry entry = {.start = 0x200, .end = 0x204, .checkedEnd = 0x204, .instructionCount = 2,
+        .codeOffset = (uint32_t)sizeof(CacheHeader), .codeSize = CHIP8_JIT_MAX_CODE_SIZE,
+        .sourceHash = hashGuestBytes(rom, 0x200, 0x204)};
+    memcpy(file, &header, sizeof(header));
+    memcpy(file + sizeof(header), &entry, sizeof(entry));
+
+    Chip8Jit jit = {.rom = rom, .profile = CHIP8_PROFILE_DEFAULT, .memorySize = CHIP8_MEMORY_SIZE,
+        .cacheFile = file, .cacheFileSize = fileSize};
+    check(chip8JitCacheLookup(&jit, 0x200) == NULL, "code past the end of a truncated file is rejected");
+
+    entry.codeOffset = UINT32_MAX;
+    entry.codeSize = 1;
+    memcpy(file + sizeof(header), &entry, sizeof(entry));
+    check(chip8JitCacheLookup(&jit, 0x200) == NULL, "code starting past the end of the file is rejected");
+    munmap(pages, 2 * pageSize);
+}
+
+int main(void) {
+    const Chip8Rom* rom = loadTestRom();
+    if (!rom) {
+        fprintf(stderr, "[jit_cache_test] ERROR: could not load the test ROM\n");
+        return 1;
+    }
+    testTruncatedFile(rom);
+    return failures == 0 ? 0 : 1;
+}
+
+#else
+
+int main(void) {
+    printf("[jit_cache_test] skipped: the JIT cache needs the native code generator (x86-64 Linux)\n");
+    return 0;
+}
+
+#endif
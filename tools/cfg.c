@@ -0,0 +1,510 @@
+/* control-flow graph of a CHIP-8 ROM: the basic blocks of the code reachable from 0x200 (chip8_analysis.c), the
+edges between them (jumps, calls and their return sites, both sides of every skip, BNNN jump tables), the
+functions (0x200 and every 2NNN target) and their call graph, the skip "diamonds" (a skip over a single
+instruction that both paths join after), and the bytes of the program that are never reached as code (data).
+The block of an instruction holds the static instruction count used to weigh it.
+
+    chip8_cfg.out [--profile default|vip|schip|xochip] [--format dot|calls|json] <rom> [output]
+
+dot (the default) and calls are Graphviz graphs (the blocks, the call graph), json holds everything; the output
+goes to stdout unless a file is given */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <chip8.h>
+#include <chip8_internal.h>
+#include <chip8_analysis.h>
+
+typedef enum {
+    FORMAT_DOT,
+    FORMAT_CALLS,
+    FORMAT_JSON
+} OutputFormat;
+
+typedef enum {
+    EDGE_NEXT, //into a leader from the instruction before it
+    EDGE_JUMP,
+    EDGE_CALL,
+    EDGE_RETURN_SITE, //from a call to the instruction after it, once the callee returns
+    EDGE_NO_SKIP,
+    EDGE_SKIP,
+    EDGE_TABLE //from a BNNN to an entry of its jump table
+} EdgeKind;
+
+static const char* const edgeKindNames[] = {
+    [EDGE_NEXT] = "next",
+    [EDGE_JUMP] = "jump",
+    [EDGE_CALL] = "call",
+    [EDGE_RETURN_SITE] = "return-site",
+    [EDGE_NO_SKIP] = "no-skip",
+    [EDGE_SKIP] = "skip",
+    [EDGE_TABLE] = "table"
+};
+
+static const char* const edgeKindStyles[] = {
+    [EDGE_NEXT] = "",
+    [EDGE_JUMP] = "",
+    [EDGE_CALL] = " color=blue",
+    [EDGE_RETURN_SITE] = " style=dashed",
+    [EDGE_NO_SKIP] = " color=darkgreen",
+    [EDGE_SKIP] = " color=red",
+    [EDGE_TABLE] = " color=purple"
+};
+
+typedef struct {
+    uint32_t from; //index of the block
+    uint16_t to; //target address (not always a block of the program: jumps may leave it)
+    uint8_t kind; //EdgeKind
+} Edge;
+
+typedef struct {
+    uint16_t entry;
+    uint32_t blockCount; //blocks reachable from the entry without entering callees
+    uint32_t instructionCount; //static instruction count of those blocks
+    uint16_t* callees;
+    uint32_t calleeCount;
+} Function;
+
+typedef struct {
+    uint16_t skip;
+    uint16_t conditional; //the instruction run only when the skip does not happen
+    uint16_t join;
+} Diamond;
+
+typedef struct {
+    const Chip8CodeAnalysis* analysis;
+    Edge* edges;
+    uint32_t edgeCount;
+    Function* functions;
+    uint32_t functionCount;
+    Diamond* diamonds;
+    uint32_t diamondCount;
+    uint8_t* referenced; //referenced[a]: a LD I, NNN of the code points to address a
+} Cfg;
+
+
+static int blockIndex(const Cfg* cfg, uint16_t address) {
+    const Chip8BasicBlock* block = chip8FindBasicBlock(cfg->analysis, address);
+    return block ? (int)(block - cfg->analysis->blocks) : -1;
+}
+
+static Chip8InstructionInfo analyzeInstruction(const Cfg* cfg, uint16_t address) {
+    return chip8AnalyzeInstruction(cfg->analysis->rom, cfg->analysis->profile, address);
+}
+
+static void addEdge(Cfg* cfg, uint32_t from, uint16_t to, EdgeKind kind) {
+    cfg->edges[cfg->edgeCount++] = (Edge){from, to, (uint8_t)kind};
+}
+
+//edges leaving each block, in block order (a block has 2 edges, or a jump table's)
+static int findEdges(Cfg* cfg) {
+    const Chip8CodeAnalysis* analysis = cfg->analysis;
+    uint32_t capacity = 0;
+    for (uint32_t b = 0; b < analysis->blockCount; b++) {
+        Chip8InstructionInfo last = analyzeInstruction(cfg, analysis->blocks[b].last);
+        capacity += last.flow == CHIP8_FLOW_INDIRECT ? chip8JumpTableLength(analysis, last.instruction.nnn) : CHIP8_MAX_SUCCESSORS;
+    }
+    cfg->edges = malloc((capacity ? capacity : 1) * sizeof(Edge));
+    if (!cfg->edges)
+        return 1;
+
+    for (uint32_t b = 0; b < analysis->blockCount; b++) {
+        Chip8InstructionInfo last = analyzeInstruction(cfg, analysis->blocks[b].last);
+        switch (last.flow) {
+            case CHIP8_FLOW_NEXT:
+                if (last.successors[0] == analysis->blocks[b].end && blockIndex(cfg, last.successors[0]) >= 0)
+                    addEdge(cfg, b, last.successors[0], EDGE_NEXT);
+                break;
+            case CHIP8_FLOW_JUMP:
+                addEdge(cfg, b, last.successors[0], EDGE_JUMP);
+                break;
+            case CHIP8_FLOW_CALL:
+                addEdge(cfg, b, last.successors[0], EDGE_CALL);
+                addEdge(cfg, b, last.successors[1], EDGE_RETURN_SITE);
+                break;
+            case CHIP8_FLOW_SKIP:
+                addEdge(cfg, b, last.successors[0], EDGE_NO_SKIP);
+                addEdge(cfg, b, last.successors[1], EDGE_SKIP);
+                break;
+            case CHIP8_FLOW_INDIRECT: {
+                uint32_t entryCount = chip8JumpTableLength(analysis, last.instruction.nnn);
+                for (uint32_t i = 0; i < entryCount; i++)
+                    addEdge(cfg, b, (uint16_t)(last.instruction.nnn + 2 * i), EDGE_TABLE);
+                break;
+            }
+            default: //00EE, 00FD
+                break;
+        }
+    }
+    return 0;
+}
+
+//the blocks of the function at entry are the ones reached without following calls (a return ends a path)
+static int findFunction(Cfg* cfg, Function* function, uint32_t* stack, uint8_t* visited) {
+    const Chip8CodeAnalysis* analysis = cfg->analysis;
+    memset(visited, 0, analysis->blockCount);
+    function->blockCount = 0;
+    function->instructionCount = 0;
+    function->calleeCount = 0;
+    function->callees = NULL;
+
+    int entry = blockIndex(cfg, function->entry);
+    if (entry < 0)
+        return 0;
+    uint32_t stackSize = 0;
+    stack[stackSize++] = (uint32_t)entry;
+    visited[entry] = 1;
+
+    //edges are sorted by block: the first edge of each block is found by binary search
+    while (stackSize > 0) {
+        uint32_t b = stack[--stackSize];
+        function->blockCount++;
+        function->instructionCount += analysis->blocks[b].instructionCount;
+
+        uint32_t low = 0;
+        uint32_t high = cfg->edgeCount;
+        while (low < high) {
+            uint32_t middle = (low + high) / 2;
+            if (cfg->edges[middle].from < b)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        for (uint32_t e = low; e < cfg->edgeCount && cfg->edges[e].from == b; e++) {
+            const Edge* edge = &cfg->edges[e];
+            if (edge->kind == EDGE_CALL) {
+                bool known = false;
+                for (uint32_t c = 0; c < function->calleeCount; c++)
+                    known |= function->callees[c] == edge->to;
+                if (!known) {
+                    uint16_t* callees = realloc(function->callees, (function->calleeCount + 1) * sizeof(uint16_t));
+                    if (!callees)
+                        return 1;
+                    function->callees = callees;
+                    function->callees[function->calleeCount++] = edge->to;
+                }
+                continue;
+            }
+            int target = blockIndex(cfg, edge->to);
+            if (target >= 0 && !visited[target]) {
+                visited[target] = 1;
+                stack[stackSize++] = (uint32_t)target;
+            }
+        }
+    }
+    return 0;
+}
+
+static int findFunctions(Cfg* cfg) {
+    const Chip8CodeAnalysis* analysis = cfg->analysis;
+    cfg->functionCount = 0;
+    cfg->functions = malloc((analysis->blockCount + 1) * sizeof(Function));
+    uint32_t* stack = malloc((analysis->blockCount + 1) * sizeof(uint32_t));
+    uint8_t* visited = malloc(analysis->blockCount + 1);
+    if (!cfg->functions || !stack || !visited) {
+        free(stack);
+        free(visited);
+        return 1;
+    }
+
+    //entries in address order: 0x200 first, then the call targets
+    int result = 0;
+    for (uint32_t b = 0; b < analysis->blockCount && result == 0; b++) {
+        uint16_t start = analysis->blocks[b].start;
+        bool isEntry = start == STARTING_MEMORY_ADDRESS;
+        for (uint32_t e = 0; e < cfg->edgeCount && !isEntry; e++)
+            isEntry = cfg->edges[e].kind == EDGE_CALL && cfg->edges[e].to == start;
+        if (!isEntry)
+            continue;
+        Function* function = &cfg->functions[cfg->functionCount++];
+        function->entry = start;
+        result = findFunction(cfg, function, stack, visited);
+    }
+    free(stack);
+    free(visited);
+    return result;
+}
+
+static int findDiamonds(Cfg* cfg) {
+    const Chip8CodeAnalysis* analysis = cfg->analysis;
+    cfg->diamondCount = 0;
+    cfg->diamonds = malloc((analysis->blockCount + 1) * sizeof(Diamond));
+    if (!cfg->diamonds)
+        return 1;
+    for (uint32_t b = 0; b < analysis->blockCount; b++) {
+        Chip8InstructionInfo last = analyzeInstruction(cfg, analysis->blocks[b].last);
+        if (last.flow != CHIP8_FLOW_SKIP)
+            continue;
+        Chip8InstructionInfo conditional = analyzeInstruction(cfg, last.successors[0]);
+        if (conditional.flow == CHIP8_FLOW_NEXT && conditional.successors[0] == last.successors[1])
+            cfg->diamonds[cfg->diamondCount++] = (Diamond){last.address, conditional.address, last.successors[1]};
+    }
+    return 0;
+}
+
+static int findReferences(Cfg* cfg) {
+    const Chip8CodeAnalysis* analysis = cfg->analysis;
+    cfg->referenced = calloc(analysis->memorySize, 1);
+    if (!cfg->referenced)
+        return 1;
+    for (uint32_t b = 0; b < analysis->blockCount; b++) {
+        uint16_t address = analysis->blocks[b].start;
+        for (uint32_t i = 0; i < analysis->blocks[b].instructionCount; i++) {
+            Chip8InstructionInfo info = analyzeInstruction(cfg, address);
+            if (info.instruction.op == CHIP8_OP_LD_I)
+                cfg->referenced[info.instruction.nnn] = 1;
+            else if (info.instruction.op == CHIP8_OP_LD_I_LONG)
+                cfg->referenced[info.longAddress & (analysis->memorySize - 1)] = 1;
+            address = (uint16_t)(address + info.length);
+        }
+    }
+    return 0;
+}
+
+static void freeCfg(Cfg* cfg) {
+    for (uint32_t f = 0; cfg->functions && f < cfg->functionCount; f++)
+        free(cfg->functions[f].callees);
+    free(cfg->functions);
+    free(cfg->edges);
+    free(cfg->diamonds);
+    free(cfg->referenced);
+}
+
+static int buildCfg(Cfg* cfg, const Chip8CodeAnalysis* analysis) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->analysis = analysis;
+    if (findEdges(cfg) != 0 || findFunctions(cfg) != 0 || findDiamonds(cfg) != 0 || findReferences(cfg) != 0) {
+        fprintf(stderr, "[cfg] ERROR: failed to allocate the control-flow graph\n");
+        freeCfg(cfg);
+        return 1;
+    }
+    return 0;
+}
+
+//program bytes that no reachable instruction covers
+static uint32_t countDataBytes(const Chip8CodeAnalysis* analysis) {
+    uint32_t count = 0;
+    for (uint32_t address = STARTING_MEMORY_ADDRESS; address < analysis->programEnd; address++)
+        count += !(analysis->flags[address] & CHIP8_CODE_BYTE);
+    return count;
+}
+
+//first address past the run of data bytes starting at address
+static uint32_t dataRangeEnd(const Chip8CodeAnalysis* analysis, uint32_t address) {
+    while (address < analysis->programEnd && !(analysis->flags[address] & CHIP8_CODE_BYTE))
+        address++;
+    return address;
+}
+
+
+static void writeDot(const Cfg* cfg, FILE* out) {
+    const Chip8CodeAnalysis* analysis = cfg->analysis;
+    fprintf(out, "digraph cfg {\n");
+    fprintf(out, "    node [shape=box fontname=\"monospace\"];\n");
+    for (uint32_t b = 0; b < analysis->blockCount; b++) {
+        const Chip8BasicBlock* block = &analysis->blocks[b];
+        fprintf(out, "    b_%04X [label=\"0x%03X-0x%03X (%u)\\l", block->start, block->start, block->end, block->instructionCount);
+        uint16_t address = block->start;
+        for (uint32_t i = 0; i < block->instructionCount; i++) {
+            Chip8InstructionInfo info = analyzeInstruction(cfg, address);
+            char text[32];
+            chip8FormatInstruction(&info, text, sizeof(text));
+            fprintf(out, "%03X  %s\\l", address, text);
+            address = (uint16_t)(address + info.length);
+        }
+        fprintf(out, "\"];\n");
+    }
+    //targets outside the reachable code (addresses outside the program)
+    for (uint32_t e = 0; e < cfg->edgeCount; e++)
+        if (blockIndex(cfg, cfg->edges[e].to) < 0)
+            fprintf(out, "    b_%04X [label=\"0x%03X (outside the program)\" style=dashed];\n", cfg->edges[e].to, cfg->edges[e].to);
+    for (uint32_t e = 0; e < cfg->edgeCount; e++) {
+        const Edge* edge = &cfg->edges[e];
+        fprintf(out, "    b_%04X -> b_%04X [label=\"%s\"%s];\n",
+            analysis->blocks[edge->from].start, edge->to, edgeKindNames[edge->kind], edgeKindStyles[edge->kind]);
+    }
+    fprintf(out, "}\n");
+}
+
+static void writeCallGraph(const Cfg* cfg, FILE* out) {
+    fprintf(out, "digraph calls {\n");
+    fprintf(out, "    node [shape=box fontname=\"monospace\"];\n");
+    for (uint32_t f = 0; f < cfg->functionCount; f++) {
+        const Function* function = &cfg->functions[f];
+        fprintf(out, "    f_%04X [label=\"0x%03X\\n%u blocks, %u instructions\"];\n",
+            function->entry, function->entry, function->blockCount, function->instructionCount);
+    }
+    for (uint32_t f = 0; f < cfg->functionCount; f++)
+        for (uint32_t c = 0; c < cfg->functions[f].calleeCount; c++)
+            fprintf(out, "    f_%04X -> f_%04X;\n", cfg->functions[f].entry, cfg->functions[f].callees[c]);
+    fprintf(out, "}\n");
+}
+
+static void writeJson(const Cfg* cfg, const char* romPath, const char* profileName, FILE* out) {
+    const Chip8CodeAnalysis* analysis = cfg->analysis;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"rom\": \"");
+    for (const char* c = romPath; *c; c++)
+        fprintf(out, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    fprintf(out, "\",\n");
+    fprintf(out, "  \"hash\": \"%016llx\",\n", (unsigned long long)analysis->rom->hash);
+    fprintf(out, "  \"profile\": \"%s\",\n", profileName);
+    fprintf(out, "  \"programEnd\": %u,\n", analysis->programEnd);
+    fprintf(out, "  \"instructionCount\": %u,\n", analysis->instructionCount);
+    fprintf(out, "  \"codeBytes\": %u,\n", analysis->programEnd - STARTING_MEMORY_ADDRESS - countDataBytes(analysis));
+    fprintf(out, "  \"dataBytes\": %u,\n", countDataBytes(analysis));
+
+    fprintf(out, "  \"blocks\": [");
+    for (uint32_t b = 0; b < analysis->blockCount; b++) {
+        const Chip8BasicBlock* block = &analysis->blocks[b];
+        fprintf(out, "%s\n    {\"start\": %u, \"end\": %u, \"instructionCount\": %u, \"jumpTableEntry\": %s, \"instructions\": [",
+            b ? "," : "", block->start, block->end, block->instructionCount,
+            analysis->flags[block->start] & CHIP8_CODE_TABLE ? "true" : "false");
+        uint16_t address = block->start;
+        for (uint32_t i = 0; i < block->instructionCount; i++) {
+            Chip8InstructionInfo info = analyzeInstruction(cfg, address);
+            char text[32];
+            chip8FormatInstruction(&info, text, sizeof(text));
+            fprintf(out, "%s{\"address\": %u, \"opcode\": %u, \"text\": \"%s\"}", i ? ", " : "", address, info.opcode, text);
+            address = (uint16_t)(address + info.length);
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"edges\": [");
+    for (uint32_t e = 0; e < cfg->edgeCount; e++) {
+        const Edge* edge = &cfg->edges[e];
+        fprintf(out, "%s\n    {\"from\": %u, \"to\": %u, \"kind\": \"%s\", \"inProgram\": %s}", e ? "," : "",
+            analysis->blocks[edge->from].start, edge->to, edgeKindNames[edge->kind], blockIndex(cfg, edge->to) >= 0 ? "true" : "false");
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"functions\": [");
+    for (uint32_t f = 0; f < cfg->functionCount; f++) {
+        const Function* function = &cfg->functions[f];
+        fprintf(out, "%s\n    {\"entry\": %u, \"blockCount\": %u, \"instructionCount\": %u, \"calls\": [",
+            f ? "," : "", function->entry, function->blockCount, function->instructionCount);
+        for (uint32_t c = 0; c < function->calleeCount; c++)
+            fprintf(out, "%s%u", c ? ", " : "", function->callees[c]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"diamonds\": [");
+    for (uint32_t d = 0; d < cfg->diamondCount; d++)
+        fprintf(out, "%s\n    {\"skip\": %u, \"conditional\": %u, \"join\": %u}", d ? "," : "",
+            cfg->diamonds[d].skip, cfg->diamonds[d].conditional, cfg->diamonds[d].join);
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"jumpTables\": [");
+    bool first = true;
+    for (uint32_t b = 0; b < analysis->blockCount; b++) {
+        Chip8InstructionInfo last = analyzeInstruction(cfg, analysis->blocks[b].last);
+        if (last.flow != CHIP8_FLOW_INDIRECT)
+            continue;
+        fprintf(out, "%s\n    {\"jump\": %u, \"base\": %u, \"entryCount\": %u}", first ? "" : ",",
+            last.address, last.instruction.nnn, chip8JumpTableLength(analysis, last.instruction.nnn));
+        first = false;
+    }
+    fprintf(out, "\n  ],\n");
+
+    //data: the program bytes never reached as code, and whether a LD I points into them (sprites, tables)
+    fprintf(out, "  \"data\": [");
+    first = true;
+    for (uint32_t address = STARTING_MEMORY_ADDRESS; address < analysis->programEnd; address++) {
+        if (analysis->flags[address] & CHIP8_CODE_BYTE)
+            continue;
+        uint32_t end = dataRangeEnd(analysis, address);
+        bool referenced = false;
+        for (uint32_t a = address; a < end; a++)
+            referenced |= cfg->referenced[a] != 0;
+        fprintf(out, "%s\n    {\"start\": %u, \"end\": %u, \"referenced\": %s}", first ? "" : ",", address, end, referenced ? "true" : "false");
+        first = false;
+        address = end;
+    }
+    fprintf(out, "\n  ]\n");
+    fprintf(out, "}\n");
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr, "[cfg] ERROR: expected format: %s [--profile default|vip|schip|xochip] [--format dot|calls|json] <rom> [output]\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    int profile = CHIP8_PROFILE_DEFAULT;
+    const char* profileName = "default";
+    OutputFormat format = FORMAT_DOT;
+    const char* paths[2] = {NULL, NULL};
+    int pathCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profileName = argv[++i];
+            profile = chip8ProfileFromName(profileName);
+            if (profile < 0) {
+                fprintf(stderr, "[cfg] ERROR: unknown profile %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "dot") == 0)
+                format = FORMAT_DOT;
+            else if (strcmp(argv[i], "calls") == 0)
+                format = FORMAT_CALLS;
+            else if (strcmp(argv[i], "json") == 0)
+                format = FORMAT_JSON;
+            else {
+                fprintf(stderr, "[cfg] ERROR: unknown format %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (pathCount < 2 && argv[i][0] != '-')
+            paths[pathCount++] = argv[i];
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (pathCount < 1) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    const Chip8Rom* rom = chip8LoadRom(paths[0]);
+    if (!rom)
+        return 1;
+    Chip8CodeAnalysis analysis;
+    if (chip8AnalyzeCode(rom, (Chip8Profile)profile, &analysis) != 0)
+        return 1;
+    Cfg cfg;
+    if (buildCfg(&cfg, &analysis) != 0) {
+        chip8FreeCodeAnalysis(&analysis);
+        return 1;
+    }
+
+    FILE* out = paths[1] ? fopen(paths[1], "w") : stdout;
+    int result = 0;
+    if (!out) {
+        fprintf(stderr, "[cfg] ERROR: could not create %s\n", paths[1]);
+        result = 1;
+    }
+    else {
+        if (format == FORMAT_DOT)
+            writeDot(&cfg, out);
+        else if (format == FORMAT_CALLS)
+            writeCallGraph(&cfg, out);
+        else
+            writeJson(&cfg, paths[0], profileName, out);
+        if (out != stdout && fclose(out) != 0)
+            result = 1;
+    }
+
+    freeCfg(&cfg);
+    chip8FreeCodeAnalysis(&analysis);
+    return result;
+}
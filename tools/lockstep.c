@@ -0,0 +1,521 @@
+/* lockstep differential testing of the execution backends: two machines run the same ROM, each with its own backend,
+and are fed the same input. Every few frames, their complete states are compared (registers, stack, timers, RAM,
+screen, and the instruction count). On the first difference, both machines are replayed from the last comparison
+that matched: first a frame at a time, then one instruction at a time. The tool prints the first instruction after
+which the states differ, what differs, and the instructions that led there.
+
+    chip8_lockstep.out [--profile default|vip|schip|xochip] [--timing fixed|vip] [--frames N] [--interval N]
+                       [--slices N] [--window N] [--movie FILE | --random-input SEED] [--jit-threshold N]
+                       <backend> <backend> <rom>
+
+Backends:
+- interpreter
+- jit: the tiered execution of chip8_jit.h, blocks compiled after --jit-threshold entries (1 by default)
+- translated: the translation of the ROM for the profile. It is linked in with make lockstep TRANSLATIONS=file.c.
+
+A movie is a text file of "frame keys" lines, sorted by frame. keys is the hexadecimal keypad state (bit k: key k is
+pressed), held from that frame on. Lines starting with # are comments. Without a movie, no key is ever pressed.
+
+The program exits with 0 when the backends agree over the frames run */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <chip8.h>
+#include <chip8_internal.h>
+#include <chip8_analysis.h>
+#include <chip8_jit.h>
+
+//slices a frame is split into when replaying one instruction at a time: more than the instructions of a frame
+#define STEP_SLICES 1024
+#define MAX_REPORTED_DIFFERENCES 16
+
+typedef enum {
+    BACKEND_INTERPRETER,
+    BACKEND_JIT,
+    BACKEND_TRANSLATED,
+    BACKEND_COUNT
+} Backend;
+
+static const char* const backendNames[] = {
+    [BACKEND_INTERPRETER] = "interpreter",
+    [BACKEND_JIT] = "jit",
+    [BACKEND_TRANSLATED] = "translated"
+};
+
+typedef struct {
+    uint32_t frame;
+    uint16_t keys;
+} MovieEvent;
+
+typedef struct {
+    MovieEvent* events;
+    uint32_t eventCount;
+    bool random;
+    uint32_t seed;
+} Input;
+
+typedef struct {
+    uint64_t count; //instructions the machines had run before it
+    uint32_t frame;
+    uint16_t pc[2]; //of each machine
+    uint8_t bytes[4]; //at the first machine's PC
+} TraceEntry;
+
+typedef struct {
+    Backend backends[2];
+    const Input* input;
+    int slices;
+    int window;
+} Lockstep;
+
+
+static int backendFromName(const char* name) {
+    for (int i = 0; i < BACKEND_COUNT; i++)
+        if (strcmp(name, backendNames[i]) == 0)
+            return i;
+    return -1;
+}
+
+//returns 0 on success
+static int setBackend(Chip8State* s, Backend backend) {
+    const struct Chip8Jit* jit = s->jit;
+    const struct Chip8CompiledProgram* compiled = s->compiled;
+    s->jit = NULL;
+    s->compiled = NULL;
+    if (backend == BACKEND_JIT) {
+        if (!jit) {
+            fprintf(stderr, "[lockstep] ERROR: the jit backend needs the native code generator (x86-64 Linux, executable memory)\n");
+            return 1;
+        }
+        s->jit = (struct Chip8Jit*)jit;
+    }
+    else if (backend == BACKEND_TRANSLATED) {
+        if (!compiled) {
+            fprintf(stderr, "[lockstep] ERROR: no translation of the ROM for this profile is linked in (make lockstep TRANSLATIONS=...)\n");
+            return 1;
+        }
+        s->compiled = compiled;
+    }
+    if (backend != BACKEND_INTERPRETER && s->timing != CHIP8_TIMING_FIXED)
+        fprintf(stderr, "[lockstep] WARNING: %s only runs with the fixed timing, the VIP timing is interpreted\n", backendNames[backend]);
+    return 0;
+}
+
+
+//returns 0 on success; the events must be released with free
+static int loadMovie(const char* filepath, Input* input) {
+    FILE* fp = fopen(filepath, "r");
+    if (!fp) {
+        fprintf(stderr, "[lockstep] ERROR: could not open %s\n", filepath);
+        return 1;
+    }
+    uint32_t capacity = 0;
+    char line[256];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNumber++;
+        char* text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\n' || *text == '\r' || *text == '\0')
+            continue;
+        unsigned long frame;
+        unsigned int keys;
+        if (sscanf(text, "%lu %x", &frame, &keys) != 2 || keys > 0xFFFF || frame > UINT32_MAX
+            || (input->eventCount > 0 && frame < input->events[input->eventCount - 1].frame)) {
+            fprintf(stderr, "[lockstep] ERROR: %s:%d: expected \"frame keys\", frames in increasing order\n", filepath, lineNumber);
+            fclose(fp);
+            return 1;
+        }
+        if (input->eventCount == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            MovieEvent* events = realloc(input->events, capacity * sizeof(MovieEvent));
+            if (!events) {
+                fclose(fp);
+                return 1;
+            }
+            input->events = events;
+        }
+        input->events[input->eventCount++] = (MovieEvent){.frame = (uint32_t)frame, .keys = (uint16_t)keys};
+    }
+    fclose(fp);
+    return 0;
+}
+
+//keypad state during a frame: random input presses one key (or none) for 8 frames at a time
+static uint16_t keysAt(const Input* input, uint32_t frame) {
+    if (input->random) {
+        uint32_t hash = (frame / 8 + 1) * 0x9E3779B9u ^ input->seed;
+        hash ^= hash >> 16;
+        hash *= 0x85EBCA6Bu;
+        hash ^= hash >> 13;
+        return (hash & 3) == 0 ? 0 : (uint16_t)(1u << ((hash >> 8) & 15));
+    }
+    uint32_t low = 0, high = input->eventCount; //first event after the frame
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (input->events[middle].frame <= frame)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low == 0 ? 0 : input->events[low - 1].keys;
+}
+
+//returns 1 if the machine stopped on an error
+static int runFrame(Chip8State* s, const Input* input, uint32_t frame, int slices) {
+    chip8SetKeypad(s, keysAt(input, frame));
+    for (int slice = 0; slice < slices; slice++)
+        if (chip8RunFrameSlice(s, slice, slices) != 0)
+            return 1;
+    return 0;
+}
+
+
+//the field is named (printf-style) only when it differs
+#define COMPARE(a, b, ...) \
+    do { \
+        if ((a) != (b)) { \
+            if (out && differences < MAX_REPORTED_DIFFERENCES) { \
+                snprintf(name, sizeof(name), __VA_ARGS__); \
+                fprintf(out, "    %-16s 0x%llx | 0x%llx\n", name, (unsigned long long)(a), (unsigned long long)(b)); \
+            } \
+            differences++; \
+        } \
+    } while (0)
+
+/* returns the number of differences between the states of machines a and b, and prints the first ones to out (if not
+NULL). The bookkeeping of the tiers (executed and written lines, code writes) is not part of the state */
+static int compareMachines(const Chip8State* a, const Chip8State* b, FILE* out) {
+    int differences = 0;
+    char name[32];
+    for (int i = 0; i < 16; i++) {
+        COMPARE(a->V[i], b->V[i], "V%X", i);
+    }
+    COMPARE(a->I, b->I, "I");
+    COMPARE(a->PC, b->PC, "PC");
+    COMPARE(a->SP, b->SP, "SP");
+    for (int i = 0; i < STACK_SIZE && i < a->SP && i < b->SP; i++) {
+        COMPARE(a->stack[i], b->stack[i], "stack[%d]", i);
+    }
+    COMPARE(a->delay_timer, b->delay_timer, "delay timer");
+    COMPARE(a->sound_timer, b->sound_timer, "sound timer");
+    COMPARE(a->instructionCount, b->instructionCount, "instructions");
+    COMPARE(a->isHalted, b->isHalted, "halted");
+    COMPARE((uint8_t)a->keyPressedDuringHalt, (uint8_t)b->keyPressedDuringHalt, "halt key");
+    COMPARE(a->screenChanged, b->screenChanged, "screen changed");
+    COMPARE(a->rngState, b->rngState, "rng");
+    COMPARE(a->hires, b->hires, "hires");
+    COMPARE(a->waitingForVblank, b->waitingForVblank, "vblank wait");
+    COMPARE((uint32_t)a->cycleBudget, (uint32_t)b->cycleBudget, "cycle budget");
+    COMPARE(a->planeMask, b->planeMask, "plane mask");
+    COMPARE(a->planeCount, b->planeCount, "plane count");
+    COMPARE(a->pitch, b->pitch, "pitch");
+    for (int i = 0; i < 16; i++) {
+        COMPARE(a->rplFlags[i], b->rplFlags[i], "rpl[%d]", i);
+        COMPARE(a->audioPattern[i], b->audioPattern[i], "audio[%d]", i);
+    }
+
+    //pages still shared with the ROM image or with each other are equal
+    int pageCount = a->pageCount < b->pageCount ? a->pageCount : b->pageCount;
+    COMPARE(a->pageCount, b->pageCount, "pages");
+    for (int p = 0; p < pageCount; p++) {
+        if (a->pages[p] == b->pages[p] || memcmp(a->pages[p]->bytes, b->pages[p]->bytes, CHIP8_PAGE_SIZE) == 0)
+            continue;
+        for (int i = 0; i < CHIP8_PAGE_SIZE; i++)
+            COMPARE(a->pages[p]->bytes[i], b->pages[p]->bytes[i], "RAM[0x%03x]", p * CHIP8_PAGE_SIZE + i);
+    }
+
+    int planeCount = a->planeCount < b->planeCount ? a->planeCount : b->planeCount;
+    for (int p = 0; p < planeCount; p++) {
+        if (memcmp(a->screen[p], b->screen[p], sizeof(a->screen[p])) == 0)
+            continue;
+        for (int y = 0; y < CHIP8_HIRES_DISPLAY_HEIGHT; y++)
+            for (int w = 0; w < CHIP8_SCREEN_ROW_WORDS; w++)
+                COMPARE(a->screen[p][y][w], b->screen[p][y][w], "screen[%d][%d][%d]", p, y, w);
+    }
+
+    if (out && differences > MAX_REPORTED_DIFFERENCES)
+        fprintf(out, "    (and %d more)\n", differences - MAX_REPORTED_DIFFERENCES);
+    return differences;
+}
+
+
+static TraceEntry traceEntry(const Chip8State* a, const Chip8State* b, uint32_t frame) {
+    TraceEntry entry = {.count = a->instructionCount, .frame = frame, .pc = {a->PC, b->PC}};
+    for (int i = 0; i < 4; i++)
+        entry.bytes[i] = READ_MEMORY(a, (uint16_t)(a->PC + i));
+    return entry;
+}
+
+//the instruction is decoded from the machine's memory, which may no longer hold the ROM's code there
+static void printTraceEntry(const Lockstep* lockstep, const TraceEntry* entry, bool isLast) {
+    Chip8InstructionInfo info = {
+        .instruction = chip8DecodeInstruction(entry->bytes[0], entry->bytes[1]),
+        .opcode = (uint16_t)(entry->bytes[0] << 8 | entry->bytes[1]),
+        .longAddress = (uint16_t)(entry->bytes[2] << 8 | entry->bytes[3]),
+        .address = entry->pc[0]
+    };
+    char text[64];
+    chip8FormatInstruction(&info, text, sizeof(text));
+    printf("  %c frame %-6u #%-10llu 0x%03x  %04x  ", isLast ? '>' : ' ', entry->frame,
+        (unsigned long long)entry->count, entry->pc[0], info.opcode);
+    if (entry->pc[1] != entry->pc[0])
+        printf("%-20s  (%s at 0x%03x)\n", text, backendNames[lockstep->backends[1]], entry->pc[1]);
+    else
+        printf("%s\n", text);
+}
+
+static void printDifferences(const Lockstep* lockstep, const Chip8State* a, const Chip8State* b, int resultA, int resultB) {
+    printf("differences (%s | %s):\n", backendNames[lockstep->backends[0]], backendNames[lockstep->backends[1]]);
+    if (resultA != resultB)
+        printf("    %-16s %d | %d\n", "error", resultA, resultB);
+    compareMachines(a, b, stdout);
+}
+
+/* runs frame `frame` of machines a and b one instruction at a time, recording them in the trace (a ring of
+lockstep->window entries); returns true if they differ after one of them, which is then reported */
+static bool stepFrame(const Lockstep* lockstep, Chip8State* a, Chip8State* b, uint32_t frame, TraceEntry* trace, uint64_t* traced) {
+    uint16_t keys = keysAt(lockstep->input, frame);
+    chip8SetKeypad(a, keys);
+    chip8SetKeypad(b, keys);
+    for (int slice = 0; slice < STEP_SLICES; slice++) {
+        TraceEntry entry = traceEntry(a, b, frame);
+        int resultA = chip8RunFrameSlice(a, slice, STEP_SLICES);
+        int resultB = chip8RunFrameSlice(b, slice, STEP_SLICES);
+        if (a->instructionCount != entry.count || b->instructionCount != entry.count || resultA != 0)
+            trace[(*traced)++ % (uint64_t)lockstep->window] = entry;
+        if (resultA == resultB && compareMachines(a, b, NULL) == 0) {
+            if (resultA != 0)
+                return false; //both stopped on the same error
+            continue;
+        }
+
+        printf("[lockstep] %s and %s diverge at frame %u, after instruction %llu (PC 0x%03x):\n",
+            backendNames[lockstep->backends[0]], backendNames[lockstep->backends[1]], frame,
+            (unsigned long long)entry.count, entry.pc[0]);
+        uint64_t first = *traced > (uint64_t)lockstep->window ? *traced - (uint64_t)lockstep->window : 0;
+        printf("last instructions of %s:\n", backendNames[lockstep->backends[0]]);
+        for (uint64_t i = first; i < *traced; i++)
+            printTraceEntry(lockstep, &trace[i % (uint64_t)lockstep->window], i == *traced - 1);
+        printDifferences(lockstep, a, b, resultA, resultB);
+        return true;
+    }
+    return false;
+}
+
+/* replays machines a and b (copies of the last matching comparison, at the start of frame `from`) up to frame `to`,
+where they were found to differ, and reports where they first did */
+static void locateDivergence(const Lockstep* lockstep, const Chip8State* a, const Chip8State* b, uint32_t from, uint32_t to) {
+    Chip8State* replay[2] = {chip8Fork(a), chip8Fork(b)};
+    Chip8State* before[2] = {chip8Fork(a), chip8Fork(b)}; //state at the start of the frame being replayed
+    Chip8State* previous[2] = {chip8Fork(a), chip8Fork(b)}; //and of the frame before it
+    TraceEntry* trace = calloc((size_t)lockstep->window, sizeof(TraceEntry));
+    if (!replay[0] || !replay[1] || !before[0] || !before[1] || !previous[0] || !previous[1] || !trace) {
+        fprintf(stderr, "[lockstep] ERROR: out of memory\n");
+        goto cleanup;
+    }
+
+    //a frame at a time, to the first frame after which the machines differ
+    uint32_t frame = from;
+    int resultA = 0, resultB = 0;
+    for (; frame <= to; frame++) {
+        resultA = runFrame(replay[0], lockstep->input, frame, lockstep->slices);
+        resultB = runFrame(replay[1], lockstep->input, frame, lockstep->slices);
+        if (resultA != resultB || compareMachines(replay[0], replay[1], NULL) != 0)
+            break;
+        for (int m = 0; m < 2; m++) {
+            chip8CopyMachine(previous[m], before[m]);
+            chip8CopyMachine(before[m], replay[m]);
+        }
+    }
+    if (frame > to) {
+        printf("[lockstep] WARNING: the divergence found after frame %u did not happen again when replayed from frame %u\n", to, from);
+        goto cleanup;
+    }
+
+    //then one instruction at a time, from the frame before it for a longer trace
+    uint64_t traced = 0;
+    Chip8State** start = frame > from ? previous : before;
+    if (stepFrame(lockstep, start[0], start[1], frame > from ? frame - 1 : frame, trace, &traced))
+        goto cleanup;
+    if (frame > from && stepFrame(lockstep, start[0], start[1], frame, trace, &traced))
+        goto cleanup;
+    printf("[lockstep] %s and %s diverge at frame %u, but not when running one instruction at a time\n",
+        backendNames[lockstep->backends[0]], backendNames[lockstep->backends[1]], frame);
+    printDifferences(lockstep, replay[0], replay[1], resultA, resultB);
+
+cleanup:
+    free(trace);
+    for (int m = 0; m < 2; m++) {
+        if (replay[m])
+            chip8Free(replay[m]);
+        if (before[m])
+            chip8Free(before[m]);
+        if (previous[m])
+            chip8Free(previous[m]);
+    }
+}
+
+
+static void printUsage(const char* program) {
+    fprintf(stderr, "[lockstep] ERROR: expected format: %s [--profile default|vip|schip|xochip] [--timing fixed|vip] "
+        "[--frames N] [--interval N] [--slices N] [--window N] [--movie FILE | --random-input SEED] [--jit-threshold N] "
+        "<interpreter|jit|translated> <interpreter|jit|translated> <rom>\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    int profile = CHIP8_PROFILE_DEFAULT;
+    Chip8Timing timing = CHIP8_TIMING_FIXED;
+    long frames = 3600;
+    long interval = 60;
+    long slices = 1;
+    long window = 32;
+    long threshold = 1;
+    const char* moviePath = NULL;
+    Input input = {0};
+    const char* arguments[3] = {NULL, NULL, NULL};
+    int argumentCount = 0;
+    for (int i = 1; i < argc; i++) {
+        char* end = NULL;
+        if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile = chip8ProfileFromName(argv[++i]);
+            if (profile < 0) {
+                fprintf(stderr, "[lockstep] ERROR: unknown profile \"%s\" (expected default, vip, schip or xochip)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--timing") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "fixed") == 0)
+                timing = CHIP8_TIMING_FIXED;
+            else if (strcmp(argv[i], "vip") == 0)
+                timing = CHIP8_TIMING_VIP;
+            else {
+                fprintf(stderr, "[lockstep] ERROR: unknown timing \"%s\" (expected fixed or vip)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = strtol(argv[++i], &end, 10);
+        else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+            interval = strtol(argv[++i], &end, 10);
+        else if (strcmp(argv[i], "--slices") == 0 && i + 1 < argc)
+            slices = strtol(argv[++i], &end, 10);
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+            window = strtol(argv[++i], &end, 10);
+        else if (strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < argc)
+            threshold = strtol(argv[++i], &end, 10);
+        else if (strcmp(argv[i], "--movie") == 0 && i + 1 < argc)
+            moviePath = argv[++i];
+        else if (strcmp(argv[i], "--random-input") == 0 && i + 1 < argc) {
+            input.random = true;
+            input.seed = (uint32_t)strtoul(argv[++i], &end, 0);
+        }
+        else if (argv[i][0] != '-' && argumentCount < 3)
+            arguments[argumentCount++] = argv[i];
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (end && *end != '\0') {
+            fprintf(stderr, "[lockstep] ERROR: %s expects a number\n", argv[i - 1]);
+            return 1;
+        }
+    }
+    if (argumentCount < 3 || (moviePath && input.random)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (frames < 1 || frames > 1000000000L || interval < 1 || slices < 1 || slices > STEP_SLICES || window < 1
+        || window > 1 << 20 || threshold < 1 || threshold > 0xFFFF) {
+        fprintf(stderr, "[lockstep] ERROR: expected at least 1 frame, interval, window entry and JIT threshold, "
+            "and from 1 to %d slices\n", STEP_SLICES);
+        return 1;
+    }
+
+    Lockstep lockstep = {.input = &input, .slices = (int)slices, .window = (int)window};
+    for (int i = 0; i < 2; i++) {
+        int backend = backendFromName(arguments[i]);
+        if (backend < 0) {
+            fprintf(stderr, "[lockstep] ERROR: unknown backend \"%s\" (expected interpreter, jit or translated)\n", arguments[i]);
+            return 1;
+        }
+        lockstep.backends[i] = (Backend)backend;
+    }
+    if (moviePath && loadMovie(moviePath, &input) != 0) {
+        free(input.events);
+        return 1;
+    }
+    bool usesJit = lockstep.backends[0] == BACKEND_JIT || lockstep.backends[1] == BACKEND_JIT;
+    if (usesJit && chip8JitInit((int)threshold, NULL) != 0) {
+        free(input.events);
+        return 1;
+    }
+
+    int status = 1;
+    Chip8State* machines[2] = {NULL, NULL};
+    Chip8State* checkpoints[2] = {NULL, NULL}; //copies of the machines at the last comparison that matched
+    const Chip8Rom* rom = chip8LoadRom(arguments[2]);
+    if (!rom)
+        goto cleanup;
+    //the second machine is a fork of the first one: they start from the same state, random generator included
+    machines[0] = chip8CreateMachine(rom);
+    if (!machines[0])
+        goto cleanup;
+    chip8SetProfile(machines[0], (Chip8Profile)profile);
+    if (chip8SetTiming(machines[0], timing) != 0)
+        goto cleanup;
+    machines[1] = chip8Fork(machines[0]);
+    if (!machines[1])
+        goto cleanup;
+    for (int m = 0; m < 2; m++) {
+        if (setBackend(machines[m], lockstep.backends[m]) != 0)
+            goto cleanup;
+        checkpoints[m] = chip8Fork(machines[m]);
+        if (!checkpoints[m])
+            goto cleanup;
+    }
+
+    uint32_t checkpointFrame = 0;
+    uint32_t comparisons = 0;
+    uint32_t frame = 0;
+    for (; frame < (uint32_t)frames; frame++) {
+        int resultA = runFrame(machines[0], &input, frame, lockstep.slices);
+        int resultB = runFrame(machines[1], &input, frame, lockstep.slices);
+        if (resultA == resultB && (frame + 1) % (uint32_t)interval != 0 && frame + 1 < (uint32_t)frames && resultA == 0)
+            continue;
+
+        comparisons++;
+        if (resultA != resultB || compareMachines(machines[0], machines[1], NULL) != 0) {
+            locateDivergence(&lockstep, checkpoints[0], checkpoints[1], checkpointFrame, frame);
+            goto cleanup;
+        }
+        if (resultA != 0) {
+            printf("[lockstep] both machines stopped on an error at frame %u\n", frame);
+            frame++;
+            break;
+        }
+        for (int m = 0; m < 2; m++)
+            chip8CopyMachine(checkpoints[m], machines[m]);
+        checkpointFrame = frame + 1;
+    }
+    printf("[lockstep] %s and %s agree over %u frames (%llu instructions, %u comparisons)\n",
+        backendNames[lockstep.backends[0]], backendNames[lockstep.backends[1]], frame,
+        (unsigned long long)chip8GetInstructionCount(machines[0]), comparisons);
+    status = 0;
+
+cleanup:
+    for (int m = 0; m < 2; m++) {
+        if (machines[m])
+            chip8Free(machines[m]);
+        if (checkpoints[m])
+            chip8Free(checkpoints[m]);
+    }
+    if (usesJit)
+        chip8JitTerminate();
+    free(input.events);
+    return status;
+}
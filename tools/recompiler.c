@@ -0,0 +1,360 @@
+/* static recompiler: translates a CHIP-8 ROM into a C source file that runs it without decoding a single instruction.
+The code reachable from 0x200 is found by recursive descent (chip8_analysis.c); each reachable instruction becomes
+a labeled statement of one function, in address order, with gotos for the control flow. Instructions whose effects
+are complex (display, memory, input, random numbers) and instructions reached only through 00EE or BNNN at run
+time are run by the interpreter, as is everything once the program writes over its own translated code.
+
+Linking the output with the emulator (placing it in src/ is enough) makes every machine running that ROM with that
+profile use the translation:
+    chip8_recompiler.out [--profile default|vip|schip|xochip] <rom> <output.c> */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <chip8.h>
+#include <chip8_internal.h>
+#include <chip8_analysis.h>
+#include <chip8_compiled.h>
+
+static const char* const profileConstants[CHIP8_PROFILE_COUNT] = {
+    [CHIP8_PROFILE_DEFAULT] = "CHIP8_PROFILE_DEFAULT",
+    [CHIP8_PROFILE_VIP] = "CHIP8_PROFILE_VIP",
+    [CHIP8_PROFILE_SCHIP] = "CHIP8_PROFILE_SCHIP",
+    [CHIP8_PROFILE_XOCHIP] = "CHIP8_PROFILE_XOCHIP"
+};
+
+typedef struct {
+    FILE* fp;
+    const Chip8CodeAnalysis* analysis;
+    Chip8Quirks quirks;
+    bool usesDispatch; //the dispatch label is the target of a goto
+} Translation;
+
+
+static bool isInstruction(const Translation* t, uint16_t address) {
+    return address < t->analysis->memorySize && (t->analysis->flags[address] & CHIP8_CODE_INSTRUCTION);
+}
+
+//control goes to address: a translated instruction, or the interpreter through the dispatch switch
+static void emitGoto(Translation* t, uint16_t address) {
+    if (isInstruction(t, address))
+        fprintf(t->fp, "    goto L_%04X;\n", address);
+    else {
+        fprintf(t->fp, "    s->PC = 0x%04X;\n    goto dispatch;\n", address);
+        t->usesDispatch = true;
+    }
+}
+
+//control goes to address when condition (a C expression) holds, otherwise on to the next statement
+static void emitConditionalGoto(Translation* t, const char* condition, uint16_t address) {
+    if (isInstruction(t, address))
+        fprintf(t->fp, "    if (%s)\n        goto L_%04X;\n", condition, address);
+    else {
+        fprintf(t->fp, "    if (%s) {\n        s->PC = 0x%04X;\n        goto dispatch;\n    }\n", condition, address);
+        t->usesDispatch = true;
+    }
+}
+
+static void emitInterpret(Translation* t, uint16_t address) {
+    fprintf(t->fp, "    CHIP8_COMPILED_INTERPRET(0x%04X);\n", address);
+    t->usesDispatch = true;
+}
+
+//returns false when control never goes on to the next instruction
+static bool emitInstruction(Translation* t, const Chip8InstructionInfo* info) {
+    FILE* fp = t->fp;
+    const Chip8Quirks* q = &t->quirks;
+    uint16_t a = info->address;
+    int x = info->instruction.x;
+    int y = info->instruction.y;
+    int nn = info->instruction.nnn & 0xFF;
+    int nnn = info->instruction.nnn;
+
+    switch (info->instruction.op) {
+        //run by the interpreter
+        case CHIP8_OP_CLS:
+        case CHIP8_OP_RND:
+        case CHIP8_OP_DRW:
+        case CHIP8_OP_LD_VX_K:
+        case CHIP8_OP_LD_B:
+        case CHIP8_OP_LD_MEM_VX:
+        case CHIP8_OP_LD_VX_MEM:
+            emitInterpret(t, a);
+            return false;
+        case CHIP8_OP_SCD:
+        case CHIP8_OP_SCR:
+        case CHIP8_OP_SCL:
+        case CHIP8_OP_LOW:
+        case CHIP8_OP_HIGH:
+        case CHIP8_OP_LD_R_VX:
+        case CHIP8_OP_LD_VX_R:
+            if (!q->schip)
+                break; //ignored
+            emitInterpret(t, a);
+            return false;
+        case CHIP8_OP_SCU:
+        case CHIP8_OP_SAVE_RANGE:
+        case CHIP8_OP_LOAD_RANGE:
+        case CHIP8_OP_PLANE:
+        case CHIP8_OP_AUDIO:
+            if (!q->xochip)
+                break; //ignored
+            emitInterpret(t, a);
+            return false;
+        default:
+            break;
+    }
+
+    fprintf(fp, "    CHIP8_COMPILED_BEGIN(0x%04X);\n", a);
+    switch (info->instruction.op) {
+        case CHIP8_OP_RET:
+            fprintf(fp, "    if (s->SP == 0)\n        CHIP8_COMPILED_ERROR(0x%04X);\n", a);
+            fprintf(fp, "    s->SP--;\n    s->PC = s->stack[s->SP];\n    goto dispatch;\n");
+            t->usesDispatch = true;
+            return false;
+        case CHIP8_OP_JP:
+            emitGoto(t, info->successors[0]);
+            return false;
+        case CHIP8_OP_CALL:
+            fprintf(fp, "    if (s->SP >= STACK_SIZE)\n        CHIP8_COMPILED_ERROR(0x%04X);\n", a);
+            fprintf(fp, "    s->stack[s->SP++] = 0x%04X;\n", (uint16_t)(a + info->length));
+            emitGoto(t, info->successors[0]);
+            return false;
+        case CHIP8_OP_SE_IMM:
+        case CHIP8_OP_SNE_IMM:
+        case CHIP8_OP_SE_REG:
+        case CHIP8_OP_SNE_REG:
+        case CHIP8_OP_SKP:
+        case CHIP8_OP_SKNP: {
+            char condition[64];
+            switch (info->instruction.op) {
+                case CHIP8_OP_SE_IMM: snprintf(condition, sizeof(condition), "s->V[%d] == 0x%02X", x, nn); break;
+                case CHIP8_OP_SNE_IMM: snprintf(condition, sizeof(condition), "s->V[%d] != 0x%02X", x, nn); break;
+                case CHIP8_OP_SE_REG: snprintf(condition, sizeof(condition), "s->V[%d] == s->V[%d]", x, y); break;
+                case CHIP8_OP_SNE_REG: snprintf(condition, sizeof(condition), "s->V[%d] != s->V[%d]", x, y); break;
+                case CHIP8_OP_SKP: snprintf(condition, sizeof(condition), "(s->keypad >> (s->V[%d] & 0xF)) & 1", x); break;
+                default: snprintf(condition, sizeof(condition), "!((s->keypad >> (s->V[%d] & 0xF)) & 1)", x); break;
+            }
+            emitConditionalGoto(t, condition, info->successors[1]);
+            break;
+        }
+        case CHIP8_OP_LD_IMM:
+            fprintf(fp, "    s->V[%d] = 0x%02X;\n", x, nn);
+            break;
+        case CHIP8_OP_ADD_IMM:
+            fprintf(fp, "    s->V[%d] = (uint8_t)(s->V[%d] + 0x%02X);\n", x, x, nn);
+            break;
+        case CHIP8_OP_LD_REG:
+            fprintf(fp, "    s->V[%d] = s->V[%d];\n", x, y);
+            break;
+        case CHIP8_OP_OR:
+        case CHIP8_OP_AND:
+        case CHIP8_OP_XOR: {
+            char operator = info->instruction.op == CHIP8_OP_OR ? '|' : info->instruction.op == CHIP8_OP_AND ? '&' : '^';
+            fprintf(fp, "    s->V[%d] %c= s->V[%d];\n", x, operator, y);
+            if (q->vfReset)
+                fprintf(fp, "    s->V[15] = 0;\n");
+            break;
+        }
+        //the arithmetic instructions read their operands in the interpreter's order (it matters when X or Y is F)
+        case CHIP8_OP_ADD_REG:
+            fprintf(fp, "    {\n        unsigned result = (unsigned)s->V[%d] + s->V[%d];\n", x, y);
+            fprintf(fp, "        s->V[%d] = (uint8_t)result;\n        s->V[15] = result > 255 ? 1 : 0;\n    }\n", x);
+            break;
+        case CHIP8_OP_SUB:
+            fprintf(fp, "    {\n        uint8_t vx = s->V[%d];\n        s->V[%d] = (uint8_t)(vx - s->V[%d]);\n", x, x, y);
+            fprintf(fp, "        s->V[15] = vx >= s->V[%d] ? 1 : 0;\n    }\n", y);
+            break;
+        case CHIP8_OP_SUBN:
+            fprintf(fp, "    s->V[%d] = (uint8_t)(s->V[%d] - s->V[%d]);\n", x, y, x);
+            fprintf(fp, "    s->V[15] = s->V[%d] >= s->V[%d] ? 1 : 0;\n", y, x);
+            break;
+        case CHIP8_OP_SHR:
+        case CHIP8_OP_SHL: {
+            bool right = info->instruction.op == CHIP8_OP_SHR;
+            if (!q->shiftVx)
+                fprintf(fp, "    s->V[%d] = s->V[%d];\n", x, y);
+            fprintf(fp, "    {\n        uint8_t value = s->V[%d];\n", x);
+            fprintf(fp, right ? "        s->V[%d] = (uint8_t)(value >> 1);\n        s->V[15] = value & 1;\n    }\n"
+                              : "        s->V[%d] = (uint8_t)(value << 1);\n        s->V[15] = value >> 7;\n    }\n", x);
+            break;
+        }
+        case CHIP8_OP_LD_I:
+            fprintf(fp, "    s->I = 0x%03X;\n", nnn);
+            break;
+        case CHIP8_OP_JP_V0:
+            fprintf(fp, "    s->PC = (uint16_t)(0x%03X + s->V[%d]);\n    goto dispatch;\n", nnn, q->jumpVx ? x : 0);
+            t->usesDispatch = true;
+            return false;
+        case CHIP8_OP_LD_VX_DT:
+            fprintf(fp, "    s->V[%d] = s->delay_timer;\n", x);
+            break;
+        case CHIP8_OP_LD_DT_VX:
+            fprintf(fp, "    s->delay_timer = s->V[%d];\n", x);
+            break;
+        case CHIP8_OP_LD_ST_VX:
+            fprintf(fp, "    s->sound_timer = s->V[%d];\n", x);
+            break;
+        case CHIP8_OP_ADD_I:
+            fprintf(fp, "    s->I = (uint16_t)(s->I + s->V[%d]);\n", x);
+            break;
+        case CHIP8_OP_LD_F:
+            fprintf(fp, "    s->I = (uint16_t)(FONT_DATA_POSITION + (s->V[%d] & 0xF) * 5);\n", x);
+            break;
+        case CHIP8_OP_EXIT:
+            if (!q->schip)
+                break;
+            fprintf(fp, "    s->PC = 0x%04X;\n    return 0;\n", a);
+            return false;
+        case CHIP8_OP_LD_HF:
+            if (q->schip)
+                fprintf(fp, "    s->I = (uint16_t)(BIG_FONT_DATA_POSITION + (s->V[%d] & 0xF) * 10);\n", x);
+            break;
+        case CHIP8_OP_LD_I_LONG:
+            if (q->xochip) {
+                const Chip8Rom* rom = t->analysis->rom;
+                uint32_t mask = t->analysis->memorySize - 1;
+                uint32_t high = (a + 2u) & mask, low = (a + 3u) & mask;
+                fprintf(fp, "    s->I = 0x%04X;\n", (rom->pages[high >> CHIP8_PAGE_SHIFT]->bytes[high & (CHIP8_PAGE_SIZE - 1)] << 8)
+                    | rom->pages[low >> CHIP8_PAGE_SHIFT]->bytes[low & (CHIP8_PAGE_SIZE - 1)]);
+            }
+            break;
+        case CHIP8_OP_PITCH:
+            if (q->xochip)
+                fprintf(fp, "    s->pitch = s->V[%d];\n", x);
+            break;
+        default: //0NNN, undefined encodings and the instructions of other platforms are ignored
+            break;
+    }
+    return true;
+}
+
+static int translate(const Chip8CodeAnalysis* analysis, const char* romFilepath, const char* profileName, FILE* out) {
+    Translation t = {
+        .fp = tmpfile(),
+        .analysis = analysis,
+        .quirks = chip8ProfileQuirks[analysis->profile],
+        .usesDispatch = false
+    };
+    if (!t.fp) {
+        fprintf(stderr, "[recompiler] ERROR: could not create a temporary file\n");
+        return 1;
+    }
+
+    //the body: every reachable instruction in address order, falling through to the next one when it follows
+    int blocks = 0;
+    for (uint32_t address = 0; address < analysis->memorySize; address++) {
+        if (!(analysis->flags[address] & CHIP8_CODE_INSTRUCTION))
+            continue;
+        Chip8InstructionInfo info = chip8AnalyzeInstruction(analysis->rom, analysis->profile, (uint16_t)address);
+        if (analysis->flags[address] & CHIP8_CODE_LEADER) {
+            fprintf(t.fp, "\n    //block %d\n", blocks);
+            blocks++;
+        }
+        fprintf(t.fp, "L_%04X:\n", address);
+        if (!emitInstruction(&t, &info))
+            continue;
+        uint16_t next = info.successors[0];
+        bool nextIsEmittedNext = next == address + info.length && isInstruction(&t, next);
+        if (!nextIsEmittedNext)
+            emitGoto(&t, next);
+    }
+
+    fprintf(out, "/* translation of %s for the %s profile, generated by the CHIP-8 static recompiler (tools/recompiler.c):\n",
+        romFilepath, profileName);
+    fprintf(out, "%u instructions in %d basic blocks. Do not edit: generate it again instead */\n\n", analysis->instructionCount, blocks);
+    fprintf(out, "#include <stdint.h>\n\n#include <chip8_compiled.h>\n\n");
+
+    fprintf(out, "static const uint8_t codeMap[%u] = {", analysis->memorySize / 8);
+    for (uint32_t i = 0; i < analysis->memorySize / 8; i++) {
+        uint8_t bits = 0;
+        for (int b = 0; b < 8; b++)
+            bits |= (uint8_t)(((analysis->flags[i * 8 + b] & CHIP8_CODE_BYTE) ? 1 : 0) << b);
+        fprintf(out, "%s0x%02X%s", i % 16 == 0 ? "\n    " : "", bits, i + 1 < analysis->memorySize / 8 ? ", " : "\n");
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static int run(Chip8State* s, int budget) {\n");
+    if (t.usesDispatch)
+        fprintf(out, "dispatch:\n");
+    fprintf(out, "    switch (s->PC & s->addressMask) {\n");
+    for (uint32_t address = 0; address < analysis->memorySize; address++)
+        if (analysis->flags[address] & CHIP8_CODE_INSTRUCTION)
+            fprintf(out, "        case 0x%04X: goto L_%04X;\n", address, address);
+    fprintf(out, "        default: return chip8InterpretInstructions(s, budget); //not found statically (00EE or BNNN target)\n");
+    fprintf(out, "    }\n");
+
+    rewind(t.fp);
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), t.fp)) > 0)
+        fwrite(buffer, 1, read, out);
+    fclose(t.fp);
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "static Chip8CompiledProgram program = {\n");
+    fprintf(out, "    .romHash = 0x%016llXULL,\n", (unsigned long long)analysis->rom->hash);
+    fprintf(out, "    .profile = %s,\n", profileConstants[analysis->profile]);
+    fprintf(out, "    .version = CHIP8_COMPILED_VERSION,\n");
+    fprintf(out, "    .codeMap = codeMap,\n");
+    fprintf(out, "    .run = run,\n");
+    fprintf(out, "    .next = NULL\n};\n\n");
+    fprintf(out, "__attribute__((constructor)) static void registerProgram(void) {\n");
+    fprintf(out, "    chip8RegisterCompiledProgram(&program);\n}\n");
+    return 0;
+}
+
+static void printUsage(const char* program) {
+    fprintf(stderr, "[recompiler] ERROR: expected format: %s [--profile default|vip|schip|xochip] <rom> <output.c>\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    int profile = CHIP8_PROFILE_DEFAULT;
+    const char* profileName = "default";
+    const char* paths[2] = {NULL, NULL};
+    int pathCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profileName = argv[++i];
+            profile = chip8ProfileFromName(profileName);
+            if (profile < 0) {
+                fprintf(stderr, "[recompiler] ERROR: unknown profile %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (pathCount < 2 && argv[i][0] != '-')
+            paths[pathCount++] = argv[i];
+        else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (pathCount != 2) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    const Chip8Rom* rom = chip8LoadRom(paths[0]);
+    if (!rom)
+        return 1;
+    Chip8CodeAnalysis analysis;
+    if (chip8AnalyzeCode(rom, (Chip8Profile)profile, &analysis) != 0)
+        return 1;
+
+    FILE* out = fopen(paths[1], "w");
+    if (!out) {
+        fprintf(stderr, "[recompiler] ERROR: could not create %s\n", paths[1]);
+        chip8FreeCodeAnalysis(&analysis);
+        return 1;
+    }
+    int result = translate(&analysis, paths[0], profileName, out);
+    if (fclose(out) != 0)
+        result = 1;
+    chip8FreeCodeAnalysis(&analysis);
+    if (result == 0)
+        printf("[recompiler] %s: %u instructions translated to %s\n", paths[0], analysis.instructionCount, paths[1]);
+    return result;
+}